@@ -0,0 +1,173 @@
+/*
+ * INA219 continuous acquisition
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _ACQ_H_
+#define _ACQ_H_
+
+#include "energy.h"
+#include "hrtimer.h"
+#include "ina219.h"
+#include "list.h"
+#include "twi.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Sample of the INA219 data registers, raw register values
+ *
+ * The timestamp is the global counter when the sample was started. Convert
+ * the registers with ina219_measure() and the sensor's calibration, the
+ * bus voltage register keeps its CNVR and OVF flags.
+ */
+typedef struct acq_sample {
+    uint64_t        tstamp;
+    ina219_raw_t    raw;
+} acq_sample_t;
+
+/**
+ * Acquisition counters
+ *
+ * Stale counts polls that found no new conversion, overruns count sample
+ * periods skipped because the previous sample was still on the bus and
+ * errors count samples dropped on a failed transfer. Overflows count
+ * samples with the OVF flag set.
+ */
+typedef struct acq_stats {
+    uint32_t    samples;
+    uint32_t    stale;
+    uint32_t    overruns;
+    uint32_t    errors;
+    uint32_t    ovf;
+} acq_stats_t;
+
+struct acq_sensor;
+
+/**
+ * Called with each sample as it is stored, in interrupt context
+ */
+typedef void (* acq_sample_fn) (struct acq_sensor *sensor, const acq_sample_t *sample, void *data);
+
+/**
+ * Sensor acquired into its own ring
+ *
+ * Each sensor has its own descriptor so the reads of all sensors queue on
+ * the bus together and run back to back. Every sample is passed to the
+ * sensor's sample function, if it has one, as it is stored and then
+ * integrated into the sensor's energy accumulator, read it with
+ * energy_get() and the device calibration.
+ */
+typedef struct acq_sensor {
+    list_t              link;
+    ina219_t            *dev;
+    acq_sample_t        *ring;
+    uint32_t            size;
+    uint32_t            mask;
+    volatile uint32_t   head; // samples acquired
+    twi_xfer_t          xfer;
+    uint8_t             buf[3];
+    uint8_t             step;
+    bool                pace; // has the shortest conversion time
+    bool                retry; // polled early, poll again shortly
+    acq_sample_t        cur;
+    acq_stats_t         stats;
+    energy_t            energy;
+    acq_sample_fn       sample_fn;
+    void                *sample_data;
+} acq_sensor_t;
+
+/**
+ * Independent reader of a sensor's sample ring
+ *
+ * Each consumer keeps its own position so a slow one never holds up the
+ * acquisition or other consumers. Samples a reader falls more than the ring
+ * size behind on are overwritten and counted as dropped.
+ */
+typedef struct acq_reader {
+    acq_sensor_t    *sensor;
+    uint32_t        next; // sample count of the next sample to read
+    uint32_t        dropped;
+} acq_reader_t;
+
+
+/**
+ * Initialize acquisition with no sensors
+ */
+void acq_init (void);
+
+/**
+ * Add an INA219 acquired into a ring of samples, with sampling stopped
+ *
+ * The ring size is a number of samples and must be a power of two. The
+ * device's bus, address and configuration are used, the configuration sets
+ * the ADC resolution, averaging and mode and is written when sampling
+ * starts.
+ */
+void acq_add (acq_sensor_t *sensor, ina219_t *dev, acq_sample_t *ring, uint32_t size);
+
+/**
+ * Set or clear with NULL the function a sensor's samples are passed to as
+ * they are stored
+ *
+ * It runs in the I2C ISR on every sample, so it must be short, e.g. to
+ * update running statistics with wstat_add().
+ */
+void acq_set_sample_fn (acq_sensor_t *sensor, acq_sample_fn func, void *data);
+
+/**
+ * Start sampling all sensors, or stop
+ *
+ * Samples are started by a high resolution timer and the registers are
+ * read from I2C completion callbacks, so acquisition runs entirely in
+ * interrupt context. Each tick starts a sample on every sensor at once,
+ * the transfers queue on the bus so a pass over all sensors is one
+ * pipelined burst rather than a period per sensor. Only conversions a part
+ * flags as new are stored.
+ *
+ * With a rate the cadence is fixed and polls finding no new conversion
+ * count as stale. Past the rate the bus can sustain periods are skipped as
+ * overruns, the cadence of the rest is kept. With a rate of zero polling
+ * follows the shortest conversion time of the sensors, a poll of one of
+ * those sensors that is early is retried shortly after, which keeps the
+ * polls just behind the parts' conversions. In triggered modes the next
+ * conversion is started once a sample is read.
+ *
+ * Returns false if there are no sensors, a configuration write failed, an
+ * ADC is off or the period, from the rate or the shortest conversion time,
+ * is shorter than the bus time of reading every sensor on the busiest bus.
+ */
+bool acq_start (uint32_t rate_hz);
+void acq_stop (void);
+
+/**
+ * Position a reader at the next sample to be acquired from a sensor
+ */
+void acq_reader_init (acq_reader_t *reader, acq_sensor_t *sensor);
+
+/**
+ * Number of samples waiting for a reader, at most the ring size
+ */
+uint32_t acq_available (acq_reader_t *reader);
+
+/**
+ * Copy out a reader's next sample, returns false if there is none
+ */
+bool acq_read (acq_reader_t *reader, acq_sample_t *sample);
+
+/**
+ * Copy out a sensor's newest sample, returns false if there is none yet
+ */
+bool acq_latest (acq_sensor_t *sensor, acq_sample_t *sample);
+
+/**
+ * Acquisition counters of a sensor, and a dump of all sensors
+ */
+void acq_get_stats (acq_sensor_t *sensor, acq_stats_t *stats);
+void acq_stats_dump (void);
+
+
+#endif // _ACQ_H_
@@ -0,0 +1,109 @@
+/*
+ * INA219 energy and charge accumulation
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+#include "gcnt.h"
+#include "ina219.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Register LSB times global counter cycles in an LSB hour
+ */
+#define ENERGY_CLKS_PER_HOUR    ((uint64_t)GCNT_HZ * 3600)
+
+/**
+ * Q31.32 to an integer count of a unit scaled by k, e.g. Wh to uWh with
+ * 1000000, rounded down
+ */
+#define ENERGY_Q32_SCALE(q, k)  (((q) >> 32) * (k) + ((((q) & 0xffffffff) * (k)) >> 32))
+
+/**
+ * Running integral of a register over global counter time
+ *
+ * Held as whole LSB hours plus LSB cycles short of the next hour, so the
+ * per sample update is a multiply, an add and a compare and the total does
+ * not wrap for as long as the hours count doesn't.
+ */
+typedef struct energy_sum {
+    int64_t     hours;
+    int64_t     clks;
+} energy_sum_t;
+
+/**
+ * Energy and charge accumulator of one sensor
+ *
+ * Each sample's power and current are held over the interval since the
+ * previous sample, as the part's ADC measures over the conversion before
+ * the sample is read. Totals run from init, an epoch runs from the last
+ * epoch start and keeps its own peak power.
+ */
+typedef struct energy {
+    uint64_t        last; // timestamp of the previous sample
+    bool            valid; // last is set
+    energy_sum_t    energy; // power register
+    energy_sum_t    charge; // current register
+    energy_sum_t    epoch_energy; // totals at the epoch start
+    energy_sum_t    epoch_charge;
+    uint64_t        epoch_start;
+    bool            epoch_pending; // starts at the next sample
+    int32_t         peak; // signed power register of the largest magnitude
+    uint64_t        peak_tstamp;
+} energy_t;
+
+/**
+ * Totals converted with a calibration
+ *
+ * Energy is Q31.32 Wh and charge Q31.32 mAh, following the W and mA of
+ * the Q15.16 measurements. The peak power is Q15.16 W. The epoch length is
+ * from its start to the last sample, in global counter cycles.
+ */
+typedef struct energy_report {
+    int64_t     total_wh;
+    int64_t     total_mah;
+    int64_t     epoch_wh;
+    int64_t     epoch_mah;
+    int32_t     epoch_peak_w;
+    uint64_t    epoch_peak_tstamp;
+    uint64_t    epoch_clks;
+} energy_report_t;
+
+
+/**
+ * Zero the totals and start an epoch
+ */
+void energy_init (energy_t *e);
+
+/**
+ * Add a sample at a global counter timestamp
+ *
+ * Runs in the acquisition ISR. The first sample after init or a restart
+ * only sets the start of the next interval.
+ */
+void energy_update (energy_t *e, uint64_t tstamp, uint16_t power_reg, uint16_t current_reg);
+
+/**
+ * Forget the previous sample, for a gap in acquisition that should not be
+ * integrated over
+ */
+void energy_restart (energy_t *e);
+
+/**
+ * Start a new epoch at the last sample, the totals keep running
+ */
+void energy_epoch (energy_t *e);
+
+/**
+ * Copy out the totals, converted with the calibration they were taken with
+ */
+void energy_get (energy_t *e, const ina219_cal_t *cal, energy_report_t *report);
+
+
+#endif // _ENERGY_H_
@@ -0,0 +1,189 @@
+/*
+ * Fixed point decimation filters
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _FILT_H_
+#define _FILT_H_
+
+#include "list.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Fraction bits of the samples between stages and out of a chain
+ */
+#define FILT_FRAC           8
+
+/**
+ * Largest input magnitude, e.g. a signed INA219 power register
+ */
+#define FILT_IN_MAX         65535
+
+/**
+ * Largest CIC order, and the bits its gain may take, so its registers
+ * hold the input times the gain in 32 bits
+ */
+#define FILT_CIC_ORDER_MAX  4
+#define FILT_CIC_GAIN_BITS  15
+
+/**
+ * Output of a chain to Q15.16 units with a Q0.32 unit per input LSB, as
+ * the scales of the INA219 calibration
+ */
+#define FILT_Q16(val, scale)    ((int32_t)(((int64_t)(val) * (scale) + (1LL << 23)) >> 24))
+
+/**
+ * Stage types
+ */
+typedef enum filt_type {
+    FILT_CIC,
+    FILT_FIR,
+    FILT_BIQUAD,
+} filt_type_t;
+
+/**
+ * Common part of a stage, linked into a chain
+ *
+ * A stage takes every sample from the stage before it and passes on one in
+ * decim.
+ */
+typedef struct filt_stage {
+    list_t      link;
+    uint8_t     type;
+    uint16_t    decim;
+    uint16_t    phase;
+} filt_stage_t;
+
+/**
+ * Cascaded integrator comb, decimating by a power of two with no multiplies
+ *
+ * The first stage of a chain only, it takes the integer input and passes
+ * on the mean over its window with FILT_FRAC fraction bits.
+ */
+typedef struct filt_cic {
+    filt_stage_t    stage;
+    uint8_t         order;
+    int8_t          shift; // right shift from the gain to the output
+    uint32_t        integ[FILT_CIC_ORDER_MAX];
+    uint32_t        comb[FILT_CIC_ORDER_MAX];
+} filt_cic_t;
+
+/**
+ * FIR with Q1.15 coefficients, of unity DC gain if they sum to 32768
+ *
+ * The history is a buffer of twice the taps so the newest taps samples are
+ * always contiguous. Only the samples passed on are computed, symmetric
+ * coefficients, as of a linear phase filter, are folded to halve the
+ * multiplies.
+ */
+typedef struct filt_fir {
+    filt_stage_t    stage;
+    const int16_t   *coef;
+    uint16_t        taps;
+    uint16_t        pos;
+    bool            symmetric;
+    int32_t         *hist;
+} filt_fir_t;
+
+/**
+ * Biquad coefficients, Q2.30 with a0 of one
+ *
+ * y = b0 x + b1 x1 + b2 x2 - a1 y1 - a2 y2
+ */
+typedef struct filt_biquad_coef {
+    int32_t     b0;
+    int32_t     b1;
+    int32_t     b2;
+    int32_t     a1;
+    int32_t     a2;
+} filt_biquad_coef_t;
+
+/**
+ * Direct form I biquad IIR
+ *
+ * It runs on every sample it takes, so it belongs after the stages that
+ * decimate. The rounding error of each output is fed into the next, which
+ * keeps a low cutoff filter from sticking short of its input.
+ */
+typedef struct filt_biquad {
+    filt_stage_t        stage;
+    filt_biquad_coef_t  coef;
+    int32_t             x1, x2;
+    int32_t             y1, y2;
+    int32_t             err;
+} filt_biquad_t;
+
+/**
+ * Chain of stages of one channel
+ */
+typedef struct filt_chain {
+    list_t      stages;
+    uint32_t    decim; // of all stages
+    bool        cic; // the first stage takes the integer input
+    uint32_t    in; // samples pushed
+    uint32_t    out; // samples out
+} filt_chain_t;
+
+
+/**
+ * Lowpass FIR for decimating by two, 15 taps Hamming windowed to 0.2 of
+ * the input rate
+ */
+extern const int16_t filt_fir_lp15[15];
+
+/**
+ * Butterworth lowpass biquad at 0.1 of its input rate
+ */
+extern const filt_biquad_coef_t filt_biquad_lp10;
+
+
+/**
+ * Initialize a chain with no stages, which passes every sample
+ */
+void filt_chain_init (filt_chain_t *chain);
+
+/**
+ * Initialize a CIC stage, decim a power of two whose order-th power is at
+ * most 2^FILT_CIC_GAIN_BITS
+ */
+void filt_cic_init (filt_cic_t *cic, uint8_t order, uint16_t decim);
+
+/**
+ * Initialize an FIR stage with a history of 2 * taps samples
+ */
+void filt_fir_init (filt_fir_t *fir, const int16_t *coef, uint16_t taps, uint16_t decim, int32_t *hist);
+
+/**
+ * Initialize a biquad stage
+ */
+void filt_biquad_init (filt_biquad_t *bq, const filt_biquad_coef_t *coef, uint16_t decim);
+
+/**
+ * Append a stage to a chain, before any samples are pushed
+ */
+void filt_chain_add (filt_chain_t *chain, filt_stage_t *stage);
+
+/**
+ * Clear the state of a chain's stages, for a gap in its input
+ */
+void filt_chain_reset (filt_chain_t *chain);
+
+/**
+ * Push a sample of magnitude at most FILT_IN_MAX through a chain
+ *
+ * Returns true with a sample in out, with FILT_FRAC fraction bits, on
+ * every decim-th sample. Safe to call from an ISR.
+ */
+bool filt_push (filt_chain_t *chain, int32_t in, int32_t *out);
+
+/**
+ * Log the cycles per input sample of each stage type and a chain of them
+ */
+void filt_bench (void);
+
+
+#endif // _FILT_H_
@@ -0,0 +1,96 @@
+/*
+ * High resolution timer services
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _HRTIMER_H_
+#define _HRTIMER_H_
+
+#include "util.h"
+#include "list.h"
+
+
+/**
+ * High resolution timer config
+ *
+ * Deadlines are kept in global counter cycles. HRTIMER_PIT is armed as a
+ * one-shot for the earliest deadline. Microsecond deadlines need a PIT
+ * counting core clocks, the build fails if the BSP has it prescaled. PIT4
+ * is prescaled by FIT1 in system.xml, so the MCS core must be regenerated
+ * with it unprescaled and system.xml re-exported before the firmware
+ * builds. Timers due within HRTIMER_SLACK_CLKS of the ISR running are
+ * expired in the same interrupt rather than re-arming the PIT for a
+ * handful of cycles.
+ */
+#ifndef HRTIMER_PIT
+#define HRTIMER_PIT                 4
+#endif
+#ifndef HRTIMER_PIT_CLKS_PER_COUNT
+#define HRTIMER_PIT_CLKS_PER_COUNT  PIT_CLKS_PER_COUNT(HRTIMER_PIT)
+#endif
+#ifndef HRTIMER_SLACK_CLKS
+#define HRTIMER_SLACK_CLKS          (2 * GCNT_TICKS_PER_US)
+#endif
+
+#define HRTIMER_US_TO_CLKS(us)      ((uint64_t)(us) * GCNT_TICKS_PER_US)
+#define HRTIMER_CLKS_TO_US(c)       ((c) / GCNT_TICKS_PER_US)
+
+
+/**
+ * High resolution timer callback function
+ */
+typedef void (* hrtimer_fn) (void *data);
+
+
+/**
+ * High resolution timer structure
+ */
+typedef struct hrtimer_t {
+    list_t      link; // must be first entry
+    uint64_t    deadline;
+    uint32_t    lateness;
+    hrtimer_fn  func;
+    void        *data;
+} hrtimer_t;
+
+
+/**
+ * Initialize high resolution timer services
+ */
+void hrtimer_svc_init (void);
+
+/**
+ * Initialize a high resolution timer
+ */
+void hrtimer_init (hrtimer_t *timer, hrtimer_fn func, void *data);
+
+/**
+ * Schedule a timer to expire in a number of microseconds
+ */
+void hrtimer_start (hrtimer_t *timer, uint32_t us);
+
+/**
+ * Schedule a timer to expire at an absolute global counter value
+ */
+void hrtimer_start_at (hrtimer_t *timer, uint64_t deadline);
+
+/**
+ * Cancel a scheduled timer
+ */
+void hrtimer_cancel (hrtimer_t *timer);
+
+/**
+ * Get the lateness in cycles of the last expiry of a timer
+ *
+ * Lateness is measured from the deadline to the callback being invoked.
+ */
+uint32_t hrtimer_get_lateness (hrtimer_t *timer);
+
+/**
+ * Get the worst lateness in cycles seen by any timer since init
+ */
+uint32_t hrtimer_get_max_lateness (void);
+
+
+#endif // _HRTIMER_H_
@@ -9,6 +9,8 @@
 
 #include "xparameters.h"
 #include "xiomodule.h"
+#include "pt.h"
+#include "twi.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -17,11 +19,20 @@
 #ifndef INA219_ADDR
 #define INA219_ADDR         64
 #endif
-#ifndef INA219_CALIB
-#define INA219_CALIB        4096
+#ifndef INA219_I2C_FREQ
+#define INA219_I2C_FREQ     TWI_FREQ
 #endif
-#ifndef INA219_TIMEOUT_MS
-#define INA219_TIMEOUT_MS   100
+#ifndef INA219_SHUNT_UOHM
+#define INA219_SHUNT_UOHM   100000      // 0.1 ohm
+#endif
+#ifndef INA219_CURRENT_LSB_NA
+#define INA219_CURRENT_LSB_NA 100000    // 100 uA, 3.2 A full scale
+#endif
+#ifndef INA219_CONFIG
+#define INA219_CONFIG       (INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | \
+                             INA219_CFG_BADC(INA219_ADC_12BIT) | \
+                             INA219_CFG_SADC(INA219_ADC_12BIT) | \
+                             INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT))
 #endif
 
 
@@ -35,22 +46,277 @@ enum ina219_reg {
     REG_MAX,
 };
 
+/*
+ * Configuration register fields
+ *
+ * PG selects the shunt voltage range, 40 mV << pg. BADC and SADC take an
+ * ina219_adc setting, resolution or the number of 12-bit samples averaged.
+ */
+#define INA219_CFG_RST          (1 << 15)
+#define INA219_CFG_BRNG_16V     (0 << 13)
+#define INA219_CFG_BRNG_32V     (1 << 13)
+#define INA219_CFG_PG(pg)       (((pg) & 0x3) << 11)
+#define INA219_CFG_BADC(adc)    (((adc) & 0xf) << 7)
+#define INA219_CFG_SADC(adc)    (((adc) & 0xf) << 3)
+#define INA219_CFG_MODE(mode)   ((mode) & 0x7)
+
+#define INA219_CFG_GET_BADC(c)  (((c) >> 7) & 0xf)
+#define INA219_CFG_GET_SADC(c)  (((c) >> 3) & 0xf)
+#define INA219_CFG_GET_MODE(c)  ((c) & 0x7)
+
+enum ina219_adc {
+    INA219_ADC_9BIT = 0x0,
+    INA219_ADC_10BIT,
+    INA219_ADC_11BIT,
+    INA219_ADC_12BIT,
+    INA219_ADC_AVG2 = 0x9,
+    INA219_ADC_AVG4,
+    INA219_ADC_AVG8,
+    INA219_ADC_AVG16,
+    INA219_ADC_AVG32,
+    INA219_ADC_AVG64,
+    INA219_ADC_AVG128,
+};
+
+/*
+ * Operating modes, triggered modes convert once per configuration write
+ */
+enum ina219_mode {
+    INA219_MODE_POWER_DOWN,
+    INA219_MODE_SHUNT_TRIG,
+    INA219_MODE_BUS_TRIG,
+    INA219_MODE_SHUNT_BUS_TRIG,
+    INA219_MODE_ADC_OFF,
+    INA219_MODE_SHUNT_CONT,
+    INA219_MODE_BUS_CONT,
+    INA219_MODE_SHUNT_BUS_CONT,
+};
+
+#define INA219_MODE_SHUNT       0x1
+#define INA219_MODE_BUS         0x2
+#define INA219_MODE_CONT        0x4
+
+/*
+ * Bus voltage register flags
+ *
+ * CNVR is set when a conversion has finished and the data registers hold
+ * its results, it is cleared by reading the power register or writing the
+ * configuration. OVF is set when the current or power calculation
+ * overflowed.
+ */
+#define INA219_BUSV_CNVR        (1 << 1)
+#define INA219_BUSV_OVF         (1 << 0)
+
+/*
+ * Calibration register for a current LSB and shunt, 0.04096 / (LSB * R)
+ * with the LSB in nA and the shunt in uohm. Bit 0 is not implemented.
+ */
+#define INA219_CAL_K                40960000000000ULL
+#define INA219_CAL_REG(lsb_na, uohm) \
+    ((uint16_t)(INA219_CAL_K / ((uint64_t)(lsb_na) * (uohm))) & 0xfffe)
+
+#define INA219_CALIB        INA219_CAL_REG(INA219_CURRENT_LSB_NA, INA219_SHUNT_UOHM)
+
+/*
+ * Calibration model
+ *
+ * The calibration register is truncated, so the current LSB is taken back
+ * from the register value rather than the one asked for. The scales are
+ * the unit per register LSB as a fraction of 2^32: mA for current and W
+ * for power, whose LSB is 20 current LSBs.
+ */
+typedef struct ina219_cal {
+    uint32_t    shunt_uohm;
+    uint32_t    current_lsb_pa;
+    uint32_t    current_scale;
+    uint32_t    power_scale;
+    uint16_t    calib; // register value
+} ina219_cal_t;
+
+/*
+ * Raw result registers of one sample
+ */
+typedef struct ina219_raw {
+    uint16_t    shuntv;
+    uint16_t    busv;
+    uint16_t    power;
+    uint16_t    current;
+} ina219_raw_t;
+
+/*
+ * Sample in Q15.16: bus voltage in V, shunt voltage in mV, current in mA
+ * and power in W, units that hold each register's full range. Power takes
+ * the sign of the current of the same sample. OVF is the bus voltage
+ * register flag of the same sample.
+ */
+typedef struct ina219_meas {
+    int32_t     busv;
+    int32_t     shuntv;
+    int32_t     current;
+    int32_t     power;
+    bool        ovf;
+} ina219_meas_t;
+
+/*
+ * Q0.32 V per LSB of the bus voltage register shifted past its flags and
+ * mV per LSB of the shunt voltage register, 4 mV and 10 uV
+ */
+#define INA219_BUSV_SCALE       17179869
+#define INA219_SHUNTV_SCALE     42949673
+
+/*
+ * Q15.16 to thousandths, V to mV, mA to uA or W to mW, rounded
+ */
+#define INA219_Q16_MILLI(q)     ((int32_t)(((int64_t)(q) * 1000 + (1 << 15)) >> 16))
+
+/*
+ * Addresses an INA219 can be strapped to with A0 and A1
+ */
+#define INA219_ADDR_MIN     0x40
+#define INA219_ADDR_MAX     0x4f
+
+/*
+ * INA219 device instance
+ *
+ * Each part on a board has its own controller, address, configuration and
+ * calibration, and its own descriptor so blocking access to different
+ * parts never shares state. The buffer holds the register pointer and the
+ * register value.
+ */
+typedef struct ina219 {
+    twi_bus_t   *bus;
+    uint8_t     addr;
+    uint16_t    config;
+    ina219_cal_t cal;
+    twi_xfer_t  xfer;
+    uint8_t     buf[3];
+} ina219_t;
+
+/*
+ * Compute a calibration for a shunt and the largest current expected, the
+ * current LSB is the smallest that covers it. Returns false if the
+ * calibration register can't hold the result or the current is beyond
+ * the 32 A the Q15.16 mA output holds.
+ */
+bool ina219_calibrate(ina219_cal_t *cal, uint32_t shunt_uohm, uint32_t max_ua);
+
+/*
+ * Compute a calibration for a shunt and a chosen current LSB
+ */
+bool ina219_calibrate_lsb(ina219_cal_t *cal, uint32_t shunt_uohm, uint32_t current_lsb_na);
+
+/*
+ * Initialize a device instance with the default configuration and
+ * calibration, NULL bus for the default controller. Change config and
+ * recalibrate before ina219_dev_setup() for a part on a different rail.
+ */
+void ina219_dev_init(ina219_t *dev, twi_bus_t *bus, uint8_t i2c_addr);
+
+/*
+ * Set the device bus speed and write the configuration and calibration,
+ * returns false if a transfer failed or the calibration did not read back
+ */
+bool ina219_dev_setup(ina219_t *dev);
+
+/*
+ * Blocking register access on a device instance, returns false if the
+ * transfer failed
+ */
+bool ina219_dev_read(ina219_t *dev, uint8_t reg_addr, uint16_t *val);
+
+bool ina219_dev_write(ina219_t *dev, uint8_t reg_addr, uint16_t val);
+
+/*
+ * Read the result registers of one sample, the power register last as
+ * reading it clears CNVR. The part has no register auto-increment so this
+ * is one transaction per register, the minimum for a sample.
+ */
+bool ina219_dev_sample(ina219_t *dev, ina219_raw_t *raw);
+
+/*
+ * Read and convert one sample
+ */
+bool ina219_dev_measure(ina219_t *dev, ina219_meas_t *meas);
+
+/*
+ * Probe each INA219 address on a controller and initialize an instance for
+ * each part that acknowledges, up to max. Returns the number found.
+ */
+uint8_t ina219_scan(twi_bus_t *bus, ina219_t *devs, uint8_t max);
+
+/*
+ * Select the controller for the blocking functions taking an address, NULL
+ * for the default one. Call before ina219_init(), which sets the device
+ * bus speed.
+ */
+void ina219_set_bus(twi_bus_t *bus);
+
 bool ina219_init(uint8_t i2c_addr);
 
-void ina219_set_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t val);
+/*
+ * Write the configuration register, which also starts a conversion
+ */
+bool ina219_configure(uint8_t i2c_addr, uint16_t config);
+
+/*
+ * Time in us for a conversion cycle with a configuration, both ADC
+ * conversions in shunt and bus mode, zero with the ADC off
+ */
+uint32_t ina219_conv_us(uint16_t config);
+
+/*
+ * Blocking register access, returns false if the transfer failed. A device
+ * that stops responding fails after the TWI transfer timeout.
+ */
+bool ina219_set_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t val);
+
+bool ina219_read_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t *val);
 
+/*
+ * Register value, zero if the read failed
+ */
 uint16_t ina219_get_reg(uint8_t i2c_addr, uint8_t reg_addr);
 
 /*
- * TODO convert to Q15.16
+ * Coroutine register access
+ *
+ * Set bus, i2c_addr and reg (and value for writes) then PT_SPAWN() the
+ * coroutine on ctx->pt. Reads leave the register value in value. Register
+ * access runs at TWI_PRIO_HIGH, ahead of display traffic. The transfer
+ * status is left in status, value is only updated on TWI_XFER_OK.
  */
+typedef struct ina219_pt {
+    struct pt   pt;
+    twi_pt_t    twi;
+    twi_bus_t   *bus;
+    uint8_t     i2c_addr;
+    uint8_t     reg;
+    uint16_t    value;
+    uint8_t     status;
+    uint8_t     buf[3];
+} ina219_pt_t;
 
-uint16_t ina219_get_busv(uint8_t i2c_addr);
+PT_THREAD(ina219_get_reg_pt(ina219_pt_t *ctx));
 
-int32_t ina219_get_shuntv(uint8_t i2c_addr);
+PT_THREAD(ina219_set_reg_pt(ina219_pt_t *ctx));
+
+/*
+ * Register conversions to Q15.16, see ina219_meas_t for the units. The
+ * current register needs the calibration it was measured with.
+ */
+int32_t ina219_busv_q16(uint16_t reg);
 
-int32_t ina219_get_current(uint8_t i2c_addr);
+int32_t ina219_shuntv_q16(uint16_t reg);
 
-int32_t ina219_get_power(uint8_t i2c_addr);
+int32_t ina219_current_q16(const ina219_cal_t *cal, uint16_t reg);
+
+int32_t ina219_power_q16(const ina219_cal_t *cal, uint16_t reg, uint16_t current_reg);
+
+void ina219_measure(const ina219_cal_t *cal, const ina219_raw_t *raw, ina219_meas_t *meas);
+
+/*
+ * Read and convert one sample with the default calibration
+ */
+bool ina219_get_measure(uint8_t i2c_addr, ina219_meas_t *meas);
 
 #endif /* __INA219_H__ */
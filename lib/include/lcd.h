@@ -7,6 +7,8 @@
 #ifndef _LCD_H_
 #define _LCD_H_
 
+#include "pt.h"
+#include "twi.h"
 #include <stdint.h>
 
 
@@ -20,6 +22,9 @@
 #ifndef LCD_I2C_ADDR
 #define LCD_I2C_ADDR            0x27
 #endif
+#ifndef LCD_I2C_FREQ
+#define LCD_I2C_FREQ            100000 // PCF8574 max
+#endif
 #ifndef LCD_EN
 #define LCD_EN                  2
 #endif
@@ -75,6 +80,7 @@ typedef enum lcd_cgset {
     LCD_CGSET_MAX
 } lcd_cgset;
 
+void lcd_set_bus (twi_bus_t *bus);
 void lcd_init (void);
 void lcd_write_cgram (lcd_cgset cgset);
 void lcd_config (uint8_t conf);
@@ -86,6 +92,39 @@ void lcd_putb (char *s, uint8_t len);
 void lcd_puts (char *s);
 
 
+/*
+ * Coroutine display access
+ *
+ * Each byte is sent to the I2C backpack as four bus bytes in a single
+ * transfer instead of four blocking ones, and strings are sent up to
+ * LCD_PT_CHARS characters per transfer. Set the argument fields then PT_SPAWN()
+ * the coroutine on ctx->pt:
+ *  lcd_cmd_pt()    cmd, waits out clear/home execution time
+ *  lcd_move_pt()   ln, ch
+ *  lcd_puts_pt()   s, handles '\n' and '\r' like lcd_putch()
+ */
+#define LCD_PT_BYTE_LEN     4   // bus bytes per LCD byte in 4-bit mode
+#ifndef LCD_PT_CHARS
+#define LCD_PT_CHARS        LCD_WIDTH
+#endif
+
+typedef struct lcd_pt {
+    struct pt   pt;
+    twi_pt_t    twi;
+    pt_timer_t  delay;
+    uint8_t     cmd;
+    uint8_t     ln;
+    uint8_t     ch;
+    const char  *s;
+    uint8_t     buf[LCD_PT_BYTE_LEN * LCD_PT_CHARS];
+} lcd_pt_t;
+
+void lcd_pt_init (lcd_pt_t *ctx);
+PT_THREAD(lcd_cmd_pt (lcd_pt_t *ctx));
+PT_THREAD(lcd_move_pt (lcd_pt_t *ctx));
+PT_THREAD(lcd_puts_pt (lcd_pt_t *ctx));
+
+
 #ifdef LCD_INT_PUT_FUNCTIONS
 void lcd_puti (int32_t num, uint8_t digits);
 void lcd_putui (uint32_t num, uint8_t digits);
@@ -0,0 +1,135 @@
+/*
+ * INA219 threshold monitoring with a GPO response
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _LIMIT_H_
+#define _LIMIT_H_
+
+#include "acq.h"
+#include "list.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * GPO channels, numbered 1-4 as in system.xml
+ */
+#define LIMIT_GPO_CHANS     5
+
+/**
+ * Trip and clear events waiting to be read out, a power of two
+ */
+#define LIMIT_EVENTS        16
+
+/**
+ * Value a limit is evaluated on, signed register values with the bus
+ * voltage register shifted past its flags and power taking the sign of
+ * the current
+ */
+typedef enum limit_source {
+    LIMIT_SRC_CURRENT,
+    LIMIT_SRC_BUSV,
+    LIMIT_SRC_POWER,
+} limit_source_t;
+
+/**
+ * Limit configuration, thresholds in register LSBs
+ *
+ * An over limit trips after debounce consecutive samples above trip and
+ * clears after release consecutive samples below clear, an under limit the
+ * other way around, so the gap from trip to clear is the hysteresis. A
+ * latched limit stays tripped until limit_clear(). While tripped the mask
+ * bits of the GPO channel are set.
+ */
+typedef struct limit_cfg {
+    const char  *name;
+    uint8_t     id; // for the owner to tell events apart
+    uint8_t     source;
+    bool        under;
+    bool        latch;
+    int32_t     trip;
+    int32_t     clear;
+    uint8_t     debounce;
+    uint8_t     release;
+    uint8_t     gpo;
+    uint32_t    mask;
+} limit_cfg_t;
+
+/**
+ * Trip or clear of a limit
+ *
+ * The timestamp is the global counter when the sample was started, the
+ * detect time is from then to the limit being evaluated, which is the
+ * sample's I2C reads, and the output time is from then to the GPO write.
+ * Times are cycles.
+ */
+typedef struct limit_event {
+    struct limit    *limit;
+    uint64_t        tstamp;
+    uint32_t        detect_clks;
+    uint32_t        output_clks;
+    int32_t         val;
+    bool            trip;
+} limit_event_t;
+
+/**
+ * Limit counters, the longest times are of trips
+ */
+typedef struct limit_stats {
+    uint32_t    trips;
+    uint32_t    clears;
+    uint32_t    max_detect_clks;
+    uint32_t    max_output_clks;
+} limit_stats_t;
+
+typedef struct limit {
+    list_t          link;
+    limit_cfg_t     cfg;
+    uint8_t         count; // consecutive samples toward a change
+    bool            tripped;
+    limit_stats_t   stats;
+} limit_t;
+
+
+/**
+ * Initialize the limit service with all limit outputs clear
+ */
+void limit_svc_init (void);
+
+/**
+ * Initialize a limit and add it to the set of limits of a sensor
+ */
+void limit_add (list_t *set, limit_t *limit, const limit_cfg_t *cfg);
+
+/**
+ * Evaluate a sensor's limits on a sample, from the acquisition sample
+ * function in the I2C ISR
+ *
+ * Call it first thing there, a trip writes the GPO before anything else is
+ * done and the event is recorded after.
+ */
+void limit_sample (list_t *set, const acq_sample_t *sample);
+
+/**
+ * Clear a tripped limit, its outputs are released if no other tripped
+ * limit drives them, a latched limit trips again if still past its trip
+ * threshold
+ */
+void limit_clear (limit_t *limit);
+
+/**
+ * Oldest event not yet read out, returns false if there is none
+ */
+bool limit_get_event (limit_event_t *event);
+
+/**
+ * Counters of a limit, and events dropped with none read out
+ */
+void limit_get_stats (limit_t *limit, limit_stats_t *stats);
+uint32_t limit_events_dropped (void);
+
+
+#endif // _LIMIT_H_
@@ -44,10 +44,23 @@
 #include <xparameters.h>
 
 /* --- Definitions for uBlaze IO module integration --- */
-#define OC_I2C_BASE         XPAR_IOMODULE_0_IO_BASEADDR + 0x3000
+/* First core, further cores are placed by the SoC design               */
+#define OC_I2C_BASE         (XPAR_IOMODULE_0_IO_BASEADDR + 0x3000)
 #define OC_I2C_IRQ          XIN_IOMODULE_EXTERNAL_INTERRUPT_INTR
 
-#define OC_I2C_REG(r)   (*(uint8_t *)(OC_I2C_BASE + (OC_I2C_##r)*4))
+#define OC_I2C_REG(b,r)     (*(volatile uint8_t *)((b) + (OC_I2C_##r)*4))
+
+/* Register accessors for the core at base b, the host simulator routes
+ * these to its core models */
+#ifdef CONFIG_SIM
+uint8_t oc_i2c_sim_read(uintptr_t base, uint8_t reg);
+void oc_i2c_sim_write(uintptr_t base, uint8_t reg, uint8_t val);
+#define OC_I2C_READ(b,r)    oc_i2c_sim_read((b), OC_I2C_##r)
+#define OC_I2C_WRITE(b,r,v) oc_i2c_sim_write((b), OC_I2C_##r, (v))
+#else
+#define OC_I2C_READ(b,r)    (OC_I2C_REG(b,r))
+#define OC_I2C_WRITE(b,r,v) (OC_I2C_REG(b,r) = (v))
+#endif
 
 /*
  * Definitions for the Opencores i2c master core
@@ -100,6 +113,7 @@
                                 /*      1 - NACK                      */
                                 /*      0 - ACK                       */
 #define OC_I2C_BUSY  (1<<6)     /* Busy bit                           */
+#define OC_I2C_AL    (1<<5)     /* Arbitration lost                   */
 #define OC_I2C_TIP   (1<<1)     /* Transfer in progress               */
 #define OC_I2C_IF    (1<<0)     /* Interrupt flag                     */
 
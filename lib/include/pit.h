@@ -0,0 +1,35 @@
+/*
+ * Programmable interval timers of the IO module
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _PIT_H_
+#define _PIT_H_
+
+#include "xparameters.h"
+#include "xiomodule.h"
+
+
+/*
+ * PITs are numbered 1-4 as in system.xml
+ *
+ * The BSP timer functions index the PITs from 0 and the interrupt
+ * numbers for PIT1-PIT4 are consecutive.
+ */
+#define PIT_TIMER(n)            ((n) - 1)
+#define PIT_IRQ(n)              (XIN_IOMODULE_PIT_1_INTERRUPT_INTR + (n) - 1)
+
+/*
+ * Clocks per count of a PIT from its prescaler in the BSP, the core clock
+ * or a FIT1 period. The timer services support no other source.
+ */
+#define PIT_PRESCALER_NONE      0
+#define PIT_PRESCALER_FIT1      1
+#define PIT_PRESCALER(n)        _PIT_PRESCALER(n)
+#define _PIT_PRESCALER(n)       XPAR_IOMODULE_0_PIT##n##_PRESCALER
+#define PIT_CLKS_PER_COUNT(n)   (PIT_PRESCALER(n) == PIT_PRESCALER_FIT1 ? \
+                                    XPAR_IOMODULE_0_FIT1_NO_CLOCKS : 1)
+
+
+#endif // _PIT_H_
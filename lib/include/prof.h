@@ -0,0 +1,66 @@
+/*
+ * Cycle counting profiler
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include "util.h"
+
+
+/*
+ * Profiling regions are only compiled in with CONFIG_PROF defined,
+ * otherwise all of the macros below expand to nothing.
+ *
+ * Usage:
+ *  PROF_REGION(foo);               // at file scope
+ *  ...
+ *  PROF_BEGIN(foo);
+ *  do_work();
+ *  PROF_END(foo);
+ *
+ * Regions may nest and overlap, each BEGIN/END pair keeps its own start
+ * time and records inclusive time. A region must only be entered from
+ * one interrupt level. Times are in global counter cycles, taken from the
+ * low word only, so a single region must be shorter than 2^32 cycles.
+ */
+#define PROF_HIST_BINS          32
+
+
+typedef struct prof_region {
+    const char          *name;
+    struct prof_region  *next;
+    bool                registered;
+    uint32_t            count;
+    uint32_t            min;
+    uint32_t            max;
+    uint64_t            total;
+    uint32_t            hist[PROF_HIST_BINS]; // bin n counts [2^n, 2^(n+1))
+} prof_region_t;
+
+
+#ifdef CONFIG_PROF
+
+#define PROF_REGION(r)          static prof_region_t prof_##r = { .name = #r, .min = UINT32_MAX }
+#define PROF_BEGIN(r)           uint32_t prof_start_##r = GCNT_LO
+#define PROF_END(r)             prof_record(&prof_##r, GCNT_LO - prof_start_##r)
+
+void prof_record (prof_region_t *r, uint32_t cycles);
+void prof_reset (void);
+void prof_dump (void);
+
+#else
+
+#define PROF_REGION(r)          struct prof_unused_##r
+#define PROF_BEGIN(r)           do { } while (0)
+#define PROF_END(r)             do { } while (0)
+
+#define prof_reset()            do { } while (0)
+#define prof_dump()             do { } while (0)
+
+#endif // CONFIG_PROF
+
+
+#endif // _PROF_H_
@@ -0,0 +1,146 @@
+/*
+ * Stackless coroutines (protothreads)
+ *
+ * A coroutine is a function returning one of the PT_* status codes whose
+ * body is wrapped in PT_BEGIN()/PT_END(). Blocking points save the source
+ * line in a local continuation and return, the next call resumes there.
+ *
+ * Local continuations are implemented with a switch statement, so:
+ *  - local variables are not preserved across a blocking point, keep
+ *    state in a context structure instead
+ *  - a coroutine body must not contain its own switch statements
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _PT_H_
+#define _PT_H_
+
+#include "util.h"
+#include "list.h"
+#include "timer.h"
+
+
+/*
+ * Local continuations
+ */
+typedef uint16_t lc_t;
+
+#define LC_INIT(lc)             (lc) = 0
+#define LC_RESUME(lc)           switch (lc) { case 0:
+#define LC_SET(lc)              (lc) = __LINE__; case __LINE__:
+#define LC_END(lc)              }
+
+
+/*
+ * Coroutine status
+ */
+#define PT_WAITING              0
+#define PT_YIELDED              1
+#define PT_EXITED               2
+#define PT_ENDED                3
+
+
+/*
+ * Coroutine state
+ */
+struct pt {
+    lc_t        lc;
+};
+
+
+/*
+ * Coroutine declaration and control
+ */
+#define PT_THREAD(decl)         char decl
+
+#define PT_INIT(pt)             LC_INIT((pt)->lc)
+
+#define PT_BEGIN(pt)            { char pt_yielded = 1; (void)pt_yielded; LC_RESUME((pt)->lc)
+
+#define PT_END(pt)              LC_END((pt)->lc); PT_INIT(pt); return PT_ENDED; }
+
+#define PT_WAIT_UNTIL(pt,cond)              \
+    do {                                    \
+        LC_SET((pt)->lc);                   \
+        if (!(cond))                        \
+            return PT_WAITING;              \
+    } while (0)
+
+#define PT_WAIT_WHILE(pt,cond)  PT_WAIT_UNTIL((pt), !(cond))
+
+#define PT_YIELD(pt)                        \
+    do {                                    \
+        pt_yielded = 0;                     \
+        LC_SET((pt)->lc);                   \
+        if (pt_yielded == 0)                \
+            return PT_YIELDED;              \
+    } while (0)
+
+#define PT_RESTART(pt)                      \
+    do {                                    \
+        PT_INIT(pt);                        \
+        return PT_WAITING;                  \
+    } while (0)
+
+#define PT_EXIT(pt)                         \
+    do {                                    \
+        PT_INIT(pt);                        \
+        return PT_EXITED;                   \
+    } while (0)
+
+/*
+ * Run a coroutine once, evaluates true while it has not finished
+ */
+#define PT_SCHEDULE(f)          ((f) < PT_EXITED)
+
+/*
+ * Block until a child coroutine finishes
+ */
+#define PT_WAIT_THREAD(pt,thread)   PT_WAIT_WHILE((pt), PT_SCHEDULE(thread))
+
+#define PT_SPAWN(pt,child,thread)           \
+    do {                                    \
+        PT_INIT((child));                   \
+        PT_WAIT_THREAD((pt), (thread));     \
+    } while (0)
+
+
+/*
+ * Scheduled coroutine
+ *
+ * The scheduler is a task which runs every registered coroutine each time
+ * it is woken by pt_sched_wake(). It must be initialized after the task
+ * services. Anything which can change a wait
+ * condition (I2C completion, timer expiry) must wake the scheduler.
+ */
+typedef char (* pt_thread_fn) (struct pt *pt, void *data);
+
+typedef struct pt_thread_t {
+    list_t          link; // must be first entry
+    struct pt       pt;
+    pt_thread_fn    func;
+    void            *data;
+} pt_thread_t;
+
+
+/*
+ * Coroutine delay
+ */
+typedef struct pt_timer_t {
+    timer_t         timer;
+    volatile bool   expired;
+} pt_timer_t;
+
+#define pt_timer_expired(t)     ((t)->expired)
+
+
+void pt_sched_init (void);
+void pt_sched_start (pt_thread_t *thread, pt_thread_fn func, void *data);
+void pt_sched_wake (void);
+
+void pt_timer_init (pt_timer_t *t);
+void pt_timer_set (pt_timer_t *t, uint32_t timeout);
+
+
+#endif // _PT_H_
@@ -0,0 +1,82 @@
+/*
+ * Cooperative run-to-completion tasks
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "util.h"
+#include "list.h"
+#include "timer.h"
+#include "workq.h"
+
+
+/**
+ * Task function, must run to completion without blocking
+ */
+typedef void (* task_fn) (void *data);
+
+
+/**
+ * Task structure
+ *
+ * A task is a work item which may also be made runnable periodically by
+ * the timer service. Run times are in global counter cycles.
+ */
+typedef struct task_t {
+    work_t      work; // must be first entry
+    list_t      all;
+    const char  *name;
+    task_fn     func;
+    void        *data;
+    timer_t     timer;
+    uint32_t    runs;
+    uint32_t    max_run;
+    uint64_t    total_run;
+} task_t;
+
+
+/**
+ * Initialize task services
+ */
+void task_svc_init (void);
+
+/**
+ * Initialize a task and register it for stats reporting
+ */
+void task_init (task_t *task, const char *name, uint8_t prio, task_fn func, void *data);
+
+/**
+ * Make a task runnable, safe to call from an ISR or callback
+ */
+bool task_post (task_t *task);
+
+/**
+ * Make a task runnable every period ticks
+ */
+void task_set_period (task_t *task, uint32_t period);
+
+/**
+ * Make a task runnable once after a timeout in ticks
+ */
+void task_post_after (task_t *task, uint32_t timeout);
+
+/**
+ * Stop a task from being made runnable by its timer and dequeue it
+ */
+void task_cancel (task_t *task);
+
+/**
+ * Run tasks forever, idling when nothing is runnable
+ */
+void task_loop (void);
+
+/**
+ * Log run counts, run times and queue latencies of all tasks
+ */
+void task_dump_stats (void);
+
+
+#endif // _TASK_H_
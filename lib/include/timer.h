@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "list.h"
+#include "workq.h"
 
 
 /**
@@ -19,17 +20,60 @@
 #endif
 #define TIMER_TICKS_PER_SEC     (1000 / TIMER_MS_PER_TICK)
 
+/**
+ * Timing wheel geometry
+ *
+ * Each level has TIMER_WHEEL_SLOTS buckets and covers TIMER_WHEEL_BITS more
+ * bits of the expiry than the level below it. Timers further out than the
+ * top level reaches are parked on an overflow list.
+ */
+#ifndef TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS        6
+#endif
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS      4
+#endif
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN        (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
 #define TIMEOUT_IN_MS(t)        ((t) / TIMER_MS_PER_TICK)
 #define TIMEOUT_IN_SEC(t)       ((t) * TIMER_TICKS_PER_SEC)
 
 #define TICKS_TO_MS(t)          ((t) * TIMER_MS_PER_TICK)
 #define TICKS_TO_SEC(t)         ((t) / TIMER_TICKS_PER_SEC)
 
+#define TIMER_CLKS_PER_TICK     (GCNT_HZ / TIMER_TICKS_PER_SEC)
+
+/**
+ * Tickless mode config
+ *
+ * When TIMER_TICKLESS is defined the periodic FIT1 tick is not used.
+ * Instead TIMER_PIT is programmed as a one-shot for the next timer event
+ * and elapsed ticks are recovered from the global counter. The PIT is
+ * always armed for at most TIMER_TICKLESS_MAX_SLEEP ticks so the elapsed
+ * cycle count between wakeups fits in 32 bits.
+ *
+ * TIMER_PIT_CLKS_PER_COUNT follows the PIT prescaler in the BSP. PIT3 is
+ * prescaled by FIT1 in system.xml, so the one-shot counts FIT1 periods and
+ * wakes within a tick of the event. An early wakeup is simply re-armed.
+ */
+#ifndef TIMER_PIT
+#define TIMER_PIT               3
+#endif
+#ifndef TIMER_PIT_CLKS_PER_COUNT
+#define TIMER_PIT_CLKS_PER_COUNT    PIT_CLKS_PER_COUNT(TIMER_PIT)
+#endif
+#ifndef TIMER_TICKLESS_MAX_SLEEP
+#define TIMER_TICKLESS_MAX_SLEEP    TIMEOUT_IN_SEC(10)
+#endif
+
 /**
  * Timer flags
  */
 #define TIMER_ONE_SHOT          0x01
 #define TIMER_PERIODIC          0x02
+#define TIMER_DEFERRED          0x04 // run callback from the work queue
 
 
 /**
@@ -45,9 +89,10 @@ typedef struct timer_t {
     list_t      link; // must be first entry
     uint8_t     flags;
     uint32_t    timeout;
-    uint32_t    expire;
+    uint64_t    expire;
     timer_fn    func;
     void        *data;
+    work_t      work; // only used with TIMER_DEFERRED
 } timer_t;
 
 
@@ -58,6 +103,9 @@ void timer_svc_init (void);
 
 /**
  * Initialize a timer
+ *
+ * Callbacks run in the tick ISR unless TIMER_DEFERRED is set, in which case
+ * expiry posts the callback to the work queue at WORKQ_PRIO_NORMAL.
  */
 void timer_init (timer_t *timer, uint8_t flags, timer_fn func, void *data);
 
@@ -71,8 +119,15 @@ void timer_set (timer_t *timer, uint32_t timeout);
  */
 void timer_cancel (timer_t *timer);
 
+/**
+ * Check if a timer is scheduled
+ */
+bool timer_is_pending (timer_t *timer);
+
 /**
  * Get remaining time in ticks for an active timer
+ *
+ * Returns 0 for a timer which is not scheduled.
  */
 uint32_t timer_get_remaining (timer_t *timer);
 
@@ -81,6 +136,11 @@ uint32_t timer_get_remaining (timer_t *timer);
  */
 uint32_t timer_get_ticks(void);
 
+/**
+ * Query the full 64-bit tick counter
+ */
+uint64_t timer_get_ticks64(void);
+
 /**
  * Subtract two counter values
  *
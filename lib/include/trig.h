@@ -0,0 +1,158 @@
+/*
+ * Triggered capture of INA219 samples
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _TRIG_H_
+#define _TRIG_H_
+
+#include "acq.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Captured records waiting to be read out, a power of two
+ */
+#define TRIG_RECORDS        8
+
+/**
+ * Value a trigger is evaluated on, signed register values with power
+ * taking the sign of the current
+ */
+typedef enum trig_source {
+    TRIG_SRC_CURRENT,
+    TRIG_SRC_POWER,
+} trig_source_t;
+
+/**
+ * Trigger conditions
+ *
+ * Levels fire on every sample past lo, edges on a sample crossing lo from
+ * the one before, windows on a sample outside or inside lo to hi
+ * inclusive.
+ */
+typedef enum trig_type {
+    TRIG_LEVEL_ABOVE,
+    TRIG_LEVEL_BELOW,
+    TRIG_EDGE_RISE,
+    TRIG_EDGE_FALL,
+    TRIG_WINDOW_OUT,
+    TRIG_WINDOW_IN,
+} trig_type_t;
+
+typedef struct trig_cond {
+    uint8_t     source;
+    uint8_t     type;
+    int32_t     lo; // register LSBs
+    int32_t     hi;
+} trig_cond_t;
+
+/**
+ * Captured record, sample numbers of the capture ring
+ *
+ * The pre-trigger part can be short of what was asked if the capture had
+ * not run that long, or if pre was raised while older records were still
+ * queued as a record never starts before them. The timestamp is the
+ * trigger sample's.
+ */
+typedef struct trig_record {
+    uint32_t    start;
+    uint32_t    trigger;
+    uint32_t    count;
+    uint64_t    tstamp;
+} trig_record_t;
+
+/**
+ * Capture counters
+ *
+ * Missed counts conditions met with no room for the record, lost counts
+ * samples not stored as the ring was full of records not yet read out.
+ */
+typedef struct trig_stats {
+    uint32_t    triggers;
+    uint32_t    missed;
+    uint32_t    lost;
+} trig_stats_t;
+
+/**
+ * Trigger engine of one sensor
+ *
+ * Every sample goes into the capture ring. A record is the samples around
+ * a trigger and stays in the ring, pinned from being overwritten until it
+ * is released, so a record is never copied and the pre-trigger samples of
+ * the next one can be shared with it.
+ */
+typedef struct trig {
+    acq_sample_t        *ring;
+    uint32_t            size;
+    uint32_t            mask;
+    volatile uint32_t   head; // samples stored
+    uint32_t            fill; // samples in the ring
+    trig_cond_t         cond;
+    uint32_t            pre;
+    uint32_t            post;
+    bool                armed;
+    bool                capturing; // post-trigger samples of cur to go
+    bool                prev_valid;
+    int32_t             prev;
+    trig_record_t       cur;
+    trig_record_t       records[TRIG_RECORDS];
+    volatile uint32_t   rec_head; // records closed
+    uint32_t            rec_tail; // records released
+    trig_stats_t        stats;
+} trig_t;
+
+
+/**
+ * Initialize a trigger engine, disarmed, with a capture ring of a power of
+ * two samples
+ */
+void trig_init (trig_t *t, acq_sample_t *ring, uint32_t size);
+
+/**
+ * Set the condition and the samples kept before and after the trigger
+ * sample, and arm
+ *
+ * A record of pre + post + 1 samples must fit in the ring. The engine
+ * rearms as soon as a record closes, so the sample after it can trigger
+ * the next.
+ */
+void trig_arm (trig_t *t, const trig_cond_t *cond, uint32_t pre, uint32_t post);
+
+/**
+ * Disarm, a record being captured is still closed
+ */
+void trig_disarm (trig_t *t);
+
+/**
+ * Store a sample and evaluate the condition on it, from the acquisition
+ * sample function in the I2C ISR
+ */
+void trig_sample (trig_t *t, const acq_sample_t *sample);
+
+/**
+ * Oldest closed record not yet released, returns false if there is none
+ */
+bool trig_get (trig_t *t, trig_record_t *rec);
+
+/**
+ * Copy samples of a record from an offset into it, returns the number
+ * copied
+ */
+uint32_t trig_copy (trig_t *t, const trig_record_t *rec, uint32_t offset, acq_sample_t *buf, uint32_t n);
+
+/**
+ * Release the oldest closed record, its samples can be overwritten
+ */
+void trig_release (trig_t *t);
+
+/**
+ * Capture counters
+ */
+void trig_get_stats (trig_t *t, trig_stats_t *stats);
+
+
+#endif // _TRIG_H_
@@ -0,0 +1,111 @@
+/*
+ * Timestamps and division free cycle conversions
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _TSTAMP_H_
+#define _TSTAMP_H_
+
+#include "gcnt.h"
+#include <stdint.h>
+
+
+#define TSTAMP_CLKS_PER_US      (GCNT_HZ / 1000000UL)
+#define TSTAMP_CLKS_PER_MS      (GCNT_HZ / 1000UL)
+
+/*
+ * floor(log2(x)) as a constant expression
+ */
+#define TSTAMP_LOG2(x)                                              \
+    ((x) >= (1UL << 31) ? 31 : (x) >= (1UL << 30) ? 30 :           \
+     (x) >= (1UL << 29) ? 29 : (x) >= (1UL << 28) ? 28 :           \
+     (x) >= (1UL << 27) ? 27 : (x) >= (1UL << 26) ? 26 :           \
+     (x) >= (1UL << 25) ? 25 : (x) >= (1UL << 24) ? 24 :           \
+     (x) >= (1UL << 23) ? 23 : (x) >= (1UL << 22) ? 22 :           \
+     (x) >= (1UL << 21) ? 21 : (x) >= (1UL << 20) ? 20 :           \
+     (x) >= (1UL << 19) ? 19 : (x) >= (1UL << 18) ? 18 :           \
+     (x) >= (1UL << 17) ? 17 : (x) >= (1UL << 16) ? 16 :           \
+     (x) >= (1UL << 15) ? 15 : (x) >= (1UL << 14) ? 14 :           \
+     (x) >= (1UL << 13) ? 13 : (x) >= (1UL << 12) ? 12 :           \
+     (x) >= (1UL << 11) ? 11 : (x) >= (1UL << 10) ? 10 :           \
+     (x) >= (1UL << 9)  ? 9  : (x) >= (1UL << 8)  ? 8  :           \
+     (x) >= (1UL << 7)  ? 7  : (x) >= (1UL << 6)  ? 6  :           \
+     (x) >= (1UL << 5)  ? 5  : (x) >= (1UL << 4)  ? 4  :           \
+     (x) >= (1UL << 3)  ? 3  : (x) >= (1UL << 2)  ? 2  :           \
+     (x) >= (1UL << 1)  ? 1  : 0)
+
+/*
+ * Fixed point reciprocal of a divisor
+ *
+ * x / d == (x * TSTAMP_RECIP_MULT(d)) >> TSTAMP_RECIP_SHIFT(d), where the
+ * multiplier is the 32-bit ceiling of 2^shift / d. The result is exact for
+ * counts up to 2^shift / (mult * d - 2^shift), which covers the full 32-bit
+ * range for the microsecond divisor at 100 MHz. The millisecond divisor
+ * may read one high above 2^31 cycles, and 64-bit conversions gain about
+ * 0.2 ppb.
+ */
+#define TSTAMP_RECIP_SHIFT(d)   (32 + TSTAMP_LOG2(d))
+#define TSTAMP_RECIP_MULT(d)    ((uint32_t)(((1ULL << TSTAMP_RECIP_SHIFT(d)) + (d) - 1) / (d)))
+
+/*
+ * Nanoseconds per cycle in 8.24 fixed point
+ */
+#define TSTAMP_NS_SHIFT         24
+#define TSTAMP_NS_MULT          ((uint32_t)((1000000000ULL << TSTAMP_NS_SHIFT) / GCNT_HZ))
+
+
+/*
+ * Fast 32-bit timestamp, a single IO bus read
+ *
+ * Only valid for measuring intervals shorter than 2^32 cycles.
+ */
+#define tstamp_get32()          GCNT_LO
+
+
+/*
+ * Initialize the software high word from the global counter
+ */
+void tstamp_init (void);
+
+/*
+ * Monotonic 64-bit timestamp from a single IO bus read
+ *
+ * The high word is kept in RAM and bumped when the low word is seen to
+ * wrap, so this (or tstamp_update()) must be called at least once every
+ * 2^32 cycles. The timer service ISR does this.
+ */
+uint64_t tstamp_get (void);
+
+#define tstamp_update()         ((void)tstamp_get())
+
+/*
+ * Cycle conversions without libgcc division helpers
+ */
+static inline uint64_t tstamp_cycles_to_ns (uint32_t cycles)
+{
+    return ((uint64_t)cycles * TSTAMP_NS_MULT) >> TSTAMP_NS_SHIFT;
+}
+
+static inline uint32_t tstamp_cycles_to_us (uint32_t cycles)
+{
+    return ((uint64_t)cycles * TSTAMP_RECIP_MULT(TSTAMP_CLKS_PER_US))
+            >> TSTAMP_RECIP_SHIFT(TSTAMP_CLKS_PER_US);
+}
+
+static inline uint32_t tstamp_cycles_to_ms (uint32_t cycles)
+{
+    return ((uint64_t)cycles * TSTAMP_RECIP_MULT(TSTAMP_CLKS_PER_MS))
+            >> TSTAMP_RECIP_SHIFT(TSTAMP_CLKS_PER_MS);
+}
+
+uint64_t tstamp_to_us (uint64_t cycles);
+uint64_t tstamp_to_ms (uint64_t cycles);
+
+/*
+ * Compare the conversions and reads above with the divide based ones
+ */
+void tstamp_bench (void);
+
+
+#endif /* _TSTAMP_H_ */
@@ -13,6 +13,11 @@
 #include "xparameters.h"
 #include "xiomodule.h"
 
+#include "list.h"
+#include "pt.h"
+#include "timer.h"
+
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifndef TWI_FREQ
@@ -23,9 +28,286 @@
 #define TWI_BUFFER_LENGTH 32
 #endif
 
+/*
+ * Transfer priority classes, lower value is serviced first
+ *
+ * A queued transfer that has waited longer than TWI_AGE_MS is serviced
+ * ahead of higher classes, so low priority traffic is never starved.
+ */
+#define TWI_PRIO_HIGH           0
+#define TWI_PRIO_NORMAL         1
+#define TWI_PRIO_LOW            2
+#define TWI_PRIO_MAX            3
+
+#ifndef TWI_AGE_MS
+#define TWI_AGE_MS              5
+#endif
+
+/*
+ * Transfer timeout
+ *
+ * Each transfer must finish within its time on the wire at the device
+ * speed plus TWI_TIMEOUT_MS, otherwise the bus is recovered and the
+ * transfer fails with TWI_XFER_TIMEOUT.
+ */
+#ifndef TWI_TIMEOUT_MS
+#define TWI_TIMEOUT_MS          5
+#endif
+
+/*
+ * Per-device bus speeds kept for each controller
+ */
+#ifndef TWI_SPEED_DEVICES
+#define TWI_SPEED_DEVICES       8
+#endif
+
+/*
+ * Bus statistics config
+ *
+ * Counters are kept for the first TWI_STATS_DEVICES addresses seen on each
+ * bus. Bus utilization is measured over a sliding window of
+ * TWI_STATS_WINDOW_MS made up of TWI_STATS_WINDOW_SLOTS slots, which must be
+ * a power of two.
+ */
+#ifndef TWI_STATS_DEVICES
+#define TWI_STATS_DEVICES       8
+#endif
+#ifndef TWI_STATS_WINDOW_MS
+#define TWI_STATS_WINDOW_MS     1000
+#endif
+#ifndef TWI_STATS_WINDOW_SLOTS
+#define TWI_STATS_WINDOW_SLOTS  8
+#endif
+#define TWI_STATS_HIST_BINS     16
+
+/*
+ * Transfer descriptor status
+ */
+enum twi_xfer_status {
+    TWI_XFER_IDLE,
+    TWI_XFER_QUEUED,
+    TWI_XFER_ACTIVE,
+    TWI_XFER_OK,
+    TWI_XFER_NACK,
+    TWI_XFER_TIMEOUT,
+    TWI_XFER_ARB_LOST,
+    TWI_XFER_ABORTED,
+};
+
+typedef struct twi_bus twi_bus_t;
+typedef struct twi_xfer twi_xfer_t;
+
+typedef void (* twi_xfer_fn) (twi_xfer_t *xfer, uint8_t status);
+
+/*
+ * Transfer segment, a caller-owned buffer
+ */
+typedef struct twi_seg {
+    uint8_t     *data;
+    uint32_t    length;
+} twi_seg_t;
+
+/*
+ * Transfer descriptor
+ *
+ * A descriptor writes the wr segments in order then reads into the rd
+ * segments, either phase may be empty for a plain read or write. A
+ * write-read turns the bus around with a repeated START instead of a STOP,
+ * as used for register reads where the register address is written first.
+ * The ISR moves bytes directly to and from the segments, so there is no
+ * copy and no limit on the length. The segments and their buffers are owned
+ * by the caller and must stay valid until the callback runs, which is in
+ * interrupt context with the final status: TWI_XFER_OK, or the error that
+ * ended the transfer. Every started transfer ends with a callback, a
+ * device that stops responding costs one bounded timeout.
+ *
+ * The single buffer helpers point wr/rd at the descriptor's own seg[].
+ * Descriptors run on the default controller at TWI_PRIO_NORMAL unless bus
+ * or prio are set after twi_xfer_init().
+ */
+struct twi_xfer {
+    list_t              link; // must be first entry
+    twi_bus_t           *bus;
+    uint8_t             prio;
+    uint8_t             addr;
+    volatile uint8_t    status;
+    uint8_t             wr_nseg;
+    uint8_t             rd_nseg;
+    twi_seg_t           *wr;
+    twi_seg_t           *rd;
+    twi_seg_t           seg[2];
+    twi_xfer_fn         callback;
+    void                *data;
+    uint16_t            prescale;
+    uint32_t            timeout; // ticks
+    uint64_t            queued;
+};
+
+/*
+ * Bus statistics
+ *
+ * Latency is measured from twi_submit() to the completion callback, so it
+ * includes time spent queued behind other devices on the same bus. Aborts
+ * count descriptors removed with twi_cancel().
+ */
+typedef struct twi_dev_stats {
+    uint8_t     addr;
+    uint32_t    xfers;
+    uint32_t    bytes;
+    uint32_t    nacks;
+    uint32_t    errors; // timeouts, arbitration lost and aborted in progress
+    uint32_t    aborts;
+    uint32_t    max_latency; // us
+    uint32_t    hist[TWI_STATS_HIST_BINS]; // bin n counts [2^n, 2^(n+1)) us
+} twi_dev_stats_t;
+
+typedef struct twi_stats {
+    twi_dev_stats_t dev[TWI_STATS_DEVICES];
+    uint8_t         ndev;
+    uint32_t        untracked;
+    uint32_t        retunes; // prescaler reprogrammed between transfers
+    uint32_t        timeouts;
+    uint32_t        recoveries;
+    uint32_t        max_wait[TWI_PRIO_MAX]; // queued to started, cycles
+    uint32_t        aged[TWI_PRIO_MAX]; // serviced ahead of a higher class
+    uint32_t        busy[TWI_STATS_WINDOW_SLOTS]; // bus busy cycles per slot
+    uint8_t         slot;
+    uint64_t        slot_end;
+} twi_stats_t;
+
+/*
+ * Controller instance
+ *
+ * Each OpenCores core has its own queue and ISR state and runs
+ * independently, so a slow device on one bus never holds up transfers on
+ * another. Devices run at the bus speed given to twi_bus_init() unless
+ * twi_set_speed() gives them their own, in which case the prescaler is
+ * reprogrammed between transfers whenever the next device runs at a
+ * different speed.
+ *
+ * The next transfer is picked at each transaction boundary: the oldest
+ * transfer of the highest non-empty class, unless a lower class has one
+ * that is older and past the aging limit. A transfer never waits for more
+ * than the transaction in progress plus the ones picked ahead of it, so
+ * the TWI_PRIO_HIGH wait is bounded by the longest transaction on the bus
+ * plus the other high priority and aged transfers queued at the time.
+ *
+ * When a transfer times out, loses arbitration or is aborted the core is
+ * reset, then nine SCL clocks and a STOP are sent so a slave holding SDA
+ * low in the middle of a byte lets go of the bus. If recovery itself
+ * times out, because SCL is held low, the core is reset and the transfer
+ * ends anyway.
+ *
+ * twi_init() sets up the default controller at OC_I2C_BASE, which is the
+ * first one initialized. Functions taking a bus use the default controller
+ * when passed NULL.
+ */
+struct twi_bus {
+    list_t      link; // must be first entry
+    const char  *name;
+    uintptr_t   base;
+    uint8_t     irq;
+    uint16_t    prescale;       // default for devices without a speed set
+    uint16_t    prer;           // programmed into the core
+    struct {
+        uint8_t     addr;
+        uint16_t    prescale;
+    } speed[TWI_SPEED_DEVICES];
+    uint8_t     nspeed;
+
+    // shared with the ISR
+    list_t      queue[TWI_PRIO_MAX];
+    twi_xfer_t  *cur;
+    uint8_t     state;
+    uint8_t     error; // final status of cur, applied on completion
+    uint8_t     seg;
+    uint32_t    index;
+    uint32_t    remain;
+    uint32_t    count;
+    uint64_t    started;
+    timer_t     timeout;
+    twi_stats_t stats;
+};
+
 void twi_init(XIOModule *xiomod);
+void twi_bus_init(twi_bus_t *bus, XIOModule *xiomod, const char *name,
+                  uintptr_t base, uint8_t irq, uint32_t freq);
+bool twi_set_speed(twi_bus_t *bus, uint8_t addr, uint32_t freq);
+bool twi_busy(twi_bus_t *bus);
+
+/*
+ * Time on the wire in core clocks of a transfer to a device at its speed,
+ * a write-read with a repeated START when both lengths are given
+ */
+uint32_t twi_xfer_clks(twi_bus_t *bus, uint8_t addr, uint32_t wr, uint32_t rd);
+
+/*
+ * Asynchronous transfers
+ *
+ * Descriptors are queued in submission order and the ISR starts the next one
+ * as soon as the current one completes, so callers never wait on the bus.
+ * twi_submit() is safe to call from a completion callback and returns false
+ * if the descriptor is already queued or in progress. twi_cancel() only
+ * removes descriptors that have not been started yet. twi_abort() also
+ * stops a transfer in progress, which ends through bus recovery with its
+ * callback reporting TWI_XFER_ABORTED.
+ */
+void twi_xfer_init(twi_xfer_t *xfer, twi_xfer_fn callback, void *data);
+void twi_xfer_write(twi_xfer_t *xfer, uint8_t addr, uint8_t *data, uint32_t length);
+void twi_xfer_read(twi_xfer_t *xfer, uint8_t addr, uint8_t *data, uint32_t length);
+void twi_xfer_write_read(twi_xfer_t *xfer, uint8_t addr, uint8_t *wr_data, uint32_t wr_len,
+                         uint8_t *rd_data, uint32_t rd_len);
+void twi_xfer_sg(twi_xfer_t *xfer, uint8_t addr, twi_seg_t *wr, uint8_t wr_nseg,
+                 twi_seg_t *rd, uint8_t rd_nseg);
+bool twi_submit(twi_xfer_t *xfer);
+bool twi_cancel(twi_xfer_t *xfer);
+bool twi_abort(twi_xfer_t *xfer);
+bool twi_xfer_pending(twi_xfer_t *xfer);
+
+/*
+ * Blocking transfers on the default controller
+ *
+ * Data is copied through a single internal buffer, so each call first waits
+ * for the previous blocking transfer to finish. Other queued descriptors are
+ * not waited on.
+ */
 void twi_write(uint8_t address, uint8_t* data, uint8_t length, void (*callback)(uint8_t, uint8_t *));
 void twi_read(uint8_t address, uint8_t length, void (*callback)(uint8_t, uint8_t *));
 uint8_t *twi_wait();
 
+/*
+ * Coroutine transfers
+ *
+ * Coroutines queue a descriptor and yield until it completes, reading
+ * directly into the caller's buffer. Set bus, prio, addr, data and length, then
+ * PT_SPAWN() twi_write_pt() or twi_read_pt(). For other transfers such as
+ * a write-read set up the xfer descriptor directly and PT_SPAWN()
+ * twi_xfer_pt(). The descriptor runs on bus at prio in every case.
+ */
+typedef struct twi_pt {
+    struct pt       pt;
+    twi_xfer_t      xfer;
+    twi_bus_t       *bus;
+    uint8_t         prio;
+    uint8_t         addr;
+    uint8_t         *data;
+    uint32_t        length;
+} twi_pt_t;
+
+PT_THREAD(twi_xfer_pt(twi_pt_t *t));
+PT_THREAD(twi_write_pt(twi_pt_t *t));
+PT_THREAD(twi_read_pt(twi_pt_t *t));
+
+/*
+ * Bus statistics access, twi_stats_dump() covers every controller
+ *
+ * twi_stats_max_wait() is the longest time in us a transfer of a priority
+ * class spent queued before it was started.
+ */
+bool twi_stats_get(twi_bus_t *bus, uint8_t addr, twi_dev_stats_t *stats);
+uint32_t twi_stats_max_wait(twi_bus_t *bus, uint8_t prio);
+uint8_t twi_stats_utilization(twi_bus_t *bus);
+void twi_stats_reset(twi_bus_t *bus);
+void twi_stats_dump(void);
+
 #endif
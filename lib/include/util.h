@@ -1,5 +1,5 @@
 /*
- * Utility macros
+ * Utility macros and functions
  *
  * Copyright (c) 2022 Matt Liss
  * BSD-3-Clause
@@ -34,6 +34,13 @@
                                         (bm[bit/(sizeof(bm[0])*8)] & ~(1<<(bit%(sizeof(bm[0])*8)))))
 
 
+/*
+ * Floor of log2 limited to max, at most 31, zero maps to 0, e.g. the bin of
+ * a power of two histogram
+ */
+uint8_t log2_floor (uint32_t v, uint8_t max);
+
+
 #define log(fmt, ...)   \
     do { \
         uint64_t tick = gcnt_get(); \
@@ -0,0 +1,86 @@
+/*
+ * Deferred work queue
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+#include "util.h"
+#include "list.h"
+
+
+/**
+ * Work priorities, lower value runs first
+ */
+#define WORKQ_PRIO_HIGH         0
+#define WORKQ_PRIO_NORMAL       1
+#define WORKQ_PRIO_LOW          2
+#define WORKQ_PRIO_MAX          3
+
+
+/**
+ * Work callback function
+ */
+typedef void (* work_fn) (void *data);
+
+
+/**
+ * Work item structure
+ *
+ * Latencies are in global counter cycles from work_post() to the callback
+ * being invoked.
+ */
+typedef struct work_t {
+    list_t      link; // must be first entry
+    uint8_t     prio;
+    work_fn     func;
+    void        *data;
+    uint64_t    posted;
+    uint32_t    latency;
+    uint32_t    max_latency;
+} work_t;
+
+
+/**
+ * Initialize the work queue
+ */
+void workq_init (void);
+
+/**
+ * Initialize a work item
+ */
+void work_init (work_t *work, uint8_t prio, work_fn func, void *data);
+
+/**
+ * Queue a work item to be run, safe to call from an ISR
+ *
+ * Returns false if the item was already queued, it will only run once.
+ */
+bool work_post (work_t *work);
+
+/**
+ * Remove a queued work item
+ */
+void work_cancel (work_t *work);
+
+/**
+ * Run the highest priority queued work item
+ *
+ * Returns false if there was no work queued.
+ */
+bool workq_run_one (void);
+
+/**
+ * Run queued work until all queues are empty
+ */
+void workq_drain (void);
+
+/**
+ * Check if any work is queued
+ */
+bool workq_is_empty (void);
+
+
+#endif // _WORKQ_H_
@@ -0,0 +1,169 @@
+/*
+ * Streaming windowed statistics
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _WSTAT_H_
+#define _WSTAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Largest sample magnitude, e.g. a signed INA219 power register
+ */
+#define WSTAT_VAL_MAX       65535
+
+/**
+ * Largest window, sums of squares of a window then fit in 64 bits with
+ * room for the variance numerator
+ */
+#define WSTAT_WINDOW_MAX    16384
+
+/**
+ * Scale of one unit per sample LSB, for samples already in the units
+ * wanted
+ */
+#define WSTAT_UNIT          (1ULL << 32)
+
+/**
+ * Largest product of a sample magnitude and its Q0.32 scale that fits a
+ * Q15.16 result, a full scale sample only fits with a scale of at most
+ * half a unit per LSB
+ */
+#define WSTAT_SCALED_MAX    (1ULL << 47)
+
+/**
+ * Exact sums of the samples in a window
+ */
+typedef struct wstat_sum {
+    uint32_t    count;
+    int32_t     min;
+    int32_t     max;
+    int64_t     sum;
+    uint64_t    sumsq;
+} wstat_sum_t;
+
+/**
+ * Monotonic queue of sample numbers for a sliding minimum or maximum
+ */
+typedef struct wstat_deque {
+    uint32_t    *seq;
+    uint32_t    head;
+    uint32_t    tail;
+} wstat_deque_t;
+
+/**
+ * Window of the last size samples
+ *
+ * A tumbling window closes every size samples, or earlier with
+ * wstat_close(), and the statistics are of the last closed window. A
+ * sliding window has a ring of the samples in it and its statistics are of
+ * the last size samples at any time.
+ */
+typedef struct wstat_window {
+    uint32_t        size;
+    uint32_t        mask; // sliding only
+    int32_t         *ring; // NULL for a tumbling window
+    wstat_deque_t   minq;
+    wstat_deque_t   maxq;
+    uint32_t        seq; // samples added
+    uint32_t        windows; // tumbling windows closed
+    wstat_sum_t     cur;
+    wstat_sum_t     done; // last closed tumbling window
+} wstat_window_t;
+
+/**
+ * Exponential moving average and variance, weight 2^-shift per sample
+ *
+ * Mean is Q.16 and variance Q.16 sample LSBs squared.
+ */
+typedef struct wstat_ema {
+    uint8_t     shift;
+    bool        valid;
+    int64_t     mean;
+    int64_t     var;
+} wstat_ema_t;
+
+/**
+ * Window statistics scaled to units
+ *
+ * All but the count are Q15.16 units, the variance is Q47.16 units squared.
+ * The standard deviation and variance are of the population of the window.
+ * Values past the Q15.16 range saturate, see WSTAT_SCALED_MAX.
+ */
+typedef struct wstat_result {
+    uint32_t    count;
+    int32_t     min;
+    int32_t     max;
+    int32_t     mean;
+    int32_t     rms;
+    int32_t     std;
+    int64_t     var;
+} wstat_result_t;
+
+
+/**
+ * Initialize a tumbling window of size samples, at most WSTAT_WINDOW_MAX
+ */
+void wstat_tumbling_init (wstat_window_t *w, uint32_t size);
+
+/**
+ * Initialize a sliding window of size samples, a power of two of at most
+ * WSTAT_WINDOW_MAX
+ *
+ * The ring holds the samples in the window and the queues the sample
+ * numbers of the window's running minimum and maximum, each has size
+ * entries.
+ */
+void wstat_sliding_init (wstat_window_t *w, uint32_t size, int32_t *ring, uint32_t *minq, uint32_t *maxq);
+
+/**
+ * Add a sample of magnitude at most WSTAT_VAL_MAX
+ *
+ * Constant time for a tumbling window, amortized constant time for a
+ * sliding window. Safe to call from an ISR.
+ */
+void wstat_add (wstat_window_t *w, int32_t val);
+
+/**
+ * Close a tumbling window now, with the samples added since it opened
+ *
+ * A reader closing the window once per period gets statistics over every
+ * sample of the period. A window closed with no samples has no statistics.
+ */
+void wstat_close (wstat_window_t *w);
+
+/**
+ * Copy out a window's statistics scaled by a Q0.32 unit per sample LSB, at
+ * most WSTAT_UNIT
+ *
+ * The results are exact while each sample magnitude times the scale is
+ * below WSTAT_SCALED_MAX, at most 32768 units.
+ *
+ * Returns false if no tumbling window has closed yet or a sliding window is
+ * empty. A sliding window that has not filled covers the samples so far.
+ */
+bool wstat_get (wstat_window_t *w, uint64_t scale, wstat_result_t *r);
+
+/**
+ * Initialize an exponential moving average, shift from 1 to 16
+ */
+void wstat_ema_init (wstat_ema_t *e, uint8_t shift);
+
+/**
+ * Add a sample of magnitude at most WSTAT_VAL_MAX, the first sets the mean
+ */
+void wstat_ema_add (wstat_ema_t *e, int32_t val);
+
+/**
+ * Copy out the mean and standard deviation as Q15.16 units with a Q0.32
+ * unit per sample LSB, saturated as wstat_get(), returns false before the
+ * first sample
+ */
+bool wstat_ema_get (wstat_ema_t *e, uint64_t scale, int32_t *mean, int32_t *std);
+
+
+#endif // _WSTAT_H_
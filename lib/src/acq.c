@@ -0,0 +1,422 @@
+/*
+ * INA219 continuous acquisition
+ *
+ * A high resolution timer starts a sample on every sensor on a fixed
+ * cadence and each sensor's registers are read one after another from the
+ * I2C completion callback. The sensors' transfers are queued together, so
+ * while one sensor's callback prepares its next read the bus is already
+ * running another's and a pass over all sensors keeps the bus busy.
+ * The bus voltage register is read first and the rest only if its CNVR
+ * flag shows a conversion finished since the last sample, the power
+ * register is read last as that clears CNVR. In triggered modes the
+ * configuration is written after the sample to start the next conversion.
+ *
+ * The finished sample is written to the ring and only then is the head
+ * advanced, so readers never see a partial sample. Readers run in thread
+ * context and a sample can only be overwritten by an ISR that runs to
+ * completion, so a copy that raced the producer is detected by re-checking
+ * the head afterwards.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "acq.h"
+#include "mbsoc.h"
+#include "util.h"
+#include <assert.h>
+
+
+/*
+ * Registers read for a sample, in order
+ */
+static const uint8_t acq_regs[] = {
+    REG_BUSV,
+    REG_SHUNTV,
+    REG_CURRENT,
+    REG_POWER,
+};
+
+static struct acq_data {
+    list_t              sensors;
+    hrtimer_t           timer;
+    uint32_t            period; // cycles
+    uint32_t            slip; // cycles, 0 for a fixed rate
+    bool                retry; // next tick polls only the early sensors
+    bool                running;
+} acq;
+
+
+/**
+ * Read the register for the current step of a sensor's sample in progress
+ */
+static void acq_read_reg (acq_sensor_t *sensor)
+{
+    sensor->buf[0] = acq_regs[sensor->step];
+    twi_xfer_write_read(&sensor->xfer, sensor->dev->addr, &sensor->buf[0], 1, &sensor->buf[1], 2);
+    twi_submit(&sensor->xfer);
+}
+
+/**
+ * Write a sensor's configuration, starting a conversion
+ */
+static void acq_write_config (acq_sensor_t *sensor)
+{
+    sensor->buf[0] = REG_CONFIG;
+    sensor->buf[1] = sensor->dev->config >> 8;
+    sensor->buf[2] = sensor->dev->config & 0xff;
+    twi_xfer_write(&sensor->xfer, sensor->dev->addr, sensor->buf, sizeof(sensor->buf));
+    twi_submit(&sensor->xfer);
+}
+
+/**
+ * Register transfer done, runs in the I2C ISR
+ */
+static void acq_reg_done (twi_xfer_t *xfer, uint8_t status)
+{
+    acq_sensor_t *sensor = xfer->data;
+    uint16_t val = (sensor->buf[1] << 8) | sensor->buf[2];
+
+    if (status != TWI_XFER_OK) {
+        sensor->stats.errors++;
+        return;
+    }
+
+    if (sensor->step == ARRAY_SIZE(acq_regs))
+        return; // trigger written
+
+    switch (acq_regs[sensor->step]) {
+        case REG_BUSV:
+            if (!(val & INA219_BUSV_CNVR)) {
+                sensor->stats.stale++;
+                // following the conversions, poll again shortly
+                if (acq.slip && sensor->pace) {
+                    sensor->retry = true;
+                    if (!acq.retry) {
+                        acq.retry = true;
+                        hrtimer_start_at(&acq.timer, gcnt_get() + acq.slip);
+                    }
+                }
+                return;
+            }
+            if (val & INA219_BUSV_OVF)
+                sensor->stats.ovf++;
+            sensor->cur.raw.busv = val;
+            break;
+        case REG_SHUNTV:
+            sensor->cur.raw.shuntv = val;
+            break;
+        case REG_CURRENT:
+            sensor->cur.raw.current = val;
+            break;
+        case REG_POWER:
+            sensor->cur.raw.power = val;
+            break;
+    }
+
+    if (++sensor->step < ARRAY_SIZE(acq_regs)) {
+        acq_read_reg(sensor);
+        return;
+    }
+
+    sensor->ring[sensor->head & sensor->mask] = sensor->cur;
+    sensor->head++;
+    sensor->stats.samples++;
+    // ahead of the energy update, limits on the sample react sooner
+    if (sensor->sample_fn)
+        sensor->sample_fn(sensor, &sensor->cur, sensor->sample_data);
+    energy_update(&sensor->energy, sensor->cur.tstamp, sensor->cur.raw.power, sensor->cur.raw.current);
+
+    if (!(INA219_CFG_GET_MODE(sensor->dev->config) & INA219_MODE_CONT))
+        acq_write_config(sensor);
+}
+
+/**
+ * Sample period, runs in the high resolution timer ISR
+ */
+static void acq_tick (void *data)
+{
+    uint64_t now = gcnt_get();
+    uint64_t deadline = acq.timer.deadline + acq.period;
+    uint32_t missed = 0;
+    bool retry = acq.retry;
+    list_t *iter;
+
+    // keep the cadence, periods already missed are overruns
+    while (deadline <= now) {
+        deadline += acq.period;
+        missed++;
+    }
+    hrtimer_start_at(&acq.timer, deadline);
+    acq.retry = false;
+
+    list_for_each(&acq.sensors, iter) {
+        acq_sensor_t *sensor = (acq_sensor_t *)iter;
+
+        // a retry moves the cadence, the others were polled in time
+        if (retry && !sensor->retry)
+            continue;
+        sensor->retry = false;
+
+        sensor->stats.overruns += missed;
+        if (twi_xfer_pending(&sensor->xfer)) {
+            sensor->stats.overruns++;
+            continue;
+        }
+
+        sensor->cur.tstamp = now;
+        sensor->step = 0;
+        acq_read_reg(sensor);
+    }
+}
+
+void acq_init (void)
+{
+    list_init_head(&acq.sensors);
+    acq.period = 0;
+    acq.slip = 0;
+    acq.retry = false;
+    acq.running = false;
+
+    hrtimer_init(&acq.timer, acq_tick, NULL);
+}
+
+void acq_add (acq_sensor_t *sensor, ina219_t *dev, acq_sample_t *ring, uint32_t size)
+{
+    CRITICAL_STORE;
+
+    assert(sensor);
+    assert(dev);
+    assert(ring);
+    assert(size && (size & (size - 1)) == 0);
+    assert(!acq.running);
+
+    sensor->dev = dev;
+    sensor->ring = ring;
+    sensor->size = size;
+    sensor->mask = size - 1;
+    sensor->head = 0;
+    memset(&sensor->stats, 0, sizeof(sensor->stats));
+    energy_init(&sensor->energy);
+    sensor->sample_fn = NULL;
+    sensor->sample_data = NULL;
+
+    twi_xfer_init(&sensor->xfer, acq_reg_done, sensor);
+    sensor->xfer.bus = dev->bus;
+    sensor->xfer.prio = TWI_PRIO_HIGH;
+
+    CRITICAL_START();
+    list_insert(&acq.sensors, &sensor->link);
+    CRITICAL_END();
+}
+
+void acq_set_sample_fn (acq_sensor_t *sensor, acq_sample_fn func, void *data)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    sensor->sample_fn = func;
+    sensor->sample_data = data;
+    CRITICAL_END();
+}
+
+/**
+ * Bus time of a sensor's sample, its register reads and in triggered modes
+ * the configuration write starting the next conversion
+ */
+static uint32_t acq_sample_clks (acq_sensor_t *sensor)
+{
+    ina219_t *dev = sensor->dev;
+    uint32_t clks = ARRAY_SIZE(acq_regs) * twi_xfer_clks(dev->bus, dev->addr, 1, 2);
+
+    if (!(INA219_CFG_GET_MODE(dev->config) & INA219_MODE_CONT))
+        clks += twi_xfer_clks(dev->bus, dev->addr, sizeof(sensor->buf), 0);
+
+    return clks;
+}
+
+/**
+ * Bus time of a pass over every sensor, that of the busiest bus
+ *
+ * Each tick starts a sample on every sensor, so the samples of sensors
+ * sharing a bus run back to back within the period.
+ */
+static uint32_t acq_pass_clks (void)
+{
+    list_t *iter, *other;
+    uint32_t clks, max = 0;
+
+    list_for_each(&acq.sensors, iter) {
+        twi_bus_t *bus = ((acq_sensor_t *)iter)->dev->bus;
+
+        clks = 0;
+        list_for_each(&acq.sensors, other) {
+            if (((acq_sensor_t *)other)->dev->bus == bus)
+                clks += acq_sample_clks((acq_sensor_t *)other);
+        }
+        if (clks > max)
+            max = clks;
+    }
+
+    return max;
+}
+
+/**
+ * Wait for the transfers of all sensors to finish
+ */
+static void acq_wait_idle (void)
+{
+    list_t *iter;
+
+    list_for_each(&acq.sensors, iter) {
+        while (twi_xfer_pending(&((acq_sensor_t *)iter)->xfer))
+            ;
+    }
+}
+
+bool acq_start (uint32_t rate_hz)
+{
+    uint32_t conv = 0, first = 0, period;
+    bool ok = true;
+    list_t *iter;
+
+    // the shortest conversion sets the period, the longest the first poll
+    list_for_each(&acq.sensors, iter) {
+        uint32_t clks = ina219_conv_us(((acq_sensor_t *)iter)->dev->config) * GCNT_TICKS_PER_US;
+
+        if (clks == 0)
+            return false;
+        if (conv == 0 || clks < conv)
+            conv = clks;
+        if (clks > first)
+            first = clks;
+    }
+    if (conv == 0 || rate_hz > GCNT_HZ)
+        return false;
+
+    // without a rate a little faster than nominal, a fast part is still tracked
+    period = rate_hz ? GCNT_HZ / rate_hz : conv - conv / 64;
+
+    // no faster than every sensor on the busiest bus can be read
+    if (period < acq_pass_clks())
+        return false;
+
+    acq_stop();
+    acq_wait_idle();
+
+    acq.period = period;
+    acq.slip = rate_hz ? 0 : conv / 16;
+    acq.retry = false;
+
+    // the configuration writes start the first conversions
+    list_for_each(&acq.sensors, iter) {
+        acq_sensor_t *sensor = (acq_sensor_t *)iter;
+
+        sensor->pace = ina219_conv_us(sensor->dev->config) * GCNT_TICKS_PER_US == conv;
+        sensor->retry = false;
+        energy_restart(&sensor->energy); // not over the time stopped
+        sensor->step = ARRAY_SIZE(acq_regs);
+        acq_write_config(sensor);
+    }
+    acq_wait_idle();
+    list_for_each(&acq.sensors, iter) {
+        if (((acq_sensor_t *)iter)->xfer.status != TWI_XFER_OK)
+            ok = false;
+    }
+    if (!ok)
+        return false;
+
+    acq.running = true;
+    hrtimer_start_at(&acq.timer, gcnt_get() + (rate_hz ? acq.period : first));
+
+    return true;
+}
+
+void acq_stop (void)
+{
+    if (!acq.running)
+        return;
+
+    hrtimer_cancel(&acq.timer);
+    acq.running = false;
+}
+
+void acq_reader_init (acq_reader_t *reader, acq_sensor_t *sensor)
+{
+    reader->sensor = sensor;
+    reader->next = sensor->head;
+    reader->dropped = 0;
+}
+
+uint32_t acq_available (acq_reader_t *reader)
+{
+    acq_sensor_t *sensor = reader->sensor;
+    uint32_t lag = sensor->head - reader->next;
+
+    return lag > sensor->size ? sensor->size : lag;
+}
+
+bool acq_read (acq_reader_t *reader, acq_sample_t *sample)
+{
+    acq_sensor_t *sensor = reader->sensor;
+    uint32_t lag;
+
+    do {
+        lag = sensor->head - reader->next;
+        if (lag == 0)
+            return false;
+
+        // skip what has been overwritten
+        if (lag > sensor->size) {
+            reader->dropped += lag - sensor->size;
+            reader->next += lag - sensor->size;
+        }
+
+        *sample = sensor->ring[reader->next & sensor->mask];
+    } while (sensor->head - reader->next > sensor->size);
+
+    reader->next++;
+
+    return true;
+}
+
+bool acq_latest (acq_sensor_t *sensor, acq_sample_t *sample)
+{
+    uint32_t head;
+
+    do {
+        head = sensor->head;
+        if (head == 0)
+            return false;
+
+        *sample = sensor->ring[(head - 1) & sensor->mask];
+    } while (sensor->head != head);
+
+    return true;
+}
+
+void acq_get_stats (acq_sensor_t *sensor, acq_stats_t *stats)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    *stats = sensor->stats;
+    CRITICAL_END();
+}
+
+void acq_stats_dump (void)
+{
+    acq_stats_t stats;
+    list_t *iter;
+
+    log("acq %s %d Hz tick lateness: %d us",
+            acq.slip ? "following conversions at" : "rate", acq.period ? GCNT_HZ / acq.period : 0,
+            HRTIMER_CLKS_TO_US(hrtimer_get_lateness(&acq.timer)));
+
+    list_for_each(&acq.sensors, iter) {
+        acq_sensor_t *sensor = (acq_sensor_t *)iter;
+
+        acq_get_stats(sensor, &stats);
+        log("acq 0x%02x samples: %d stale: %d overruns: %d errors: %d overflows: %d",
+                sensor->dev->addr, stats.samples, stats.stale, stats.overruns, stats.errors, stats.ovf);
+    }
+}
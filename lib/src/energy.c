@@ -0,0 +1,141 @@
+/*
+ * INA219 energy and charge accumulation
+ *
+ * The raw power and current registers are integrated over the global
+ * counter interval between samples, so the per sample cost is two
+ * multiplies and adds and no calibration is applied until the totals are
+ * read. An LSB hour is exactly ENERGY_CLKS_PER_HOUR LSB cycles, carrying
+ * whole ones into the hours count keeps the cycles part small enough to
+ * scale by the calibration in 64 bits when the totals are read.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "energy.h"
+#include "mbsoc.h"
+#include "util.h"
+
+
+/*
+ * The cycles part is scaled in 64 bits after dropping this many bits,
+ * a cycles part under two hours then fits with a 32 bit scale
+ */
+#define ENERGY_CLKS_SHIFT       11
+
+
+static void energy_sum_add (energy_sum_t *sum, int64_t val)
+{
+    sum->clks += val;
+
+    while (sum->clks >= (int64_t)ENERGY_CLKS_PER_HOUR) {
+        sum->clks -= ENERGY_CLKS_PER_HOUR;
+        sum->hours++;
+    }
+    while (sum->clks <= -(int64_t)ENERGY_CLKS_PER_HOUR) {
+        sum->clks += ENERGY_CLKS_PER_HOUR;
+        sum->hours--;
+    }
+}
+
+/**
+ * Scale a sum by a Q0.32 unit per LSB to Q31.32 unit hours
+ */
+static int64_t energy_sum_scale (const energy_sum_t *sum, uint32_t scale)
+{
+    return sum->hours * scale +
+           (sum->clks >> ENERGY_CLKS_SHIFT) * scale / (int64_t)(ENERGY_CLKS_PER_HOUR >> ENERGY_CLKS_SHIFT);
+}
+
+void energy_init (energy_t *e)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    memset(e, 0, sizeof(*e));
+    e->epoch_pending = true;
+    CRITICAL_END();
+}
+
+void energy_update (energy_t *e, uint64_t tstamp, uint16_t power_reg, uint16_t current_reg)
+{
+    int32_t current = (int16_t)current_reg;
+    int32_t power = current < 0 ? -(int32_t)power_reg : power_reg;
+    uint64_t dt = tstamp - e->last;
+
+    if (power_reg > (e->peak < 0 ? -e->peak : e->peak)) {
+        e->peak = power;
+        e->peak_tstamp = tstamp;
+    }
+
+    if (e->epoch_pending) {
+        e->epoch_start = tstamp;
+        e->epoch_pending = false;
+    }
+
+    // a gap too long to trust only starts the next interval
+    if (e->valid && dt <= UINT32_MAX) {
+        energy_sum_add(&e->energy, (int64_t)power * (uint32_t)dt);
+        energy_sum_add(&e->charge, (int64_t)current * (uint32_t)dt);
+    }
+
+    e->last = tstamp;
+    e->valid = true;
+}
+
+void energy_restart (energy_t *e)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    e->valid = false;
+    CRITICAL_END();
+}
+
+void energy_epoch (energy_t *e)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    e->epoch_energy = e->energy;
+    e->epoch_charge = e->charge;
+    e->epoch_start = e->last;
+    e->epoch_pending = !e->valid;
+    e->peak = 0;
+    e->peak_tstamp = 0;
+    CRITICAL_END();
+}
+
+void energy_get (energy_t *e, const ina219_cal_t *cal, energy_report_t *report)
+{
+    energy_sum_t energy, charge, epoch_energy, epoch_charge;
+    uint64_t start, last;
+    int32_t peak;
+    bool pending;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    energy = e->energy;
+    charge = e->charge;
+    epoch_energy = e->epoch_energy;
+    epoch_charge = e->epoch_charge;
+    start = e->epoch_start;
+    last = e->last;
+    pending = e->epoch_pending;
+    peak = e->peak;
+    report->epoch_peak_tstamp = e->peak_tstamp;
+    CRITICAL_END();
+
+    report->total_wh = energy_sum_scale(&energy, cal->power_scale);
+    report->total_mah = energy_sum_scale(&charge, cal->current_scale);
+
+    // the epoch is the difference of the sums, the cycles part stays small
+    epoch_energy.hours = energy.hours - epoch_energy.hours;
+    epoch_energy.clks = energy.clks - epoch_energy.clks;
+    epoch_charge.hours = charge.hours - epoch_charge.hours;
+    epoch_charge.clks = charge.clks - epoch_charge.clks;
+    report->epoch_wh = energy_sum_scale(&epoch_energy, cal->power_scale);
+    report->epoch_mah = energy_sum_scale(&epoch_charge, cal->current_scale);
+
+    report->epoch_peak_w = (int32_t)(((int64_t)peak * cal->power_scale + (1 << 15)) >> 16);
+    report->epoch_clks = pending ? 0 : last - start;
+}
@@ -0,0 +1,351 @@
+/*
+ * Fixed point decimation filters
+ *
+ * The core multiplies in software, so the chain is arranged to need as few
+ * multiplies per input sample as it can. A CIC stage first decimates with
+ * only 32 bit adds, its registers wrap but the comb differences of a
+ * window come out exact as long as the gain fits, and as the gain is a
+ * power of two it is normalized with a shift. An FIR stage then only
+ * computes the samples it passes on, folds symmetric coefficients and
+ * multiplies 32 bit samples by 16 bit coefficients as two 32 bit
+ * products rather than a 64 bit one. A biquad runs last at the lowest
+ * rate. Nothing divides per sample, the coefficients are fixed tables.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "filt.h"
+#include "mbsoc.h"
+#include "tstamp.h"
+#include "util.h"
+#include <assert.h>
+
+
+#define BENCH_ITER      1000
+
+
+/*
+ * Lowpass for decimating by two, 15 taps Hamming windowed to 0.2 of the
+ * input rate, 0.17 gain at the output Nyquist and under 0.02 past 0.3
+ */
+const int16_t filt_fir_lp15[15] = {
+    70, 207, 0, -1082, -1309, 2527, 9438, 13066, 9438, 2527, -1309, -1082, 0, 207, 70,
+};
+
+/*
+ * Butterworth lowpass at 0.1 of its input rate, b1 trimmed for exactly
+ * unity DC gain
+ */
+const filt_biquad_coef_t filt_biquad_lp10 = {
+    .b0 = 72429549,
+    .b1 = 144859097,
+    .b2 = 72429549,
+    .a1 = -1227265970,
+    .a2 = 443242341,
+};
+
+
+void filt_chain_init (filt_chain_t *chain)
+{
+    list_init_head(&chain->stages);
+    chain->decim = 1;
+    chain->cic = false;
+    chain->in = 0;
+    chain->out = 0;
+}
+
+static void filt_stage_init (filt_stage_t *stage, uint8_t type, uint16_t decim)
+{
+    assert(decim);
+
+    stage->type = type;
+    stage->decim = decim;
+    stage->phase = 0;
+}
+
+void filt_cic_init (filt_cic_t *cic, uint8_t order, uint16_t decim)
+{
+    uint8_t bits = 0;
+
+    assert(order && order <= FILT_CIC_ORDER_MAX);
+    assert(decim && (decim & (decim - 1)) == 0);
+
+    while ((1 << bits) < decim)
+        bits++;
+    assert(order * bits <= FILT_CIC_GAIN_BITS);
+
+    filt_stage_init(&cic->stage, FILT_CIC, decim);
+    cic->order = order;
+    cic->shift = order * bits - FILT_FRAC;
+    memset(cic->integ, 0, sizeof(cic->integ));
+    memset(cic->comb, 0, sizeof(cic->comb));
+}
+
+void filt_fir_init (filt_fir_t *fir, const int16_t *coef, uint16_t taps, uint16_t decim, int32_t *hist)
+{
+    uint16_t i;
+
+    assert(coef && taps && hist);
+
+    filt_stage_init(&fir->stage, FILT_FIR, decim);
+    fir->coef = coef;
+    fir->taps = taps;
+    fir->pos = 0;
+    fir->hist = hist;
+    memset(hist, 0, 2 * taps * sizeof(*hist));
+
+    fir->symmetric = true;
+    for (i = 0; i < taps / 2; ++i) {
+        if (coef[i] != coef[taps - 1 - i])
+            fir->symmetric = false;
+    }
+}
+
+void filt_biquad_init (filt_biquad_t *bq, const filt_biquad_coef_t *coef, uint16_t decim)
+{
+    filt_stage_init(&bq->stage, FILT_BIQUAD, decim);
+    bq->coef = *coef;
+    bq->x1 = bq->x2 = 0;
+    bq->y1 = bq->y2 = 0;
+    bq->err = 0;
+}
+
+void filt_chain_add (filt_chain_t *chain, filt_stage_t *stage)
+{
+    // the CIC takes the integer input
+    assert(stage->type != FILT_CIC || list_is_empty(&chain->stages));
+    assert(chain->in == 0);
+
+    list_insert(&chain->stages, &stage->link);
+    if (stage->type == FILT_CIC)
+        chain->cic = true;
+    chain->decim *= stage->decim;
+}
+
+void filt_chain_reset (filt_chain_t *chain)
+{
+    list_t *iter;
+
+    list_for_each(&chain->stages, iter) {
+        filt_stage_t *stage = (filt_stage_t *)iter;
+
+        stage->phase = 0;
+        switch (stage->type) {
+            case FILT_CIC: {
+                filt_cic_t *cic = CONTAINER_OF(filt_cic_t, stage, stage);
+
+                memset(cic->integ, 0, sizeof(cic->integ));
+                memset(cic->comb, 0, sizeof(cic->comb));
+                break;
+            }
+            case FILT_FIR: {
+                filt_fir_t *fir = CONTAINER_OF(filt_fir_t, stage, stage);
+
+                memset(fir->hist, 0, 2 * fir->taps * sizeof(*fir->hist));
+                fir->pos = 0;
+                break;
+            }
+            case FILT_BIQUAD: {
+                filt_biquad_t *bq = CONTAINER_OF(filt_biquad_t, stage, stage);
+
+                bq->x1 = bq->x2 = 0;
+                bq->y1 = bq->y2 = 0;
+                bq->err = 0;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Count a sample into a stage, true if it is one passed on
+ */
+static inline bool filt_stage_pass (filt_stage_t *stage)
+{
+    if (++stage->phase < stage->decim)
+        return false;
+    stage->phase = 0;
+    return true;
+}
+
+static bool filt_cic_step (filt_cic_t *cic, int32_t *val)
+{
+    uint32_t acc, prev;
+    uint8_t i;
+
+    acc = *val;
+    for (i = 0; i < cic->order; ++i)
+        acc = cic->integ[i] += acc;
+
+    if (!filt_stage_pass(&cic->stage))
+        return false;
+
+    for (i = 0; i < cic->order; ++i) {
+        prev = cic->comb[i];
+        cic->comb[i] = acc;
+        acc -= prev;
+    }
+
+    if (cic->shift > 0)
+        *val = ((int32_t)acc + (1 << (cic->shift - 1))) >> cic->shift;
+    else
+        *val = (int32_t)(acc << -cic->shift);
+
+    return true;
+}
+
+/**
+ * Sample of at most 26 bits times a Q1.15 coefficient, as two 32 bit
+ * products
+ */
+static inline int64_t filt_mul_q15 (int32_t x, int16_t c)
+{
+    return ((int64_t)((x >> 16) * c) << 16) + (int32_t)(x & 0xffff) * c;
+}
+
+static bool filt_fir_step (filt_fir_t *fir, int32_t *val)
+{
+    const int32_t *x;
+    int64_t acc = 0;
+    uint16_t i, n = fir->taps;
+
+    fir->hist[fir->pos] = *val;
+    fir->hist[fir->pos + n] = *val;
+    if (++fir->pos == n)
+        fir->pos = 0;
+
+    if (!filt_stage_pass(&fir->stage))
+        return false;
+
+    // oldest to newest, x[n - 1] is the sample just taken
+    x = &fir->hist[fir->pos];
+    if (fir->symmetric) {
+        for (i = 0; i < n / 2; ++i)
+            acc += filt_mul_q15(x[i] + x[n - 1 - i], fir->coef[i]);
+        if (n & 1)
+            acc += filt_mul_q15(x[n / 2], fir->coef[n / 2]);
+    } else {
+        for (i = 0; i < n; ++i)
+            acc += filt_mul_q15(x[n - 1 - i], fir->coef[i]);
+    }
+
+    *val = (acc + (1 << 14)) >> 15;
+
+    return true;
+}
+
+static bool filt_biquad_step (filt_biquad_t *bq, int32_t *val)
+{
+    const filt_biquad_coef_t *c = &bq->coef;
+    int64_t acc = bq->err;
+    int32_t x = *val, y;
+
+    acc += (int64_t)c->b0 * x + (int64_t)c->b1 * bq->x1 + (int64_t)c->b2 * bq->x2;
+    acc -= (int64_t)c->a1 * bq->y1 + (int64_t)c->a2 * bq->y2;
+    y = acc >> 30;
+    bq->err = acc - ((int64_t)y << 30);
+
+    bq->x2 = bq->x1;
+    bq->x1 = x;
+    bq->y2 = bq->y1;
+    bq->y1 = y;
+
+    if (!filt_stage_pass(&bq->stage))
+        return false;
+
+    *val = y;
+
+    return true;
+}
+
+bool filt_push (filt_chain_t *chain, int32_t in, int32_t *out)
+{
+    int32_t val = chain->cic ? in : in * (1 << FILT_FRAC);
+    list_t *iter;
+    bool pass = true;
+
+    chain->in++;
+
+    list_for_each(&chain->stages, iter) {
+        filt_stage_t *stage = (filt_stage_t *)iter;
+
+        switch (stage->type) {
+            case FILT_CIC:
+                pass = filt_cic_step(CONTAINER_OF(filt_cic_t, stage, stage), &val);
+                break;
+            case FILT_FIR:
+                pass = filt_fir_step(CONTAINER_OF(filt_fir_t, stage, stage), &val);
+                break;
+            case FILT_BIQUAD:
+                pass = filt_biquad_step(CONTAINER_OF(filt_biquad_t, stage, stage), &val);
+                break;
+        }
+        if (!pass)
+            return false;
+    }
+
+    chain->out++;
+    *out = val;
+
+    return true;
+}
+
+/**
+ * Cycles per sample pushed through a chain
+ */
+static uint32_t filt_bench_chain (filt_chain_t *chain)
+{
+    volatile int32_t sink;
+    uint32_t start;
+    int32_t out;
+    int i;
+
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i) {
+        if (filt_push(chain, (i * 2731) & 0x7fff, &out))
+            sink = out;
+    }
+    (void)sink;
+
+    return (tstamp_get32() - start) / BENCH_ITER;
+}
+
+void filt_bench (void)
+{
+    static int32_t hist[2 * ARRAY_SIZE(filt_fir_lp15)];
+    filt_chain_t chain;
+    filt_cic_t cic;
+    filt_fir_t fir;
+    filt_biquad_t bq;
+
+    log("filt bench, cycles per input sample");
+
+    filt_chain_init(&chain);
+    filt_cic_init(&cic, 3, 8);
+    filt_chain_add(&chain, &cic.stage);
+    log("    cic3/8:      %d", filt_bench_chain(&chain));
+
+    filt_chain_init(&chain);
+    filt_fir_init(&fir, filt_fir_lp15, ARRAY_SIZE(filt_fir_lp15), 1, hist);
+    filt_chain_add(&chain, &fir.stage);
+    log("    fir15:       %d", filt_bench_chain(&chain));
+
+    filt_chain_init(&chain);
+    filt_fir_init(&fir, filt_fir_lp15, ARRAY_SIZE(filt_fir_lp15), 2, hist);
+    filt_chain_add(&chain, &fir.stage);
+    log("    fir15/2:     %d", filt_bench_chain(&chain));
+
+    filt_chain_init(&chain);
+    filt_biquad_init(&bq, &filt_biquad_lp10, 1);
+    filt_chain_add(&chain, &bq.stage);
+    log("    biquad:      %d", filt_bench_chain(&chain));
+
+    filt_chain_init(&chain);
+    filt_cic_init(&cic, 3, 8);
+    filt_fir_init(&fir, filt_fir_lp15, ARRAY_SIZE(filt_fir_lp15), 2, hist);
+    filt_biquad_init(&bq, &filt_biquad_lp10, 1);
+    filt_chain_add(&chain, &cic.stage);
+    filt_chain_add(&chain, &fir.stage);
+    filt_chain_add(&chain, &bq.stage);
+    log("    chain/16:    %d", filt_bench_chain(&chain));
+}
@@ -0,0 +1,178 @@
+/*
+ * High resolution timer services
+ *
+ * Pending timers are kept in a list sorted by deadline and a single PIT is
+ * armed as a one-shot for the head of the list. There are only ever a few
+ * of these timers outstanding, so the ordered insert stays short.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "hrtimer.h"
+#include "mbsoc.h"
+#include <assert.h>
+
+
+#if PIT_PRESCALER(HRTIMER_PIT) != PIT_PRESCALER_NONE
+#error "HRTIMER_PIT must count core clocks, set its prescaler to None in the MCS core"
+#endif
+
+
+static struct hrtimer_svc_data {
+    list_t      timers;
+    uint32_t    max_lateness;
+} hrtimer_data;
+
+
+/**
+ * Arm the PIT for the earliest deadline
+ *
+ * *MUST* be called in a critical region
+ */
+static void hrtimer_program (uint64_t now)
+{
+    hrtimer_t *first;
+    uint64_t cycles;
+    uint32_t counts;
+
+    XIOModule_Timer_Stop(&xio, PIT_TIMER(HRTIMER_PIT));
+
+    if (list_is_empty(&hrtimer_data.timers))
+        return;
+
+    first = (hrtimer_t *)hrtimer_data.timers.next;
+    if (first->deadline > now) {
+        cycles = first->deadline - now;
+        if (cycles > (uint64_t)UINT32_MAX * HRTIMER_PIT_CLKS_PER_COUNT)
+            counts = UINT32_MAX; // ISR will re-arm for the rest
+        else
+            counts = ((uint32_t)cycles + HRTIMER_PIT_CLKS_PER_COUNT - 1) / HRTIMER_PIT_CLKS_PER_COUNT;
+    } else {
+        counts = 1;
+    }
+
+    XIOModule_SetResetValue(&xio, PIT_TIMER(HRTIMER_PIT), counts);
+    XIOModule_Timer_Start(&xio, PIT_TIMER(HRTIMER_PIT));
+}
+
+/**
+ * PIT one-shot ISR
+ */
+static void hrtimer_isr (void *data)
+{
+    hrtimer_t *timer;
+    uint64_t now = gcnt_get();
+
+    while (!list_is_empty(&hrtimer_data.timers)) {
+        timer = (hrtimer_t *)hrtimer_data.timers.next;
+        if (timer->deadline > now + HRTIMER_SLACK_CLKS)
+            break;
+
+        list_delete(&timer->link);
+
+        // spin out the slack so callbacks never run early
+        while (now < timer->deadline)
+            now = gcnt_get();
+
+        timer->lateness = now - timer->deadline;
+        if (timer->lateness > hrtimer_data.max_lateness)
+            hrtimer_data.max_lateness = timer->lateness;
+
+        timer->func(timer->data);
+        now = gcnt_get();
+    }
+
+    hrtimer_program(now);
+}
+
+void hrtimer_svc_init (void)
+{
+    list_init_head(&hrtimer_data.timers);
+    hrtimer_data.max_lateness = 0;
+
+    XIOModule_SetOptions(&xio, PIT_TIMER(HRTIMER_PIT), 0);
+    XIOModule_Connect(&xio, PIT_IRQ(HRTIMER_PIT), hrtimer_isr, NULL);
+    XIOModule_Enable(&xio, PIT_IRQ(HRTIMER_PIT));
+}
+
+void hrtimer_init (hrtimer_t *timer, hrtimer_fn func, void *data)
+{
+    assert(timer && func);
+
+    timer->deadline = 0;
+    timer->lateness = 0;
+    timer->func = func;
+    timer->data = data;
+    list_init_head(&timer->link);
+}
+
+/**
+ * Helper to check if a timer is linked into the pending list
+ *
+ * *MUST* be called in a critical region
+ */
+static bool hrtimer_linked (hrtimer_t *timer)
+{
+    return (timer->link.next != NULL) && (timer->link.next != &timer->link);
+}
+
+void hrtimer_start_at (hrtimer_t *timer, uint64_t deadline)
+{
+    list_t *iter;
+    CRITICAL_STORE;
+
+    assert(timer);
+
+    // timer list shared with ISR
+    CRITICAL_START();
+
+    if (hrtimer_linked(timer))
+        list_delete(&timer->link);
+
+    timer->deadline = deadline;
+
+    // insert timer in list in order of deadline
+    list_for_each(&hrtimer_data.timers, iter) {
+        if (deadline < ((hrtimer_t *)iter)->deadline)
+            break;
+    }
+    list_insert(iter, &timer->link);
+
+    // re-arm only if the head changed
+    if (hrtimer_data.timers.next == &timer->link)
+        hrtimer_program(gcnt_get());
+
+    CRITICAL_END();
+}
+
+void hrtimer_start (hrtimer_t *timer, uint32_t us)
+{
+    hrtimer_start_at(timer, gcnt_get() + HRTIMER_US_TO_CLKS(us));
+}
+
+void hrtimer_cancel (hrtimer_t *timer)
+{
+    bool head;
+    CRITICAL_STORE;
+
+    assert(timer);
+
+    CRITICAL_START();
+    if (hrtimer_linked(timer)) {
+        head = (hrtimer_data.timers.next == &timer->link);
+        list_delete(&timer->link);
+        if (head)
+            hrtimer_program(gcnt_get());
+    }
+    CRITICAL_END();
+}
+
+uint32_t hrtimer_get_lateness (hrtimer_t *timer)
+{
+    return timer->lateness;
+}
+
+uint32_t hrtimer_get_max_lateness (void)
+{
+    return hrtimer_data.max_lateness;
+}
@@ -6,115 +6,293 @@
  */
 #include "twi.h"
 #include "ina219.h"
-#include "timer.h"
 #include <assert.h>
 
 
-enum ina219_state {
-    IDLE,
-    WRITE_REG,
-    READ_REG_ADDR,
-    READ_REG_VAL,
-    ERR_TIMEOUT,
-    STATE_MAX
+/*
+ * Device used by the functions taking an address
+ */
+static ina219_t ina_dev;
+
+/*
+ * Conversion time in us of each ADC setting, 0x4-0x7 alias 0x0-0x3 and
+ * 0x8 is 12-bit
+ */
+static const uint32_t ina_adc_us[16] = {
+       84,   148,   276,   532,
+       84,   148,   276,   532,
+      532,  1060,  2130,  4260,
+     8510, 17020, 34050, 68100,
 };
 
-static struct ina219_data_t {
-    enum ina219_state   state;
-    uint16_t            value;
-} volatile ina_dat;
-
-static timer_t timer;
-
-
-static void ina219_i2c_cb(uint8_t i2c_addr, uint8_t *data)
-{
-    switch (ina_dat.state) {
-        case WRITE_REG:
-            ina_dat.state = IDLE;
-            break;
-        case READ_REG_ADDR:
-            ina_dat.state = READ_REG_VAL;
-            break;
-        case READ_REG_VAL:
-            ina_dat.value = data[1];
-            ina_dat.value |= (data[0] << 8);
-            ina_dat.state = IDLE;
-            break;
-        default:
-            assert(false);
-            break;
+
+/*
+ * Run a transfer on a device's descriptor and wait for it
+ */
+static bool ina219_xfer_wait(ina219_t *dev)
+{
+    twi_submit(&dev->xfer);
+    while (twi_xfer_pending(&dev->xfer))
+        ;
+
+    return dev->xfer.status == TWI_XFER_OK;
+}
+
+void ina219_dev_init(ina219_t *dev, twi_bus_t *bus, uint8_t i2c_addr)
+{
+    assert(dev);
+
+    dev->bus = bus;
+    dev->addr = i2c_addr;
+    dev->config = INA219_CONFIG;
+    ina219_calibrate_lsb(&dev->cal, INA219_SHUNT_UOHM, INA219_CURRENT_LSB_NA);
+
+    twi_xfer_init(&dev->xfer, NULL, NULL);
+    dev->xfer.bus = bus;
+    dev->xfer.prio = TWI_PRIO_HIGH;
+}
+
+bool ina219_dev_setup(ina219_t *dev)
+{
+    uint16_t calib;
+
+    twi_set_speed(dev->bus, dev->addr, INA219_I2C_FREQ);
+
+    if (!ina219_dev_write(dev, REG_CONFIG, dev->config))
+        return false;
+    if (!ina219_dev_write(dev, REG_CALIB, dev->cal.calib))
+        return false;
+    if (!ina219_dev_read(dev, REG_CALIB, &calib))
+        return false;
+
+    return calib == dev->cal.calib;
+}
+
+bool ina219_dev_read(ina219_t *dev, uint8_t reg_addr, uint16_t *val)
+{
+    dev->buf[0] = reg_addr;
+    twi_xfer_write_read(&dev->xfer, dev->addr, &dev->buf[0], 1, &dev->buf[1], 2);
+    if (!ina219_xfer_wait(dev))
+        return false;
+
+    *val = (dev->buf[1] << 8) | dev->buf[2];
+    return true;
+}
+
+bool ina219_dev_write(ina219_t *dev, uint8_t reg_addr, uint16_t val)
+{
+    dev->buf[0] = reg_addr;
+    dev->buf[1] = val >> 8;
+    dev->buf[2] = val & 0xff;
+
+    twi_xfer_write(&dev->xfer, dev->addr, dev->buf, sizeof(dev->buf));
+    return ina219_xfer_wait(dev);
+}
+
+bool ina219_dev_sample(ina219_t *dev, ina219_raw_t *raw)
+{
+    return ina219_dev_read(dev, REG_BUSV, &raw->busv) &&
+           ina219_dev_read(dev, REG_SHUNTV, &raw->shuntv) &&
+           ina219_dev_read(dev, REG_CURRENT, &raw->current) &&
+           ina219_dev_read(dev, REG_POWER, &raw->power);
+}
+
+bool ina219_dev_measure(ina219_t *dev, ina219_meas_t *meas)
+{
+    ina219_raw_t raw;
+
+    if (!ina219_dev_sample(dev, &raw))
+        return false;
+
+    ina219_measure(&dev->cal, &raw, meas);
+    return true;
+}
+
+uint8_t ina219_scan(twi_bus_t *bus, ina219_t *devs, uint8_t max)
+{
+    twi_xfer_t probe;
+    uint8_t addr, n = 0;
+
+    twi_xfer_init(&probe, NULL, NULL);
+    probe.bus = bus;
+
+    for (addr = INA219_ADDR_MIN; addr <= INA219_ADDR_MAX && n < max; ++addr) {
+        // address only write, a device is there if it ACKs
+        twi_xfer_write(&probe, addr, NULL, 0);
+        twi_submit(&probe);
+        while (twi_xfer_pending(&probe))
+            ;
+
+        if (probe.status == TWI_XFER_OK)
+            ina219_dev_init(&devs[n++], bus, addr);
     }
+
+    return n;
 }
 
-static void ina219_timer_cb(void *data)
+bool ina219_read_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t *val)
 {
-    ina_dat.state = ERR_TIMEOUT;
+    ina_dev.addr = i2c_addr;
+    return ina219_dev_read(&ina_dev, reg_addr, val);
 }
 
 uint16_t ina219_get_reg(uint8_t i2c_addr, uint8_t reg_addr)
 {
-    ina_dat.state = READ_REG_ADDR;
-    twi_write(i2c_addr, &reg_addr, 1, ina219_i2c_cb);
-    while (ina_dat.state != READ_REG_VAL)
-        ;
-    twi_read(i2c_addr, 2, ina219_i2c_cb);
-    while (ina_dat.state != IDLE)
-        ;
+    uint16_t val = 0;
+
+    ina219_read_reg(i2c_addr, reg_addr, &val);
 
-    return ina_dat.value;
+    return val;
 }
 
-void ina219_set_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t val)
+bool ina219_set_reg(uint8_t i2c_addr, uint8_t reg_addr, uint16_t val)
 {
-    uint8_t buf[3];
+    ina_dev.addr = i2c_addr;
+    return ina219_dev_write(&ina_dev, reg_addr, val);
+}
 
-    buf[0] = reg_addr;
-    buf[1] = val >> 8;
-    buf[2] = val & 0xff;
+PT_THREAD(ina219_get_reg_pt(ina219_pt_t *ctx))
+{
+    PT_BEGIN(&ctx->pt);
 
-    ina_dat.state = WRITE_REG;
-    twi_write(i2c_addr, buf, sizeof(buf), ina219_i2c_cb);
-    while (ina_dat.state != IDLE)
-        ;
+    ctx->buf[0] = ctx->reg;
+    ctx->twi.bus = ctx->bus;
+    ctx->twi.prio = TWI_PRIO_HIGH;
+    twi_xfer_write_read(&ctx->twi.xfer, ctx->i2c_addr, &ctx->buf[0], 1, &ctx->buf[1], 2);
+    PT_SPAWN(&ctx->pt, &ctx->twi.pt, twi_xfer_pt(&ctx->twi));
+
+    ctx->status = ctx->twi.xfer.status;
+    if (ctx->status == TWI_XFER_OK)
+        ctx->value = (ctx->buf[1] << 8) | ctx->buf[2];
+
+    PT_END(&ctx->pt);
 }
 
-uint16_t ina219_get_busv(uint8_t i2c_addr)
+PT_THREAD(ina219_set_reg_pt(ina219_pt_t *ctx))
 {
-    uint16_t data = ina219_get_reg(INA219_ADDR, REG_BUSV);
+    PT_BEGIN(&ctx->pt);
+
+    ctx->buf[0] = ctx->reg;
+    ctx->buf[1] = ctx->value >> 8;
+    ctx->buf[2] = ctx->value & 0xff;
+    ctx->twi.bus = ctx->bus;
+    ctx->twi.prio = TWI_PRIO_HIGH;
+    ctx->twi.addr = ctx->i2c_addr;
+    ctx->twi.data = ctx->buf;
+    ctx->twi.length = sizeof(ctx->buf);
+    PT_SPAWN(&ctx->pt, &ctx->twi.pt, twi_write_pt(&ctx->twi));
 
-    return (data >> 3) * 4; // TODO cleanup
+    ctx->status = ctx->twi.xfer.status;
+
+    PT_END(&ctx->pt);
 }
 
-int32_t ina219_get_shuntv(uint8_t i2c_addr)
+bool ina219_calibrate_lsb(ina219_cal_t *cal, uint32_t shunt_uohm, uint32_t current_lsb_na)
 {
-    int16_t data = ina219_get_reg(INA219_ADDR, REG_SHUNTV);
+    uint64_t calib, lsb_pa;
+
+    if (shunt_uohm == 0 || current_lsb_na == 0)
+        return false;
 
-    return (int32_t)data * 10; // TODO cleanup
+    calib = INA219_CAL_K / ((uint64_t)current_lsb_na * shunt_uohm);
+    if (calib > 0xffff)
+        return false;
+    calib &= 0xfffe;
+    if (calib == 0)
+        return false;
+
+    // the LSB the truncated register gives, under 1 mA for Q0.32 scales
+    lsb_pa = INA219_CAL_K * 1000 / (calib * shunt_uohm);
+    if (lsb_pa >= 1000000000)
+        return false;
+
+    cal->shunt_uohm = shunt_uohm;
+    cal->current_lsb_pa = lsb_pa;
+    cal->current_scale = ((lsb_pa << 32) + 500000000) / 1000000000;
+    cal->power_scale = ((lsb_pa << 32) + 25000000000ULL) / 50000000000ULL; // 20 LSB, pW to W
+    cal->calib = calib;
+
+    return true;
 }
 
-int32_t ina219_get_current(uint8_t i2c_addr)
+bool ina219_calibrate(ina219_cal_t *cal, uint32_t shunt_uohm, uint32_t max_ua)
 {
-    int16_t data = ina219_get_reg(i2c_addr, REG_CURRENT);
+    // full scale is 2^15 current LSBs
+    return ina219_calibrate_lsb(cal, shunt_uohm, ((uint64_t)max_ua * 1000 + 32767) >> 15);
+}
 
-    return (int32_t)data * 100; // TODO cleanup
+/*
+ * Scale a register value by a Q0.32 unit per LSB to Q15.16, rounded
+ */
+static int32_t ina219_scale(int32_t val, uint32_t scale)
+{
+    return (int32_t)(((int64_t)val * scale + (1 << 15)) >> 16);
 }
 
-int32_t ina219_get_power(uint8_t i2c_addr)
+int32_t ina219_busv_q16(uint16_t reg)
 {
-    uint16_t data = ina219_get_reg(i2c_addr, REG_POWER);
-    int8_t sign = (int16_t)ina219_get_reg(i2c_addr, REG_CURRENT) >= 0 ? 1 : -1;
+    return ina219_scale(reg >> 3, INA219_BUSV_SCALE);
+}
 
-    return (int32_t)data * sign * 2; // TODO cleanup
+int32_t ina219_shuntv_q16(uint16_t reg)
+{
+    return ina219_scale((int16_t)reg, INA219_SHUNTV_SCALE);
+}
+
+int32_t ina219_current_q16(const ina219_cal_t *cal, uint16_t reg)
+{
+    return ina219_scale((int16_t)reg, cal->current_scale);
+}
+
+int32_t ina219_power_q16(const ina219_cal_t *cal, uint16_t reg, uint16_t current_reg)
+{
+    int32_t power = ina219_scale(reg, cal->power_scale);
+
+    return (int16_t)current_reg < 0 ? -power : power;
+}
+
+void ina219_measure(const ina219_cal_t *cal, const ina219_raw_t *raw, ina219_meas_t *meas)
+{
+    meas->busv = ina219_busv_q16(raw->busv);
+    meas->shuntv = ina219_shuntv_q16(raw->shuntv);
+    meas->current = ina219_current_q16(cal, raw->current);
+    meas->power = ina219_power_q16(cal, raw->power, raw->current);
+    meas->ovf = raw->busv & INA219_BUSV_OVF;
+}
+
+bool ina219_configure(uint8_t i2c_addr, uint16_t config)
+{
+    return ina219_set_reg(i2c_addr, REG_CONFIG, config);
+}
+
+uint32_t ina219_conv_us(uint16_t config)
+{
+    uint8_t mode = INA219_CFG_GET_MODE(config);
+    uint32_t us = 0;
+
+    if (mode & INA219_MODE_SHUNT)
+        us += ina_adc_us[INA219_CFG_GET_SADC(config)];
+    if (mode & INA219_MODE_BUS)
+        us += ina_adc_us[INA219_CFG_GET_BADC(config)];
+
+    return us;
+}
+
+void ina219_set_bus(twi_bus_t *bus)
+{
+    ina_dev.bus = bus;
+    ina_dev.xfer.bus = bus;
 }
 
 bool ina219_init(uint8_t i2c_addr)
 {
-    timer_init(&timer, TIMER_ONE_SHOT, ina219_timer_cb, NULL);
+    ina219_dev_init(&ina_dev, ina_dev.bus, i2c_addr);
 
-    ina219_set_reg(INA219_ADDR, REG_CALIB, INA219_CALIB);
-    if (ina219_get_reg(INA219_ADDR, REG_CALIB) != INA219_CALIB)
-        return false;
+    return ina219_dev_setup(&ina_dev);
+}
 
-    return true;
+bool ina219_get_measure(uint8_t i2c_addr, ina219_meas_t *meas)
+{
+    ina_dev.addr = i2c_addr;
+    return ina219_dev_measure(&ina_dev, meas);
 }
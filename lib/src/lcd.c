@@ -8,7 +8,9 @@
 #include "lcd.h"
 #include "twi.h"
 #include "gcnt.h"
+#include "timer.h"
 #include "util.h"
+#include "prof.h"
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -43,9 +45,19 @@ static uint8_t cgdata_batt[] = {
     0x0e, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, 0x00, // battery 100%
 };
 
+// DDRAM address of the start of each line
+static uint8_t line_offset[] = { 0x80, 0xC0, 0x94, 0xD4 };
+
 // state of backlight
 static bool backlight_on = true;
 
+// controller and descriptor for blocking writes to the backpack
+static twi_bus_t *lcd_bus;
+static twi_xfer_t lcd_xfer;
+static uint8_t lcd_byte;
+
+PROF_REGION(lcd_putch);
+
 // location of cursor
 static struct lcd_position {
     uint8_t ln;
@@ -62,7 +74,13 @@ static struct lcd_position {
  */
 static bool lcd_write (uint8_t value)
 {
-    twi_write(LCD_I2C_ADDR, &value, sizeof(value), NULL);
+    while (twi_xfer_pending(&lcd_xfer))
+        ;
+
+    lcd_byte = value;
+    twi_xfer_write(&lcd_xfer, LCD_I2C_ADDR, &lcd_byte, sizeof(lcd_byte));
+    lcd_xfer.bus = lcd_bus;
+    twi_submit(&lcd_xfer);
 
     return true;
 }
@@ -161,6 +179,15 @@ void lcd_write_cgram (lcd_cgset cgset)
     }
 }
 
+/*
+ * Select the I2C controller the backpack is on, NULL for the default one.
+ * Must be called before lcd_init() to take effect.
+ */
+void lcd_set_bus (twi_bus_t *bus)
+{
+    lcd_bus = bus;
+}
+
 /*
  * Initialize the io pins controlling the lcd and configure
  * the lcd with default settings. This MUST be called prior
@@ -168,6 +195,10 @@ void lcd_write_cgram (lcd_cgset cgset)
  */
 void lcd_init (void)
 {
+    twi_xfer_init(&lcd_xfer, NULL, NULL);
+    lcd_xfer.prio = TWI_PRIO_LOW; // display traffic yields to sensor reads
+    twi_set_speed(lcd_bus, LCD_I2C_ADDR, LCD_I2C_FREQ);
+
     // LCD initialization specified by controller doc
     delay_us(50000);
 
@@ -250,7 +281,6 @@ void lcd_home (void)
  */
 void lcd_move (uint8_t line, uint8_t chr)
 {
-    static uint8_t line_offset[] = { 0x80, 0xC0, 0x94, 0xD4 };
     pos.ln = line;
     pos.ch = chr;
 
@@ -268,6 +298,8 @@ void lcd_move (uint8_t line, uint8_t chr)
  */
 void lcd_putch (char c)
 {
+    PROF_BEGIN(lcd_putch);
+
     if (c == '\n')
     {
         pos.ln++;
@@ -284,6 +316,8 @@ void lcd_putch (char c)
         lcd_write_data(c);
         pos.ch++;
     }
+
+    PROF_END(lcd_putch);
 } /* end lcd_putch */
 
 /*
@@ -314,6 +348,104 @@ void lcd_puts (char *s)
     }
 }
 
+/*
+ * Pack both nibbles of a byte with their EN strobes into one transfer
+ */
+static void lcd_pack_byte (uint8_t *buf, uint8_t value, uint8_t mode)
+{
+    if (backlight_on)
+        mode |= (1 << LCD_BACKLIGHT);
+
+    buf[0] = lcd_map_nibble(value >> 4) | mode | (1 << LCD_EN);
+    buf[1] = lcd_map_nibble(value >> 4) | mode;
+    buf[2] = lcd_map_nibble(value & 0xF) | mode | (1 << LCD_EN);
+    buf[3] = lcd_map_nibble(value & 0xF) | mode;
+}
+
+/*
+ * Set up the coroutine context, must be called once before use
+ */
+void lcd_pt_init (lcd_pt_t *ctx)
+{
+    PT_INIT(&ctx->pt);
+    pt_timer_init(&ctx->delay);
+    ctx->twi.bus = lcd_bus;
+    ctx->twi.prio = TWI_PRIO_LOW;
+    ctx->twi.addr = LCD_I2C_ADDR;
+    ctx->twi.data = ctx->buf;
+    ctx->twi.length = LCD_PT_BYTE_LEN;
+}
+
+/*
+ * Write a command byte, clear and home take ~2 ms to execute
+ */
+PT_THREAD(lcd_cmd_pt (lcd_pt_t *ctx))
+{
+    PT_BEGIN(&ctx->pt);
+
+    lcd_pack_byte(ctx->buf, ctx->cmd, LCD_MODE_COMMAND);
+    ctx->twi.length = LCD_PT_BYTE_LEN;
+    PT_SPAWN(&ctx->pt, &ctx->twi.pt, twi_write_pt(&ctx->twi));
+
+    if (ctx->cmd == 0x01 || ctx->cmd == 0x02) {
+        pos.ln = 0;
+        pos.ch = 0;
+        pt_timer_set(&ctx->delay, TIMEOUT_IN_MS(2) + 1);
+        PT_WAIT_UNTIL(&ctx->pt, pt_timer_expired(&ctx->delay));
+    }
+
+    PT_END(&ctx->pt);
+}
+
+/*
+ * Move the cursor, see lcd_move()
+ */
+PT_THREAD(lcd_move_pt (lcd_pt_t *ctx))
+{
+    PT_BEGIN(&ctx->pt);
+
+    pos.ln = ctx->ln;
+    pos.ch = ctx->ch;
+    lcd_pack_byte(ctx->buf, line_offset[pos.ln] + pos.ch, LCD_MODE_COMMAND);
+    ctx->twi.length = LCD_PT_BYTE_LEN;
+    PT_SPAWN(&ctx->pt, &ctx->twi.pt, twi_write_pt(&ctx->twi));
+
+    PT_END(&ctx->pt);
+}
+
+/*
+ * Display a null terminated string, see lcd_putch()
+ *
+ * Characters are packed into the context buffer and sent as one transfer
+ * per buffer full rather than one per character.
+ */
+PT_THREAD(lcd_puts_pt (lcd_pt_t *ctx))
+{
+    uint32_t n;
+
+    PT_BEGIN(&ctx->pt);
+
+    while (*ctx->s) {
+        for (n = 0; *ctx->s && n < sizeof(ctx->buf); n += LCD_PT_BYTE_LEN, ctx->s++) {
+            if (*ctx->s == '\n') {
+                pos.ln++;
+                pos.ch = 0;
+                lcd_pack_byte(&ctx->buf[n], line_offset[pos.ln] + pos.ch, LCD_MODE_COMMAND);
+            } else if (*ctx->s == '\r') {
+                pos.ch = 0;
+                lcd_pack_byte(&ctx->buf[n], line_offset[pos.ln] + pos.ch, LCD_MODE_COMMAND);
+            } else {
+                lcd_pack_byte(&ctx->buf[n], *ctx->s, LCD_MODE_DATA);
+                pos.ch++;
+            }
+        }
+        ctx->twi.length = n;
+        PT_SPAWN(&ctx->pt, &ctx->twi.pt, twi_write_pt(&ctx->twi));
+    }
+
+    PT_END(&ctx->pt);
+}
+
 #ifdef LCD_INT_PUT_FUNCTIONS
 
 /* lcd_puti
@@ -0,0 +1,209 @@
+/*
+ * INA219 threshold monitoring with a GPO response
+ *
+ * Limits are evaluated on each sample in the I2C ISR that completes it, so
+ * the response is bounded by the poll period and one sample's register
+ * reads. A trip sets its output bits in the GPO channel's shadow and
+ * writes the channel before anything else, the global counter is read on
+ * either side of the evaluation and the write and the event, with the
+ * times from the sample start, is recorded after. Limits may share output
+ * bits, each bit is released once no tripped limit drives it.
+ *
+ * The GPO data registers are write only, so the service keeps the value of
+ * every channel and owns the whole of the channels its limits use.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "limit.h"
+#include "mbsoc.h"
+#include "tstamp.h"
+#include "util.h"
+#include <assert.h>
+
+
+#define LIMIT_EVENTS_MASK   (LIMIT_EVENTS - 1)
+
+
+static struct limit_data {
+    uint32_t            gpo[LIMIT_GPO_CHANS];
+    uint8_t             drivers[LIMIT_GPO_CHANS][32]; // tripped limits per bit
+    limit_event_t       events[LIMIT_EVENTS];
+    volatile uint32_t   ev_head;
+    uint32_t            ev_tail;
+    uint32_t            ev_dropped;
+} lim;
+
+
+void limit_svc_init (void)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    memset(&lim, 0, sizeof(lim));
+    CRITICAL_END();
+}
+
+void limit_add (list_t *set, limit_t *limit, const limit_cfg_t *cfg)
+{
+    CRITICAL_STORE;
+
+    assert(cfg->gpo >= 1 && cfg->gpo < LIMIT_GPO_CHANS);
+    assert(cfg->mask);
+    assert(cfg->under ? cfg->clear >= cfg->trip : cfg->clear <= cfg->trip);
+
+    limit->cfg = *cfg;
+    if (limit->cfg.debounce == 0)
+        limit->cfg.debounce = 1;
+    if (limit->cfg.release == 0)
+        limit->cfg.release = 1;
+    limit->count = 0;
+    limit->tripped = false;
+    memset(&limit->stats, 0, sizeof(limit->stats));
+
+    CRITICAL_START();
+    list_insert(set, &limit->link);
+    CRITICAL_END();
+}
+
+static int32_t limit_value (const limit_t *limit, const acq_sample_t *sample)
+{
+    int32_t current = (int16_t)sample->raw.current;
+
+    switch (limit->cfg.source) {
+        case LIMIT_SRC_CURRENT:
+            return current;
+        case LIMIT_SRC_BUSV:
+            return sample->raw.busv >> 3;
+        case LIMIT_SRC_POWER:
+            return current < 0 ? -(int32_t)sample->raw.power : sample->raw.power;
+    }
+
+    return 0;
+}
+
+static void limit_event (limit_t *limit, uint64_t tstamp, uint32_t detect, uint32_t out, int32_t val, bool trip)
+{
+    limit_event_t *event;
+
+    if (lim.ev_head - lim.ev_tail == LIMIT_EVENTS) {
+        lim.ev_dropped++;
+        return;
+    }
+
+    event = &lim.events[lim.ev_head & LIMIT_EVENTS_MASK];
+    event->limit = limit;
+    event->tstamp = tstamp;
+    event->detect_clks = detect - (uint32_t)tstamp;
+    event->output_clks = out - detect;
+    event->val = val;
+    event->trip = trip;
+    lim.ev_head++;
+}
+
+static void limit_trip (limit_t *limit, const acq_sample_t *sample, uint32_t detect, int32_t val)
+{
+    uint8_t ch = limit->cfg.gpo;
+    uint32_t mask = limit->cfg.mask;
+    uint32_t out;
+    uint8_t bit;
+
+    // respond first, the book keeping can wait
+    lim.gpo[ch] |= mask;
+    GPO(ch) = lim.gpo[ch];
+    out = tstamp_get32();
+
+    for (bit = 0; bit < 32; ++bit) {
+        if (mask & (1UL << bit))
+            lim.drivers[ch][bit]++;
+    }
+
+    limit->tripped = true;
+    limit->count = 0;
+    limit->stats.trips++;
+    if (detect - (uint32_t)sample->tstamp > limit->stats.max_detect_clks)
+        limit->stats.max_detect_clks = detect - (uint32_t)sample->tstamp;
+    if (out - detect > limit->stats.max_output_clks)
+        limit->stats.max_output_clks = out - detect;
+
+    limit_event(limit, sample->tstamp, detect, out, val, true);
+}
+
+static void limit_release (limit_t *limit, uint64_t tstamp, uint32_t detect, int32_t val)
+{
+    uint8_t ch = limit->cfg.gpo;
+    uint32_t mask = limit->cfg.mask;
+    uint8_t bit;
+
+    for (bit = 0; bit < 32; ++bit) {
+        if ((mask & (1UL << bit)) && --lim.drivers[ch][bit] == 0)
+            lim.gpo[ch] &= ~(1UL << bit);
+    }
+    GPO(ch) = lim.gpo[ch];
+
+    limit->tripped = false;
+    limit->count = 0;
+    limit->stats.clears++;
+
+    limit_event(limit, tstamp, detect, tstamp_get32(), val, false);
+}
+
+void limit_sample (list_t *set, const acq_sample_t *sample)
+{
+    uint32_t detect = tstamp_get32();
+    list_t *iter;
+
+    list_for_each(set, iter) {
+        limit_t *limit = (limit_t *)iter;
+        const limit_cfg_t *cfg = &limit->cfg;
+        int32_t val = limit_value(limit, sample);
+
+        if (!limit->tripped) {
+            if (!(cfg->under ? val < cfg->trip : val > cfg->trip))
+                limit->count = 0;
+            else if (++limit->count >= cfg->debounce)
+                limit_trip(limit, sample, detect, val);
+        } else if (!cfg->latch) {
+            if (!(cfg->under ? val > cfg->clear : val < cfg->clear))
+                limit->count = 0;
+            else if (++limit->count >= cfg->release)
+                limit_release(limit, sample->tstamp, detect, val);
+        }
+    }
+}
+
+void limit_clear (limit_t *limit)
+{
+    CRITICAL_STORE;
+    uint64_t now = gcnt_get();
+
+    CRITICAL_START();
+    if (limit->tripped)
+        limit_release(limit, now, (uint32_t)now, 0);
+    CRITICAL_END();
+}
+
+bool limit_get_event (limit_event_t *event)
+{
+    if (lim.ev_tail == lim.ev_head)
+        return false;
+
+    *event = lim.events[lim.ev_tail & LIMIT_EVENTS_MASK];
+    lim.ev_tail++;
+
+    return true;
+}
+
+void limit_get_stats (limit_t *limit, limit_stats_t *stats)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    *stats = limit->stats;
+    CRITICAL_END();
+}
+
+uint32_t limit_events_dropped (void)
+{
+    return lim.ev_dropped;
+}
@@ -0,0 +1,80 @@
+/*
+ * Cycle counting profiler
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "prof.h"
+#include "mbsoc.h"
+
+#ifdef CONFIG_PROF
+
+
+static prof_region_t *regions;
+
+
+void prof_record (prof_region_t *r, uint32_t cycles)
+{
+    if (!r->registered) {
+        CRITICAL_STORE;
+
+        CRITICAL_START();
+        r->next = regions;
+        regions = r;
+        r->registered = true;
+        CRITICAL_END();
+    }
+
+    r->count++;
+    r->total += cycles;
+    if (cycles < r->min)
+        r->min = cycles;
+    if (cycles > r->max)
+        r->max = cycles;
+    r->hist[log2_floor(cycles, PROF_HIST_BINS - 1)]++;
+}
+
+void prof_reset (void)
+{
+    prof_region_t *r;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    for (r = regions; r != NULL; r = r->next) {
+        r->count = 0;
+        r->total = 0;
+        r->min = UINT32_MAX;
+        r->max = 0;
+        memset(r->hist, 0, sizeof(r->hist));
+    }
+    CRITICAL_END();
+}
+
+void prof_dump (void)
+{
+    prof_region_t *r;
+    prof_region_t snap;
+    uint8_t i;
+    CRITICAL_STORE;
+
+    log("profile (cycles): name count min mean max");
+    for (r = regions; r != NULL; r = r->next) {
+        // copy so the line is consistent if an ISR records meanwhile
+        CRITICAL_START();
+        snap = *r;
+        CRITICAL_END();
+
+        if (snap.count == 0)
+            continue;
+
+        xil_printf("  %s %d %d %d %d\r\n  ", snap.name, snap.count, snap.min,
+                (uint32_t)(snap.total / snap.count), snap.max);
+        for (i = 0; i < PROF_HIST_BINS; ++i) {
+            if (snap.hist[i])
+                xil_printf(" %d:%d", i, snap.hist[i]);
+        }
+        xil_printf("\r\n");
+    }
+}
+
+#endif // CONFIG_PROF
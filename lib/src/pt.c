@@ -0,0 +1,85 @@
+/*
+ * Stackless coroutine scheduler
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "pt.h"
+#include "task.h"
+#include "mbsoc.h"
+#include <assert.h>
+
+
+static struct pt_sched_data {
+    list_t      threads;
+    task_t      task;
+} pt_data;
+
+
+/**
+ * Run every coroutine once
+ *
+ * Finished coroutines are dropped, yielded ones get another pass.
+ */
+static void pt_sched_run (void *data)
+{
+    list_t *iter, *next;
+    bool again = false;
+    char status;
+
+    list_for_each_safe(&pt_data.threads, iter, next) {
+        pt_thread_t *thread = (pt_thread_t *)iter;
+
+        status = thread->func(&thread->pt, thread->data);
+        if (status == PT_YIELDED)
+            again = true;
+        else if (status >= PT_EXITED)
+            list_delete(iter);
+    }
+
+    if (again)
+        pt_sched_wake();
+}
+
+static void pt_timer_cb (void *data)
+{
+    pt_timer_t *t = data;
+
+    t->expired = true;
+    pt_sched_wake();
+}
+
+void pt_sched_init (void)
+{
+    list_init_head(&pt_data.threads);
+    task_init(&pt_data.task, "coroutines", WORKQ_PRIO_NORMAL, pt_sched_run, NULL);
+}
+
+void pt_sched_start (pt_thread_t *thread, pt_thread_fn func, void *data)
+{
+    assert(thread && func);
+
+    PT_INIT(&thread->pt);
+    thread->func = func;
+    thread->data = data;
+    list_insert(&pt_data.threads, &thread->link);
+
+    pt_sched_wake();
+}
+
+void pt_sched_wake (void)
+{
+    task_post(&pt_data.task);
+}
+
+void pt_timer_init (pt_timer_t *t)
+{
+    t->expired = true;
+    timer_init(&t->timer, TIMER_ONE_SHOT, pt_timer_cb, t);
+}
+
+void pt_timer_set (pt_timer_t *t, uint32_t timeout)
+{
+    t->expired = false;
+    timer_set(&t->timer, timeout);
+}
@@ -0,0 +1,124 @@
+/*
+ * Cooperative run-to-completion tasks
+ *
+ * Tasks are run from the deferred work queue by task_loop(), in priority
+ * order. The MicroBlaze MCS core has no sleep instruction, so the loop
+ * spins while idle and accounts the idle time for the stats report.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "task.h"
+#include "mbsoc.h"
+#include <assert.h>
+
+
+static struct task_svc_data {
+    list_t      tasks;
+    uint64_t    idle;
+    uint64_t    start;
+} task_data;
+
+
+/**
+ * Work queue trampoline, times the task function
+ */
+static void task_run (void *data)
+{
+    task_t *task = data;
+    uint64_t start = gcnt_get();
+    uint32_t run;
+
+    task->func(task->data);
+
+    run = gcnt_get() - start;
+    task->runs++;
+    task->total_run += run;
+    if (run > task->max_run)
+        task->max_run = run;
+}
+
+/**
+ * Timer callback, runs in the tick ISR
+ */
+static void task_timer_cb (void *data)
+{
+    task_post(data);
+}
+
+void task_svc_init (void)
+{
+    list_init_head(&task_data.tasks);
+    task_data.idle = 0;
+    task_data.start = gcnt_get();
+}
+
+void task_init (task_t *task, const char *name, uint8_t prio, task_fn func, void *data)
+{
+    assert(task && func);
+
+    task->name = name;
+    task->func = func;
+    task->data = data;
+    task->runs = 0;
+    task->max_run = 0;
+    task->total_run = 0;
+
+    work_init(&task->work, prio, task_run, task);
+    timer_init(&task->timer, TIMER_ONE_SHOT, task_timer_cb, task);
+    list_insert(&task_data.tasks, &task->all);
+}
+
+bool task_post (task_t *task)
+{
+    return work_post(&task->work);
+}
+
+void task_set_period (task_t *task, uint32_t period)
+{
+    task->timer.flags = TIMER_PERIODIC;
+    timer_set(&task->timer, period);
+}
+
+void task_post_after (task_t *task, uint32_t timeout)
+{
+    task->timer.flags = TIMER_ONE_SHOT;
+    timer_set(&task->timer, timeout);
+}
+
+void task_cancel (task_t *task)
+{
+    timer_cancel(&task->timer);
+    work_cancel(&task->work);
+}
+
+void task_loop (void)
+{
+    uint64_t idle_start;
+
+    while (true) {
+        if (workq_run_one())
+            continue;
+
+        idle_start = gcnt_get();
+        while (workq_is_empty())
+            ;
+        task_data.idle += gcnt_get() - idle_start;
+    }
+}
+
+void task_dump_stats (void)
+{
+    list_t *iter;
+    uint64_t elapsed = gcnt_get() - task_data.start;
+
+    log("task stats, idle %d%%", (uint32_t)(task_data.idle * 100 / elapsed));
+    list_for_each(&task_data.tasks, iter) {
+        task_t *task = CONTAINER_OF(task_t, all, iter);
+        log("    %-12s runs: %d max run: %d us avg run: %d us max latency: %d us",
+                task->name, task->runs,
+                task->max_run / GCNT_TICKS_PER_US,
+                task->runs ? (uint32_t)(task->total_run / task->runs) / GCNT_TICKS_PER_US : 0,
+                task->work.max_latency / GCNT_TICKS_PER_US);
+    }
+}
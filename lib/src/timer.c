@@ -1,60 +1,337 @@
 /*
  * Timer services
  *
+ * Timers are kept in a hierarchical timing wheel. Level 0 has one slot per
+ * tick and each higher level has one slot per full revolution of the level
+ * below it. A timer is hashed into the lowest level which can hold its
+ * expiry, so scheduling and cancelling are O(1). When a lower level wraps,
+ * the matching slot of the next level is cascaded down.
+ *
+ * In tickless mode the wheel is only advanced when a PIT one-shot fires
+ * for the next tick with work on it, see TIMER_TICKLESS.
+ *
  * Copyright (c) 2022 Matt Liss
  * BSD-3-Clause
  */
 #include "timer.h"
 #include "mbsoc.h"
+#include "prof.h"
+#include "tstamp.h"
 #include <assert.h>
 
 
+#define WHEEL_LEVEL_SHIFT(l)    ((l) * TIMER_WHEEL_BITS)
+#define WHEEL_LEVEL_SPAN(l)     (1ULL << WHEEL_LEVEL_SHIFT((l) + 1))
+#define WHEEL_INDEX(t,l)        (((t) >> WHEEL_LEVEL_SHIFT(l)) & TIMER_WHEEL_MASK)
+
+#if defined(TIMER_TICKLESS) && PIT_PRESCALER(TIMER_PIT) > PIT_PRESCALER_FIT1
+#error "TIMER_PIT must count core clocks or FIT1 periods"
+#endif
+
+
 static struct timer_svc_data {
     uint64_t    tick;
-    list_t      timers;
+#ifdef TIMER_TICKLESS
+    uint64_t    tick_gcnt;  // global counter at the start of tick
+    uint64_t    next;       // tick the PIT is armed for
+    bool        in_isr;
+#endif
+    list_t      wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    list_t      overflow;
 } timer_data;
 
+PROF_REGION(timer_tick);
+
 
 /**
- * Timer tick ISR
+ * Hash a timer into the wheel based on its expiry
+ *
+ * *MUST* be called in a critical region
  */
-static void timer_tick (void *data)
+static void timer_enqueue (timer_t *timer)
 {
-    list_t *iter, *next;
+    uint64_t delta = timer->expire - timer_data.tick;
+    list_t *slot = &timer_data.overflow;
+    uint8_t level;
 
-    timer_data.tick++;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (delta < WHEEL_LEVEL_SPAN(level)) {
+            slot = &timer_data.wheel[level][WHEEL_INDEX(timer->expire, level)];
+            break;
+        }
+    }
+
+    list_insert(slot, &timer->link);
+}
 
-    /*
-     * check for expired timers
-     * loop can break after first unexpired timer because the list is ordered
-     */
-    list_for_each_safe(&timer_data.timers, iter, next) {
+/**
+ * Re-hash all timers in a slot into lower levels of the wheel
+ *
+ * *MUST* be called in a critical region
+ */
+static void timer_cascade (list_t *slot)
+{
+    list_t *iter;
+    list_t pending;
+
+    if (list_is_empty(slot))
+        return;
+
+    // detach the slot first, timers may hash back into the same list
+    pending.next = slot->next;
+    pending.prev = slot->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init_head(slot);
+
+    while ((iter = list_get_first(&pending)) != NULL)
+        timer_enqueue((timer_t *)iter);
+}
+
+/**
+ * Run cascades and expire timers for the current tick
+ *
+ * *MUST* be called in a critical region
+ */
+static void timer_process (void)
+{
+    list_t *slot;
+    list_t *iter;
+    uint8_t level;
+
+    // cascade each higher level whose lower neighbor just wrapped
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (WHEEL_INDEX(timer_data.tick, level - 1) != 0)
+            break;
+        timer_cascade(&timer_data.wheel[level][WHEEL_INDEX(timer_data.tick, level)]);
+    }
+    if (level == TIMER_WHEEL_LEVELS && WHEEL_INDEX(timer_data.tick, level - 1) == 0)
+        timer_cascade(&timer_data.overflow);
+
+    // everything left in the current level 0 slot expires on this tick
+    slot = &timer_data.wheel[0][WHEEL_INDEX(timer_data.tick, 0)];
+    while ((iter = list_get_first(slot)) != NULL) {
         timer_t *timer = (timer_t *)iter;
-        if (timer->expire == timer_data.tick) {
 
-            // remove from list and add again if periodic
-            list_delete(iter);
-            if (timer->flags & TIMER_PERIODIC) {
-                timer_set(timer, timer->timeout);
-            }
+        // re-arm periodic timers relative to the expiry to avoid drift
+        if (timer->flags & TIMER_PERIODIC) {
+            timer->expire += timer->timeout;
+            timer_enqueue(timer);
+        }
 
-            // invoke callback
+        // invoke callback or hand it off to the work queue
+        if (timer->flags & TIMER_DEFERRED)
+            work_post(&timer->work);
+        else
             timer->func(timer->data);
-        } else {
+    }
+}
+
+#ifdef TIMER_TICKLESS
+
+/**
+ * Current tick reconstructed from the global counter
+ *
+ * *MUST* be called in a critical region
+ */
+static uint64_t timer_now (void)
+{
+    uint32_t cycles = gcnt_get() - timer_data.tick_gcnt;
+
+    return timer_data.tick + cycles / TIMER_CLKS_PER_TICK;
+}
+
+/**
+ * Earliest expiry of the timers in a slot
+ *
+ * *MUST* be called in a critical region
+ */
+static uint64_t timer_slot_min (list_t *slot)
+{
+    uint64_t min = UINT64_MAX;
+    list_t *iter;
+
+    list_for_each(slot, iter) {
+        if (((timer_t *)iter)->expire < min)
+            min = ((timer_t *)iter)->expire;
+    }
+
+    return min;
+}
+
+/**
+ * Find the next tick on which the wheel has work to do
+ *
+ * With exact set this is the earliest timer expiry, which is what the PIT
+ * is armed for. Otherwise the tick on which the first occupied slot of a
+ * higher level is cascaded is returned, which is where the wheel has to
+ * stop while it is being advanced. Returns UINT64_MAX if the wheel is
+ * empty.
+ *
+ * *MUST* be called in a critical region
+ */
+static uint64_t timer_next_event (bool exact)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t base, event;
+    list_t *slot;
+    uint16_t level, k;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        base = timer_data.tick >> WHEEL_LEVEL_SHIFT(level);
+
+        // no slot on this level can beat what we already have
+        if (((base + 1) << WHEEL_LEVEL_SHIFT(level)) >= next)
             break;
+
+        for (k = 1; k <= TIMER_WHEEL_SLOTS; ++k) {
+            slot = &timer_data.wheel[level][(base + k) & TIMER_WHEEL_MASK];
+            if (!list_is_empty(slot)) {
+                if (exact && level > 0)
+                    event = timer_slot_min(slot);
+                else
+                    event = (base + k) << WHEEL_LEVEL_SHIFT(level);
+                if (event < next)
+                    next = event;
+                break;
+            }
         }
     }
+
+    if (!list_is_empty(&timer_data.overflow)) {
+        if (exact)
+            event = timer_slot_min(&timer_data.overflow);
+        else
+            event = ((timer_data.tick >> WHEEL_LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) + 1)
+                    << WHEEL_LEVEL_SHIFT(TIMER_WHEEL_LEVELS);
+        if (event < next)
+            next = event;
+    }
+
+    return next;
 }
 
+/**
+ * Step the wheel forward to a target tick, only stopping on ticks with work
+ *
+ * *MUST* be called in a critical region
+ */
+static void timer_advance (uint64_t target)
+{
+    uint64_t next;
+
+    while (timer_data.tick < target) {
+        next = timer_next_event(false);
+        if (next > target)
+            next = target;
+
+        timer_data.tick_gcnt += (uint32_t)(next - timer_data.tick) * TIMER_CLKS_PER_TICK;
+        timer_data.tick = next;
+        timer_process();
+    }
+}
+
+/**
+ * Arm the PIT as a one-shot for the next timer event
+ *
+ * *MUST* be called in a critical region
+ */
+static void timer_program (void)
+{
+    uint64_t next = timer_next_event(true);
+    uint32_t elapsed, cycles, counts;
+
+    if (next - timer_data.tick > TIMER_TICKLESS_MAX_SLEEP)
+        next = timer_data.tick + TIMER_TICKLESS_MAX_SLEEP;
+    timer_data.next = next;
+
+    // count from now, not from the start of the current tick
+    cycles = (uint32_t)(next - timer_data.tick) * TIMER_CLKS_PER_TICK;
+    elapsed = gcnt_get() - timer_data.tick_gcnt;
+    if (elapsed < cycles)
+        counts = (cycles - elapsed + TIMER_PIT_CLKS_PER_COUNT - 1) / TIMER_PIT_CLKS_PER_COUNT;
+    else
+        counts = 1;
+
+    XIOModule_Timer_Stop(&xio, PIT_TIMER(TIMER_PIT));
+    XIOModule_SetResetValue(&xio, PIT_TIMER(TIMER_PIT), counts);
+    XIOModule_Timer_Start(&xio, PIT_TIMER(TIMER_PIT));
+}
+
+/**
+ * PIT one-shot ISR
+ *
+ * The PIT may fire early when its prescaler is not phase aligned with the
+ * tick, in that case there is nothing to advance and it is simply re-armed.
+ */
+static void timer_wakeup (void *data)
+{
+    PROF_BEGIN(timer_tick);
+
+    tstamp_update();
+    timer_data.in_isr = true;
+    timer_advance(timer_now());
+    timer_data.in_isr = false;
+
+    timer_program();
+
+    PROF_END(timer_tick);
+}
+
+#else
+
+/**
+ * Current tick
+ */
+static uint64_t timer_now (void)
+{
+    return timer_data.tick;
+}
+
+/**
+ * Timer tick ISR
+ */
+static void timer_tick (void *data)
+{
+    PROF_BEGIN(timer_tick);
+
+    tstamp_update();
+    timer_data.tick++;
+    timer_process();
+
+    PROF_END(timer_tick);
+}
+
+#endif // TIMER_TICKLESS
+
 void timer_svc_init (void)
 {
+    uint16_t level, slot;
+
+    // the tick keeps the timestamp high word current
+    tstamp_init();
+
     // initialize data
     timer_data.tick = 0;
-    list_init_head(&timer_data.timers);
-
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+            list_init_head(&timer_data.wheel[level][slot]);
+    list_init_head(&timer_data.overflow);
+
+#ifdef TIMER_TICKLESS
+    timer_data.tick_gcnt = gcnt_get();
+    timer_data.in_isr = false;
+
+    // install one-shot wakeup isr and arm it
+    XIOModule_SetOptions(&xio, PIT_TIMER(TIMER_PIT), 0);
+    XIOModule_Connect(&xio, PIT_IRQ(TIMER_PIT), timer_wakeup, NULL);
+    XIOModule_Enable(&xio, PIT_IRQ(TIMER_PIT));
+    timer_program();
+#else
     // install tick isr
     XIOModule_Connect(&xio, XIN_IOMODULE_FIT_1_INTERRUPT_INTR, timer_tick, NULL);
     XIOModule_Enable(&xio, XIN_IOMODULE_FIT_1_INTERRUPT_INTR);
+#endif
 }
 
 void timer_init (timer_t *timer, uint8_t flags, timer_fn func, void *data)
@@ -67,64 +344,47 @@ void timer_init (timer_t *timer, uint8_t flags, timer_fn func, void *data)
     timer->func = func;
     timer->data = data;
     list_init_head(&timer->link);
+
+    if (flags & TIMER_DEFERRED)
+        work_init(&timer->work, WORKQ_PRIO_NORMAL, func, data);
 }
 
 /**
- * Helper to compare two timer timeouts
+ * Helper to check if a timer is linked into the wheel
  *
  * *MUST* be called in a critical region
  */
-static int8_t timer_cmp (timer_t *a, timer_t *b)
+static bool timer_linked (timer_t *timer)
 {
-    uint32_t a_time, b_time;
-
-    a_time = count32_sub(a->expire, timer_data.tick);
-    b_time = count32_sub(b->expire, timer_data.tick);
-
-    if (a_time > b_time) {
-        return 1;
-    } else if (a_time < b_time) {
-        return -1;
-    } else {
-        return 0;
-    }
+    return (timer->link.next != NULL) && (timer->link.next != &timer->link);
 }
 
 void timer_set (timer_t *timer, uint32_t timeout)
 {
-    list_t *iter;
     CRITICAL_STORE;
 
     assert(timer);
 
-    // make sure timer isn't already in list
-    timer_cancel(timer);
+    // a zero timeout expires on the next tick
+    if (timeout == 0)
+        timeout = 1;
 
-    // timer list shared with ISR
+    // timer wheel shared with ISR
     CRITICAL_START();
 
-    // update timer data (expiry rollover fine)
-    timer->timeout = timeout;
-    timer->expire = timer_data.tick + timeout;
+    // make sure timer isn't already scheduled
+    if (timer_linked(timer))
+        list_delete(&timer->link);
 
-    // insert at head if list empty
-    if (list_is_empty(&timer_data.timers)) {
-        list_add(&timer_data.timers, &timer->link);
-        CRITICAL_END();
-        return;
-    }
-
-    // insert timer in list in order of expiry
-    list_for_each(&timer_data.timers, iter) {
-        if (timer_cmp(timer, (timer_t *)iter) <= 0) {
-            list_insert(iter, &timer->link);
-            CRITICAL_END();
-            return;
-        }
-    }
+    timer->timeout = timeout;
+    timer->expire = timer_now() + timeout;
+    timer_enqueue(timer);
 
-    // loop fell through, insert at end of list
-    list_insert(&timer_data.timers, &timer->link);
+#ifdef TIMER_TICKLESS
+    // the wakeup ISR re-arms the PIT itself once callbacks are done
+    if (!timer_data.in_isr && timer->expire < timer_data.next)
+        timer_program();
+#endif
 
     CRITICAL_END();
 }
@@ -135,21 +395,39 @@ void timer_cancel (timer_t *timer)
     assert(timer);
 
     CRITICAL_START();
-    list_delete(&timer->link);
+    if (timer_linked(timer))
+        list_delete(&timer->link);
+    CRITICAL_END();
+
+    if (timer->flags & TIMER_DEFERRED)
+        work_cancel(&timer->work);
+}
+
+bool timer_is_pending (timer_t *timer)
+{
+    bool pending;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    pending = timer_linked(timer);
     CRITICAL_END();
+
+    return pending;
 }
 
 uint32_t timer_get_remaining (timer_t *timer)
 {
-    uint32_t exp, tick;
+    uint64_t remaining = 0;
+    uint64_t now;
     CRITICAL_STORE;
 
     CRITICAL_START();
-    exp = timer->expire;
-    tick = timer_data.tick;
+    now = timer_now();
+    if (timer_linked(timer) && timer->expire > now)
+        remaining = timer->expire - now;
     CRITICAL_END();
 
-    return count32_sub(exp, tick);
+    return remaining > UINT32_MAX ? UINT32_MAX : (uint32_t)remaining;
 }
 
 uint32_t timer_get_ticks (void)
@@ -158,7 +436,19 @@ uint32_t timer_get_ticks (void)
     CRITICAL_STORE;
 
     CRITICAL_START();
-    count = timer_data.tick;
+    count = timer_now();
+    CRITICAL_END();
+
+    return count;
+}
+
+uint64_t timer_get_ticks64 (void)
+{
+    uint64_t count;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    count = timer_now();
     CRITICAL_END();
 
     return count;
@@ -0,0 +1,226 @@
+/*
+ * Triggered capture of INA219 samples
+ *
+ * Samples are stored into the capture ring as they are acquired and the
+ * trigger condition is evaluated on each, so the samples before a trigger
+ * are already in place when it fires. A record is only the sample numbers
+ * of its first and trigger samples, it is closed once its post-trigger
+ * samples are stored and the engine is armed again on the next sample.
+ * Closed records pin the ring from their first sample, the producer never
+ * overwrites a pinned sample and drops samples instead until records are
+ * released. A trigger is only taken if its record fits in the ring along
+ * with those already pinned.
+ *
+ * The ring and records are written in the I2C ISR and read in thread
+ * context. A record's samples do not change while it is pinned and only
+ * the reader releases records, so reading out needs no locking.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "trig.h"
+#include "mbsoc.h"
+#include "util.h"
+#include <assert.h>
+
+
+#define TRIG_RECORDS_MASK   (TRIG_RECORDS - 1)
+
+
+void trig_init (trig_t *t, acq_sample_t *ring, uint32_t size)
+{
+    CRITICAL_STORE;
+
+    assert(ring);
+    assert(size && (size & (size - 1)) == 0);
+
+    CRITICAL_START();
+    memset(t, 0, sizeof(*t));
+    t->ring = ring;
+    t->size = size;
+    t->mask = size - 1;
+    CRITICAL_END();
+}
+
+void trig_arm (trig_t *t, const trig_cond_t *cond, uint32_t pre, uint32_t post)
+{
+    CRITICAL_STORE;
+
+    assert(pre + post < t->size);
+
+    CRITICAL_START();
+    t->cond = *cond;
+    t->pre = pre;
+    t->post = post;
+    t->prev_valid = false;
+    t->armed = true;
+    CRITICAL_END();
+}
+
+void trig_disarm (trig_t *t)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    t->armed = false;
+    CRITICAL_END();
+}
+
+static int32_t trig_value (const trig_t *t, const acq_sample_t *sample)
+{
+    int32_t current = (int16_t)sample->raw.current;
+
+    if (t->cond.source == TRIG_SRC_CURRENT)
+        return current;
+
+    return current < 0 ? -(int32_t)sample->raw.power : sample->raw.power;
+}
+
+static bool trig_met (const trig_t *t, int32_t val)
+{
+    const trig_cond_t *c = &t->cond;
+
+    switch (c->type) {
+        case TRIG_LEVEL_ABOVE:
+            return val > c->lo;
+        case TRIG_LEVEL_BELOW:
+            return val < c->lo;
+        case TRIG_EDGE_RISE:
+            return t->prev_valid && t->prev <= c->lo && val > c->lo;
+        case TRIG_EDGE_FALL:
+            return t->prev_valid && t->prev >= c->lo && val < c->lo;
+        case TRIG_WINDOW_OUT:
+            return val < c->lo || val > c->hi;
+        case TRIG_WINDOW_IN:
+            return val >= c->lo && val <= c->hi;
+    }
+
+    return false;
+}
+
+/**
+ * Oldest sample that must not be overwritten, returns false if none is
+ * pinned
+ */
+static bool trig_pin (const trig_t *t, uint32_t *pin)
+{
+    if (t->rec_tail != t->rec_head) {
+        *pin = t->records[t->rec_tail & TRIG_RECORDS_MASK].start;
+        return true;
+    }
+    if (t->capturing) {
+        *pin = t->cur.start;
+        return true;
+    }
+
+    return false;
+}
+
+static void trig_close (trig_t *t)
+{
+    t->records[t->rec_head & TRIG_RECORDS_MASK] = t->cur;
+    t->rec_head++;
+    t->capturing = false;
+}
+
+/**
+ * Take a trigger on the sample just stored, if its record fits
+ */
+static void trig_fire (trig_t *t, uint32_t seq, uint64_t tstamp)
+{
+    uint32_t pre = t->fill - 1 < t->pre ? t->fill - 1 : t->pre;
+    uint32_t pin;
+
+    // a record never starts before the oldest queued one, even if pre was
+    // raised since, so that one start pins every sample still needed
+    if (trig_pin(t, &pin)) {
+        if (seq - pin < pre)
+            pre = seq - pin;
+    } else {
+        pin = seq - pre;
+    }
+
+    if (t->rec_head - t->rec_tail == TRIG_RECORDS || seq + t->post - pin >= t->size) {
+        t->stats.missed++;
+        return;
+    }
+
+    t->cur.start = seq - pre;
+    t->cur.trigger = seq;
+    t->cur.count = pre + 1 + t->post;
+    t->cur.tstamp = tstamp;
+    t->stats.triggers++;
+
+    if (t->post)
+        t->capturing = true;
+    else
+        trig_close(t);
+}
+
+void trig_sample (trig_t *t, const acq_sample_t *sample)
+{
+    uint32_t seq = t->head;
+    int32_t val = trig_value(t, sample);
+    uint32_t pin;
+
+    if (trig_pin(t, &pin) && seq - pin >= t->size) {
+        t->stats.lost++;
+        t->prev_valid = false; // no edge across the gap
+        return;
+    }
+
+    t->ring[seq & t->mask] = *sample;
+    t->head = seq + 1;
+    if (t->fill < t->size)
+        t->fill++;
+
+    if (t->capturing) {
+        if (seq - t->cur.trigger == t->post)
+            trig_close(t);
+    } else if (t->armed && trig_met(t, val)) {
+        trig_fire(t, seq, sample->tstamp);
+    }
+
+    t->prev = val;
+    t->prev_valid = true;
+}
+
+bool trig_get (trig_t *t, trig_record_t *rec)
+{
+    if (t->rec_tail == t->rec_head)
+        return false;
+
+    *rec = t->records[t->rec_tail & TRIG_RECORDS_MASK];
+
+    return true;
+}
+
+uint32_t trig_copy (trig_t *t, const trig_record_t *rec, uint32_t offset, acq_sample_t *buf, uint32_t n)
+{
+    uint32_t i;
+
+    if (offset >= rec->count)
+        return 0;
+    if (n > rec->count - offset)
+        n = rec->count - offset;
+
+    for (i = 0; i < n; ++i)
+        buf[i] = t->ring[(rec->start + offset + i) & t->mask];
+
+    return n;
+}
+
+void trig_release (trig_t *t)
+{
+    if (t->rec_tail != t->rec_head)
+        t->rec_tail++;
+}
+
+void trig_get_stats (trig_t *t, trig_stats_t *stats)
+{
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    *stats = t->stats;
+    CRITICAL_END();
+}
@@ -0,0 +1,128 @@
+/*
+ * Timestamps and division free cycle conversions
+ *
+ * The core is built without a hardware multiplier or divider, so every
+ * division by a clock rate is a long libgcc shift/subtract loop. Here
+ * those divisions are replaced by a multiply with a fixed point
+ * reciprocal computed at compile time from the core clock frequency.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "tstamp.h"
+#include "mbsoc.h"
+#include "util.h"
+
+
+#define BENCH_ITER      1000
+
+
+static struct tstamp_data {
+    uint32_t    hi;
+    uint32_t    last_lo;
+} tstamp_data;
+
+
+void tstamp_init (void)
+{
+    uint64_t now = gcnt_get();
+
+    tstamp_data.hi = now >> 32;
+    tstamp_data.last_lo = now;
+}
+
+uint64_t tstamp_get (void)
+{
+    uint32_t lo, hi;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    lo = GCNT_LO;
+    if (lo < tstamp_data.last_lo)
+        tstamp_data.hi++;
+    tstamp_data.last_lo = lo;
+    hi = tstamp_data.hi;
+    CRITICAL_END();
+
+    return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * Scale a 64-bit count by a 32-bit reciprocal with shift >= 32
+ *
+ * floor((hi * 2^32 + lo) * mult / 2^shift) is computed as
+ * floor((hi * mult + floor(lo * mult / 2^32)) / 2^(shift - 32)), which
+ * needs no more than 64-bit intermediates.
+ */
+static inline uint64_t tstamp_scale (uint64_t cycles, uint32_t mult, uint8_t shift)
+{
+    uint64_t hi = (uint64_t)(uint32_t)(cycles >> 32) * mult;
+    uint64_t lo = (uint64_t)(uint32_t)cycles * mult;
+
+    return (hi + (lo >> 32)) >> (shift - 32);
+}
+
+uint64_t tstamp_to_us (uint64_t cycles)
+{
+    return tstamp_scale(cycles, TSTAMP_RECIP_MULT(TSTAMP_CLKS_PER_US),
+            TSTAMP_RECIP_SHIFT(TSTAMP_CLKS_PER_US));
+}
+
+uint64_t tstamp_to_ms (uint64_t cycles)
+{
+    return tstamp_scale(cycles, TSTAMP_RECIP_MULT(TSTAMP_CLKS_PER_MS),
+            TSTAMP_RECIP_SHIFT(TSTAMP_CLKS_PER_MS));
+}
+
+void tstamp_bench (void)
+{
+    volatile uint32_t in32 = 0x12345678;
+    volatile uint64_t in64 = 0x123456789abcULL;
+    volatile uint64_t sink;
+    uint32_t start, div, recip;
+    int i;
+
+    log("tstamp bench, cycles per call (divide vs reciprocal)");
+
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = in32 / TSTAMP_CLKS_PER_US;
+    div = tstamp_get32() - start;
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = tstamp_cycles_to_us(in32);
+    recip = tstamp_get32() - start;
+    log("    us32:  %d vs %d", div / BENCH_ITER, recip / BENCH_ITER);
+
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = in32 / TSTAMP_CLKS_PER_MS;
+    div = tstamp_get32() - start;
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = tstamp_cycles_to_ms(in32);
+    recip = tstamp_get32() - start;
+    log("    ms32:  %d vs %d", div / BENCH_ITER, recip / BENCH_ITER);
+
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = in64 / TSTAMP_CLKS_PER_US;
+    div = tstamp_get32() - start;
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = tstamp_to_us(in64);
+    recip = tstamp_get32() - start;
+    log("    us64:  %d vs %d", div / BENCH_ITER, recip / BENCH_ITER);
+
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = gcnt_get();
+    div = tstamp_get32() - start;
+    start = tstamp_get32();
+    for (i = 0; i < BENCH_ITER; ++i)
+        sink = tstamp_get();
+    recip = tstamp_get32() - start;
+    log("    read:  %d vs %d (gcnt_get vs tstamp_get)", div / BENCH_ITER, recip / BENCH_ITER);
+
+    (void)sink;
+}
@@ -8,9 +8,15 @@
  * BSD-3-Clause
  */
 #include "twi.h"
+#include "mbsoc.h"
 #include "xparameters.h"
 #include "xiomodule.h"
 #include "oc_i2c_master.h"
+#include "prof.h"
+#include "timer.h"
+#include "tstamp.h"
+#include "util.h"
+#include <assert.h>
 
 #include <string.h>
 
@@ -24,141 +30,865 @@ enum oc_i2c_state {
     I2C_ADDR_WAIT,
     I2C_TX_WAIT,
     I2C_RX_WAIT,
+    I2C_RX_START,
     I2C_DONE,
+    I2C_RECOVER_CLOCK,
+    I2C_RECOVER_STOP,
     I2C_STATE_MAX
 };
 
 
-static volatile uint8_t busy;
+/*
+ * Controllers, the default one is the first initialized
+ */
+static twi_bus_t twi_bus0;
+static twi_bus_t *twi_default;
+static list_t twi_buses = LIST_INIT_HEAD(twi_buses);
+
+/*
+ * Blocking transfer state
+ */
 static struct {
-    uint8_t state;
-    uint8_t buffer[TWI_BUFFER_LENGTH];
-    uint8_t length;
-    uint8_t index;
+    twi_xfer_t      xfer;
+    uint8_t         buffer[TWI_BUFFER_LENGTH];
     void (*callback)(uint8_t, uint8_t *);
 } transmission;
 
 
+/*
+ * Length of a utilization window slot
+ */
+#define TWI_STATS_SLOT_CLKS \
+    ((uint32_t)((uint64_t)TWI_STATS_WINDOW_MS * TSTAMP_CLKS_PER_MS / TWI_STATS_WINDOW_SLOTS))
+
+/*
+ * Queue wait after which a transfer is serviced ahead of higher classes
+ */
+#define TWI_AGE_CLKS    ((uint64_t)TWI_AGE_MS * TSTAMP_CLKS_PER_MS)
+
+PROF_REGION(twi_isr);
+
+
 void twi_isr(void *data);
+static void twi_timeout(void *data);
+static void twi_blocking_done(twi_xfer_t *xfer, uint8_t status);
+
+
+static twi_bus_t *twi_bus_get(twi_bus_t *bus) {
+    return bus != NULL ? bus : twi_default;
+}
+
+/*
+ * Prescaler value for an SCL frequency, the core divides the clock by
+ * 5 * (prescale + 1)
+ */
+static uint16_t twi_prescale(uint32_t freq) {
+    uint32_t prescale = XPAR_CPU_CORE_CLOCK_FREQ_HZ / (5 * freq);
+
+    if (prescale == 0)
+        return 0;
+    if (prescale > 0x10000)
+        return 0xffff;
+
+    return (uint16_t)(prescale - 1);
+}
 
+/*
+ * Program the prescaler, the core must be disabled while it changes
+ *
+ * *MUST* be called in a critical region or from the ISR with the bus idle
+ */
+static void twi_set_prescale(twi_bus_t *bus, uint16_t prescale) {
+    OC_I2C_WRITE(bus->base, CTR, 0);
+    OC_I2C_WRITE(bus->base, PRER_LO, (uint8_t)prescale);
+    OC_I2C_WRITE(bus->base, PRER_HI, (uint8_t)(prescale>>8));
+    OC_I2C_WRITE(bus->base, CTR, OC_I2C_EN | OC_I2C_IEN);
+    bus->prer = prescale;
+}
 
 void twi_init(XIOModule *xio) {
-    uint16_t prescale = (XPAR_CPU_CORE_CLOCK_FREQ_HZ / (5 * TWI_FREQ)) - 1;
+    twi_bus_init(&twi_bus0, xio, "i2c0", OC_I2C_BASE, OC_I2C_IRQ, TWI_FREQ);
 
-    busy = 0;
-    transmission.state = I2C_IDLE;
+    twi_xfer_init(&transmission.xfer, twi_blocking_done, NULL);
+    transmission.xfer.bus = &twi_bus0;
     memset(transmission.buffer, 0, TWI_BUFFER_LENGTH);
+}
+
+void twi_bus_init(twi_bus_t *bus, XIOModule *xio, const char *name,
+                  uintptr_t base, uint8_t irq, uint32_t freq) {
+    uint8_t i;
+
+    assert(bus);
+
+    bus->name = name;
+    bus->base = base;
+    bus->irq = irq;
+    bus->prescale = twi_prescale(freq);
+    bus->nspeed = 0;
 
-    XIOModule_Connect(xio, OC_I2C_IRQ, twi_isr, NULL);
-    XIOModule_Enable(xio, OC_I2C_IRQ);
+    for (i = 0; i < TWI_PRIO_MAX; ++i)
+        list_init_head(&bus->queue[i]);
+    bus->cur = NULL;
+    bus->state = I2C_IDLE;
+    bus->seg = 0;
+    bus->index = 0;
+    bus->remain = 0;
+    timer_init(&bus->timeout, TIMER_ONE_SHOT, twi_timeout, bus);
 
-    OC_I2C_REG(PRER_LO) = (uint8_t)prescale;
-    OC_I2C_REG(PRER_HI) = (uint8_t)(prescale>>8);
-    OC_I2C_REG(CTR) = OC_I2C_EN | OC_I2C_IEN;
+    twi_stats_reset(bus);
+    twi_set_prescale(bus, bus->prescale);
+
+    if (twi_default == NULL)
+        twi_default = bus;
+    list_insert(&twi_buses, &bus->link);
+
+    XIOModule_Connect(xio, irq, twi_isr, bus);
+    XIOModule_Enable(xio, irq);
 }
 
-uint8_t *twi_wait(void) {
-    while (busy)
-        ;
-    return &transmission.buffer[1];
+bool twi_set_speed(twi_bus_t *bus, uint8_t addr, uint32_t freq) {
+    uint16_t prescale = twi_prescale(freq);
+    uint8_t i;
+    bool ok = true;
+    CRITICAL_STORE;
+
+    bus = twi_bus_get(bus);
+    assert(bus);
+
+    // table read by twi_submit() in callbacks
+    CRITICAL_START();
+    for (i = 0; i < bus->nspeed; ++i) {
+        if (bus->speed[i].addr == addr)
+            break;
+    }
+    if (i < bus->nspeed) {
+        bus->speed[i].prescale = prescale;
+    } else if (bus->nspeed < TWI_SPEED_DEVICES) {
+        bus->speed[i].addr = addr;
+        bus->speed[i].prescale = prescale;
+        bus->nspeed++;
+    } else {
+        ok = false;
+    }
+    CRITICAL_END();
+
+    return ok;
+}
+
+bool twi_busy(twi_bus_t *bus) {
+    uint8_t i;
+
+    bus = twi_bus_get(bus);
+    if (bus->cur != NULL)
+        return true;
+
+    for (i = 0; i < TWI_PRIO_MAX; ++i) {
+        if (!list_is_empty(&bus->queue[i]))
+            return true;
+    }
+
+    return false;
+}
+
+void twi_xfer_init(twi_xfer_t *xfer, twi_xfer_fn callback, void *data) {
+    assert(xfer);
+
+    list_init_head(&xfer->link);
+    xfer->bus = NULL;
+    xfer->prio = TWI_PRIO_NORMAL;
+    xfer->addr = 0;
+    xfer->status = TWI_XFER_IDLE;
+    xfer->wr_nseg = 0;
+    xfer->rd_nseg = 0;
+    xfer->wr = NULL;
+    xfer->rd = NULL;
+    xfer->callback = callback;
+    xfer->data = data;
+}
+
+void twi_xfer_write(twi_xfer_t *xfer, uint8_t addr, uint8_t *data, uint32_t length) {
+    twi_xfer_write_read(xfer, addr, data, length, NULL, 0);
+}
+
+void twi_xfer_read(twi_xfer_t *xfer, uint8_t addr, uint8_t *data, uint32_t length) {
+    twi_xfer_write_read(xfer, addr, NULL, 0, data, length);
+}
+
+void twi_xfer_write_read(twi_xfer_t *xfer, uint8_t addr, uint8_t *wr_data, uint32_t wr_len,
+                         uint8_t *rd_data, uint32_t rd_len) {
+    xfer->seg[0].data = wr_data;
+    xfer->seg[0].length = wr_len;
+    xfer->seg[1].data = rd_data;
+    xfer->seg[1].length = rd_len;
+
+    twi_xfer_sg(xfer, addr, &xfer->seg[0], wr_len ? 1 : 0, &xfer->seg[1], rd_len ? 1 : 0);
+}
+
+void twi_xfer_sg(twi_xfer_t *xfer, uint8_t addr, twi_seg_t *wr, uint8_t wr_nseg,
+                 twi_seg_t *rd, uint8_t rd_nseg) {
+    assert(!twi_xfer_pending(xfer));
+
+    xfer->addr = addr;
+    xfer->wr = wr;
+    xfer->wr_nseg = wr_nseg;
+    xfer->rd = rd;
+    xfer->rd_nseg = rd_nseg;
+}
+
+bool twi_xfer_pending(twi_xfer_t *xfer) {
+    return xfer->status == TWI_XFER_QUEUED || xfer->status == TWI_XFER_ACTIVE;
+}
+
+/*
+ * Total length of a segment list
+ */
+static uint32_t twi_seg_length(twi_seg_t *segs, uint8_t nseg) {
+    uint32_t length = 0;
+
+    while (nseg--)
+        length += segs[nseg].length;
+
+    return length;
 }
 
-void twi_done(void) {
-    uint8_t address = transmission.buffer[0] >> 1;
-    uint8_t *data = &transmission.buffer[1];
+/*
+ * Point at the next byte of the current phase, skipping empty segments
+ */
+static uint8_t *twi_seg_next(twi_bus_t *bus, twi_seg_t *segs) {
+    while (bus->index >= segs[bus->seg].length) {
+        ++bus->seg;
+        bus->index = 0;
+    }
+
+    --bus->remain;
+    ++bus->count;
+    return &segs[bus->seg].data[bus->index++];
+}
+
+/*
+ * Reset the segment cursor for a transfer phase
+ */
+static void twi_seg_start(twi_bus_t *bus, twi_seg_t *segs, uint8_t nseg) {
+    bus->seg = 0;
+    bus->index = 0;
+    bus->remain = twi_seg_length(segs, nseg);
+}
+
+/*
+ * Send the address byte to start the read phase of the current descriptor,
+ * after a write phase this is a repeated START
+ */
+static void twi_start_read(twi_bus_t *bus) {
+    twi_seg_start(bus, bus->cur->rd, bus->cur->rd_nseg);
+    bus->state = I2C_ADDR_WAIT;
+    OC_I2C_WRITE(bus->base, TXR, (bus->cur->addr << 1) | TW_READ);
+    OC_I2C_WRITE(bus->base, CR, OC_I2C_STA | OC_I2C_WR);
+}
+
+/*
+ * Pick the next descriptor, the head of the highest non-empty class unless
+ * a lower class head is older and has waited past the aging limit
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static twi_xfer_t *twi_pick_next(twi_bus_t *bus, uint64_t now) {
+    twi_xfer_t *head, *next = NULL;
+    uint8_t prio;
 
-    busy = 0;
+    for (prio = 0; prio < TWI_PRIO_MAX; ++prio) {
+        if (list_is_empty(&bus->queue[prio]))
+            continue;
 
-    if (transmission.callback != NULL) {
-        transmission.callback(address, data);
+        head = (twi_xfer_t *)bus->queue[prio].next;
+        if (next == NULL) {
+            next = head;
+        } else if (head->queued < next->queued && now - head->queued > TWI_AGE_CLKS) {
+            next = head;
+            bus->stats.aged[prio]++;
+        }
     }
+
+    if (next != NULL)
+        list_delete(&next->link);
+
+    return next;
+}
+
+/*
+ * Start the next queued descriptor if the bus is idle
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static void twi_start_next(twi_bus_t *bus) {
+    twi_xfer_t *xfer;
+    uint64_t now;
+    uint32_t wait;
+
+    if (bus->cur != NULL)
+        return;
+
+    now = gcnt_get();
+    xfer = twi_pick_next(bus, now);
+    if (xfer == NULL)
+        return;
+
+    xfer->status = TWI_XFER_ACTIVE;
+    bus->cur = xfer;
+    bus->error = TWI_XFER_OK;
+    bus->count = 0;
+
+    wait = now - xfer->queued > UINT32_MAX ? UINT32_MAX : (uint32_t)(now - xfer->queued);
+    if (wait > bus->stats.max_wait[xfer->prio])
+        bus->stats.max_wait[xfer->prio] = wait;
+
+    // the previous transfer ended with a STOP so the bus is free to retune
+    if (xfer->prescale != bus->prer) {
+        twi_set_prescale(bus, xfer->prescale);
+        bus->stats.retunes++;
+    }
+
+    bus->started = gcnt_get();
+    timer_set(&bus->timeout, xfer->timeout);
+
+    if (twi_seg_length(xfer->wr, xfer->wr_nseg) == 0 &&
+        twi_seg_length(xfer->rd, xfer->rd_nseg) != 0) {
+        twi_start_read(bus);
+        return;
+    }
+
+    twi_seg_start(bus, xfer->wr, xfer->wr_nseg);
+    bus->state = I2C_TX_WAIT;
+    OC_I2C_WRITE(bus->base, TXR, (xfer->addr << 1) | TW_WRITE);
+    OC_I2C_WRITE(bus->base, CR, OC_I2C_STA | OC_I2C_WR);
+}
+
+/*
+ * Find or allocate the counters for a device address
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static twi_dev_stats_t *twi_stats_dev(twi_stats_t *stats, uint8_t addr, bool alloc) {
+    uint8_t i;
+
+    for (i = 0; i < stats->ndev; ++i) {
+        if (stats->dev[i].addr == addr)
+            return &stats->dev[i];
+    }
+
+    if (!alloc || stats->ndev == TWI_STATS_DEVICES)
+        return NULL;
+
+    stats->dev[stats->ndev].addr = addr;
+    return &stats->dev[stats->ndev++];
+}
+
+/*
+ * Move the utilization window forward to now, clearing expired slots
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static void twi_stats_advance(twi_stats_t *stats, uint64_t now) {
+    uint8_t n = 0;
+
+    while (now >= stats->slot_end) {
+        if (++n > TWI_STATS_WINDOW_SLOTS) {
+            // idle for more than the window, every slot is already clear
+            stats->slot_end = now + TWI_STATS_SLOT_CLKS;
+            break;
+        }
+        stats->slot = (stats->slot + 1) & (TWI_STATS_WINDOW_SLOTS - 1);
+        stats->busy[stats->slot] = 0;
+        stats->slot_end += TWI_STATS_SLOT_CLKS;
+    }
+}
+
+/*
+ * Account a finished descriptor
+ *
+ * Busy time is credited to the slot the transfer finished in.
+ */
+static void twi_stats_record(twi_bus_t *bus, twi_xfer_t *xfer) {
+    twi_stats_t *stats = &bus->stats;
+    twi_dev_stats_t *dev;
+    uint64_t now = gcnt_get();
+    uint64_t latency = now - xfer->queued;
+    uint32_t us;
+
+    twi_stats_advance(stats, now);
+    stats->busy[stats->slot] += (uint32_t)(now - bus->started);
+
+    dev = twi_stats_dev(stats, xfer->addr, true);
+    if (dev == NULL) {
+        stats->untracked++;
+        return;
+    }
+
+    dev->xfers++;
+    dev->bytes += bus->count;
+    if (xfer->status == TWI_XFER_NACK)
+        dev->nacks++;
+    else if (xfer->status != TWI_XFER_OK)
+        dev->errors++;
+
+    us = latency > UINT32_MAX ? UINT32_MAX : tstamp_cycles_to_us((uint32_t)latency);
+    if (us > dev->max_latency)
+        dev->max_latency = us;
+    dev->hist[log2_floor(us, TWI_STATS_HIST_BINS - 1)]++;
+}
+
+/*
+ * Finish the current descriptor and keep the bus going before calling back
+ */
+static void twi_complete(twi_bus_t *bus) {
+    twi_xfer_t *xfer = bus->cur;
+
+    // stays pending until the bus is free again
+    xfer->status = bus->error;
+
+    timer_cancel(&bus->timeout);
+    twi_stats_record(bus, xfer);
+
+    bus->cur = NULL;
+    bus->state = I2C_IDLE;
+    twi_start_next(bus);
+
+    if (xfer->callback != NULL)
+        xfer->callback(xfer, xfer->status);
+}
+
+/*
+ * Fail the current descriptor and free the bus
+ *
+ * The core is reset to drop the command in progress, then nine SCL clocks
+ * let a slave that was driving SDA in the middle of a byte finish it and a
+ * STOP returns the bus to idle. The descriptor completes once the STOP is
+ * sent, or on the next timeout if SCL is held low.
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static void twi_recover(twi_bus_t *bus, uint8_t status) {
+    bus->error = status;
+    bus->stats.recoveries++;
+
+    twi_set_prescale(bus, bus->prer);
+    OC_I2C_WRITE(bus->base, CR, OC_I2C_IACK);
+
+    // read with NACK drives nine clocks and leaves SDA released
+    bus->state = I2C_RECOVER_CLOCK;
+    OC_I2C_WRITE(bus->base, CR, OC_I2C_RD | OC_I2C_ACK);
+    timer_set(&bus->timeout, TIMEOUT_IN_MS(TWI_TIMEOUT_MS) + 1);
+}
+
+/*
+ * Transfer deadline, runs in the tick ISR
+ */
+static void twi_timeout(void *data) {
+    twi_bus_t *bus = data;
+
+    if (bus->cur == NULL)
+        return;
+
+    bus->stats.timeouts++;
+
+    if (bus->state == I2C_RECOVER_CLOCK || bus->state == I2C_RECOVER_STOP) {
+        // SCL still held, give up on the bus for this transfer
+        twi_set_prescale(bus, bus->prer);
+        OC_I2C_WRITE(bus->base, CR, OC_I2C_IACK);
+        twi_complete(bus);
+        return;
+    }
+
+    twi_recover(bus, TWI_XFER_TIMEOUT);
+}
+
+/*
+ * SCL clocks of a transfer, nine per byte including the address bytes,
+ * plus START, repeated START and STOP
+ */
+static uint32_t twi_wire_bits(uint32_t wr, uint32_t rd) {
+    return 9 * (wr + rd + 1 + (wr && rd ? 1 : 0)) + 3;
+}
+
+/*
+ * Deadline for a descriptor in ticks, its time on the wire at the device
+ * speed plus the TWI_TIMEOUT_MS margin
+ */
+static uint32_t twi_deadline(twi_xfer_t *xfer) {
+    uint32_t bits = twi_wire_bits(twi_seg_length(xfer->wr, xfer->wr_nseg),
+                                  twi_seg_length(xfer->rd, xfer->rd_nseg));
+    uint32_t bit_us = 5 * ((uint32_t)xfer->prescale + 1) / TSTAMP_CLKS_PER_US + 1;
+
+    // ~ms, rounded up by the margin
+    return TIMEOUT_IN_MS((bits * bit_us >> 10) + 1 + TWI_TIMEOUT_MS) + 1;
+}
+
+/*
+ * Prescaler for a device, its own speed or the bus default
+ *
+ * *MUST* be called in a critical region or from the ISR
+ */
+static uint16_t twi_dev_prescale(twi_bus_t *bus, uint8_t addr) {
+    uint8_t i;
+
+    for (i = 0; i < bus->nspeed; ++i) {
+        if (bus->speed[i].addr == addr)
+            return bus->speed[i].prescale;
+    }
+
+    return bus->prescale;
+}
+
+uint32_t twi_xfer_clks(twi_bus_t *bus, uint8_t addr, uint32_t wr, uint32_t rd) {
+    uint16_t prescale;
+    CRITICAL_STORE;
+
+    bus = twi_bus_get(bus);
+    assert(bus);
+
+    CRITICAL_START();
+    prescale = twi_dev_prescale(bus, addr);
+    CRITICAL_END();
+
+    return twi_wire_bits(wr, rd) * 5 * ((uint32_t)prescale + 1);
+}
+
+bool twi_submit(twi_xfer_t *xfer) {
+    twi_bus_t *bus;
+    CRITICAL_STORE;
+
+    assert(xfer);
+    assert(xfer->prio < TWI_PRIO_MAX);
+
+    bus = twi_bus_get(xfer->bus);
+    assert(bus);
+
+    // queue shared with ISR
+    CRITICAL_START();
+
+    if (twi_xfer_pending(xfer)) {
+        CRITICAL_END();
+        return false;
+    }
+
+    xfer->bus = bus;
+    xfer->status = TWI_XFER_QUEUED;
+    xfer->prescale = twi_dev_prescale(bus, xfer->addr);
+    xfer->timeout = twi_deadline(xfer);
+    xfer->queued = gcnt_get();
+    list_insert(&bus->queue[xfer->prio], &xfer->link);
+    twi_start_next(bus);
+
+    CRITICAL_END();
+
+    return true;
+}
+
+bool twi_cancel(twi_xfer_t *xfer) {
+    twi_dev_stats_t *dev;
+    bool queued;
+    CRITICAL_STORE;
+
+    assert(xfer);
+
+    CRITICAL_START();
+    queued = (xfer->status == TWI_XFER_QUEUED);
+    if (queued) {
+        list_delete(&xfer->link);
+        xfer->status = TWI_XFER_IDLE;
+
+        dev = twi_stats_dev(&xfer->bus->stats, xfer->addr, true);
+        if (dev != NULL)
+            dev->aborts++;
+    }
+    CRITICAL_END();
+
+    return queued;
+}
+
+bool twi_abort(twi_xfer_t *xfer) {
+    twi_bus_t *bus;
+    bool pending = true;
+    CRITICAL_STORE;
+
+    assert(xfer);
+
+    CRITICAL_START();
+    bus = xfer->bus;
+    if (xfer->status == TWI_XFER_QUEUED) {
+        CRITICAL_END();
+        return twi_cancel(xfer);
+    }
+
+    if (xfer->status == TWI_XFER_ACTIVE && bus->cur == xfer &&
+        bus->state != I2C_RECOVER_CLOCK && bus->state != I2C_RECOVER_STOP) {
+        twi_recover(bus, TWI_XFER_ABORTED);
+    } else {
+        pending = xfer->status == TWI_XFER_ACTIVE;
+    }
+    CRITICAL_END();
+
+    return pending;
+}
+
+bool twi_stats_get(twi_bus_t *bus, uint8_t addr, twi_dev_stats_t *dev) {
+    twi_dev_stats_t *found;
+    CRITICAL_STORE;
+
+    bus = twi_bus_get(bus);
+
+    CRITICAL_START();
+    found = twi_stats_dev(&bus->stats, addr, false);
+    if (found != NULL)
+        *dev = *found;
+    CRITICAL_END();
+
+    return found != NULL;
+}
+
+uint32_t twi_stats_max_wait(twi_bus_t *bus, uint8_t prio) {
+    assert(prio < TWI_PRIO_MAX);
+
+    return tstamp_cycles_to_us(twi_bus_get(bus)->stats.max_wait[prio]);
+}
+
+uint8_t twi_stats_utilization(twi_bus_t *bus) {
+    twi_stats_t *stats;
+    uint64_t now, busy = 0;
+    uint32_t window;
+    uint8_t i;
+    CRITICAL_STORE;
+
+    stats = &twi_bus_get(bus)->stats;
+
+    CRITICAL_START();
+    now = gcnt_get();
+    twi_stats_advance(stats, now);
+    for (i = 0; i < TWI_STATS_WINDOW_SLOTS; ++i)
+        busy += stats->busy[i];
+
+    // full slots plus the part of the current one that has elapsed
+    window = (TWI_STATS_WINDOW_SLOTS - 1) * TWI_STATS_SLOT_CLKS +
+             (uint32_t)(now + TWI_STATS_SLOT_CLKS - stats->slot_end);
+    CRITICAL_END();
+
+    if (busy >= window)
+        return 100;
+
+    return (uint8_t)(busy * 100 / window);
+}
+
+void twi_stats_reset(twi_bus_t *bus) {
+    twi_stats_t *stats;
+    CRITICAL_STORE;
+
+    stats = &twi_bus_get(bus)->stats;
+
+    CRITICAL_START();
+    memset(stats, 0, sizeof(*stats));
+    stats->slot_end = gcnt_get() + TWI_STATS_SLOT_CLKS;
+    CRITICAL_END();
+}
+
+void twi_stats_dump(void) {
+    list_t *iter;
+    twi_bus_t *bus;
+    twi_dev_stats_t dev;
+    uint8_t i, n;
+
+    list_for_each(&twi_buses, iter) {
+        bus = (twi_bus_t *)iter;
+        log("%s stats, bus utilization %d%%, retunes: %d, untracked xfers: %d", bus->name,
+                twi_stats_utilization(bus), bus->stats.retunes, bus->stats.untracked);
+        log("    timeouts: %d recoveries: %d", bus->stats.timeouts, bus->stats.recoveries);
+        for (i = 0; i < TWI_PRIO_MAX; ++i) {
+            log("    prio %d max wait: %d us aged: %d",
+                    i, twi_stats_max_wait(bus, i), bus->stats.aged[i]);
+        }
+
+        for (n = 0; n < bus->stats.ndev; ++n) {
+            if (!twi_stats_get(bus, bus->stats.dev[n].addr, &dev))
+                continue;
+
+            log("    0x%02x xfers: %d bytes: %d nacks: %d errors: %d aborts: %d max latency: %d us",
+                    dev.addr, dev.xfers, dev.bytes, dev.nacks, dev.errors, dev.aborts,
+                    dev.max_latency);
+            xil_printf("      latency (log2 us):");
+            for (i = 0; i < TWI_STATS_HIST_BINS; ++i) {
+                if (dev.hist[i])
+                    xil_printf(" %d:%d", i, dev.hist[i]);
+            }
+            xil_printf("\r\n");
+        }
+    }
+}
+
+static void twi_blocking_done(twi_xfer_t *xfer, uint8_t status) {
+    if (transmission.callback != NULL)
+        transmission.callback(xfer->addr, transmission.buffer);
+}
+
+uint8_t *twi_wait(void) {
+    while (twi_xfer_pending(&transmission.xfer))
+        ;
+    return transmission.buffer;
 }
 
 void twi_write(uint8_t address, uint8_t* data, uint8_t length, void (*callback)(uint8_t, uint8_t *)) {
-    twi_wait();
+    assert(length <= TWI_BUFFER_LENGTH);
 
-    busy = 1;
+    twi_wait();
 
-    transmission.buffer[0] = (address << 1) | TW_WRITE;
-    transmission.length = length + 1;
-    transmission.index = 1;
+    memcpy(transmission.buffer, data, length);
     transmission.callback = callback;
-    memcpy(&transmission.buffer[1], data, length);
-
-    transmission.state = I2C_TX_WAIT;
-    OC_I2C_REG(TXR) = transmission.buffer[0];
-    OC_I2C_REG(CR) = OC_I2C_STA | OC_I2C_WR;
+    twi_xfer_write(&transmission.xfer, address, transmission.buffer, length);
+    twi_submit(&transmission.xfer);
 }
 
 void twi_read(uint8_t address, uint8_t length, void (*callback)(uint8_t, uint8_t *)) {
-    twi_wait();
+    assert(length <= TWI_BUFFER_LENGTH);
 
-    busy = 1;
+    twi_wait();
 
-    transmission.buffer[0] = (address << 1) | TW_READ;
-    transmission.length = length + 1;
-    transmission.index = 1;
     transmission.callback = callback;
+    twi_xfer_read(&transmission.xfer, address, transmission.buffer, length);
+    twi_submit(&transmission.xfer);
+}
 
-    transmission.state = I2C_ADDR_WAIT;
-    OC_I2C_REG(TXR) = transmission.buffer[0];
-    OC_I2C_REG(CR) = OC_I2C_STA | OC_I2C_WR;
+static void twi_pt_cb(twi_xfer_t *xfer, uint8_t status) {
+    pt_sched_wake();
+}
+
+PT_THREAD(twi_xfer_pt(twi_pt_t *t))
+{
+    PT_BEGIN(&t->pt);
+
+    t->xfer.bus = t->bus;
+    t->xfer.prio = t->prio;
+    t->xfer.callback = twi_pt_cb;
+    t->xfer.data = t;
+    twi_submit(&t->xfer);
+
+    PT_WAIT_WHILE(&t->pt, twi_xfer_pending(&t->xfer));
+
+    PT_END(&t->pt);
+}
+
+PT_THREAD(twi_write_pt(twi_pt_t *t))
+{
+    PT_BEGIN(&t->pt);
+
+    twi_xfer_init(&t->xfer, twi_pt_cb, t);
+    t->xfer.bus = t->bus;
+    t->xfer.prio = t->prio;
+    twi_xfer_write(&t->xfer, t->addr, t->data, t->length);
+    twi_submit(&t->xfer);
+
+    PT_WAIT_WHILE(&t->pt, twi_xfer_pending(&t->xfer));
+
+    PT_END(&t->pt);
+}
+
+PT_THREAD(twi_read_pt(twi_pt_t *t))
+{
+    PT_BEGIN(&t->pt);
+
+    twi_xfer_init(&t->xfer, twi_pt_cb, t);
+    t->xfer.bus = t->bus;
+    t->xfer.prio = t->prio;
+    twi_xfer_read(&t->xfer, t->addr, t->data, t->length);
+    twi_submit(&t->xfer);
+
+    PT_WAIT_WHILE(&t->pt, twi_xfer_pending(&t->xfer));
+
+    PT_END(&t->pt);
 }
 
 void twi_isr(void *data)
 {
-    uint8_t sr = OC_I2C_REG(SR); // cache status register with ACK/NACK
+    PROF_BEGIN(twi_isr);
+    twi_bus_t *bus = data;
+    uint8_t sr = OC_I2C_READ(bus->base, SR); // cache status register with ACK/NACK
+    twi_xfer_t *xfer = bus->cur;
+
+    OC_I2C_WRITE(bus->base, CR, OC_I2C_IACK); // ack interrupt
 
-    OC_I2C_REG(CR) = OC_I2C_IACK; // ack interrupt
+    if ((sr & OC_I2C_AL) && xfer != NULL &&
+        bus->state != I2C_RECOVER_CLOCK && bus->state != I2C_RECOVER_STOP) {
+        twi_recover(bus, TWI_XFER_ARB_LOST);
+        PROF_END(twi_isr);
+        return;
+    }
 
-    switch (transmission.state) {
+    switch (bus->state) {
         case I2C_IDLE:
             break;
         case I2C_TX_WAIT:
             if (sr & OC_I2C_RXACK) { // NACK
-                OC_I2C_REG(CR) = OC_I2C_STO;
-                transmission.state = I2C_DONE;
-            } else { // ACK
-                if (transmission.index < transmission.length) {
-                    OC_I2C_REG(TXR) = transmission.buffer[transmission.index];
-                    if (transmission.index == (transmission.length - 1)) {
-                        OC_I2C_REG(CR) = OC_I2C_STO | OC_I2C_WR;
-                        transmission.state = I2C_DONE;
-                    } else {
-                        OC_I2C_REG(CR) = OC_I2C_WR;
-                    }
-                    ++transmission.index;
+                OC_I2C_WRITE(bus->base, CR, OC_I2C_STO);
+                bus->error = TWI_XFER_NACK;
+                bus->state = I2C_DONE;
+            } else if (bus->remain) { // ACK
+                OC_I2C_WRITE(bus->base, TXR, *twi_seg_next(bus, xfer->wr));
+                if (bus->remain == 0 && twi_seg_length(xfer->rd, xfer->rd_nseg)) {
+                    // no STOP, the read phase follows with a repeated START
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_WR);
+                    bus->state = I2C_RX_START;
+                } else if (bus->remain == 0) {
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_STO | OC_I2C_WR);
+                    bus->state = I2C_DONE;
+                } else {
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_WR);
                 }
+            } else { // address only
+                OC_I2C_WRITE(bus->base, CR, OC_I2C_STO);
+                bus->state = I2C_DONE;
+            }
+            break;
+        case I2C_RX_START:
+            if (sr & OC_I2C_RXACK) { // NACK
+                OC_I2C_WRITE(bus->base, CR, OC_I2C_STO);
+                bus->error = TWI_XFER_NACK;
+                bus->state = I2C_DONE;
+            } else { // ACK
+                twi_start_read(bus);
             }
             break;
         case I2C_ADDR_WAIT:
             if (sr & OC_I2C_RXACK) { // NACK
-                OC_I2C_REG(CR) = OC_I2C_STO;
-                transmission.state = I2C_DONE;
+                OC_I2C_WRITE(bus->base, CR, OC_I2C_STO);
+                bus->error = TWI_XFER_NACK;
+                bus->state = I2C_DONE;
             } else { // ACK
-                if (transmission.index == (transmission.length - 1))
-                    OC_I2C_REG(CR) = OC_I2C_RD | OC_I2C_ACK | OC_I2C_STO;
+                if (bus->remain == 1)
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_RD | OC_I2C_ACK | OC_I2C_STO);
                 else
-                    OC_I2C_REG(CR) = OC_I2C_RD;
-                transmission.state = I2C_RX_WAIT;
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_RD);
+                bus->state = I2C_RX_WAIT;
             }
             break;
         case I2C_RX_WAIT:
-            transmission.buffer[transmission.index++] = OC_I2C_REG(RXR);
-            if (transmission.index < transmission.length) {
-                if (transmission.index == (transmission.length - 1)) {
-                    OC_I2C_REG(CR) = OC_I2C_RD | OC_I2C_ACK | OC_I2C_STO;
+            *twi_seg_next(bus, xfer->rd) = OC_I2C_READ(bus->base, RXR);
+            if (bus->remain) {
+                if (bus->remain == 1) {
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_RD | OC_I2C_ACK | OC_I2C_STO);
                 } else {
-                    OC_I2C_REG(CR) = OC_I2C_RD;
+                    OC_I2C_WRITE(bus->base, CR, OC_I2C_RD);
                 }
             } else {
-                transmission.state = I2C_IDLE;
-                twi_done();
+                twi_complete(bus);
             }
             break;
         case I2C_DONE:
-            transmission.state = I2C_IDLE;
-            twi_done();
+            twi_complete(bus);
+            break;
+        case I2C_RECOVER_CLOCK:
+            OC_I2C_WRITE(bus->base, CR, OC_I2C_STO);
+            bus->state = I2C_RECOVER_STOP;
+            break;
+        case I2C_RECOVER_STOP:
+            twi_complete(bus);
             break;
     }
+
+    PROF_END(twi_isr);
 }
@@ -0,0 +1,39 @@
+/*
+ * Utility functions
+ *
+ * The MicroBlaze MCS core has no barrel shifter or count leading zeros
+ * instruction, so log2 is found with a binary search over a table of
+ * powers of two instead of shifting.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "util.h"
+
+
+static const uint32_t pow2[32] = {
+    1UL << 0,  1UL << 1,  1UL << 2,  1UL << 3,
+    1UL << 4,  1UL << 5,  1UL << 6,  1UL << 7,
+    1UL << 8,  1UL << 9,  1UL << 10, 1UL << 11,
+    1UL << 12, 1UL << 13, 1UL << 14, 1UL << 15,
+    1UL << 16, 1UL << 17, 1UL << 18, 1UL << 19,
+    1UL << 20, 1UL << 21, 1UL << 22, 1UL << 23,
+    1UL << 24, 1UL << 25, 1UL << 26, 1UL << 27,
+    1UL << 28, 1UL << 29, 1UL << 30, 1UL << 31,
+};
+
+
+uint8_t log2_floor (uint32_t v, uint8_t max)
+{
+    uint8_t lo = 0, hi = max + 1, mid;
+
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (v >= pow2[mid])
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
@@ -0,0 +1,121 @@
+/*
+ * Deferred work queue
+ *
+ * Work is posted from interrupt context and run from the main loop, so
+ * ISRs only do the minimum needed to service the hardware.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "workq.h"
+#include "mbsoc.h"
+#include <assert.h>
+
+
+static list_t queues[WORKQ_PRIO_MAX];
+
+
+/**
+ * Helper to check if a work item is queued
+ *
+ * *MUST* be called in a critical region
+ */
+static bool work_linked (work_t *work)
+{
+    return (work->link.next != NULL) && (work->link.next != &work->link);
+}
+
+void workq_init (void)
+{
+    uint8_t i;
+
+    for (i = 0; i < WORKQ_PRIO_MAX; ++i)
+        list_init_head(&queues[i]);
+}
+
+void work_init (work_t *work, uint8_t prio, work_fn func, void *data)
+{
+    assert(work && func);
+    assert(prio < WORKQ_PRIO_MAX);
+
+    work->prio = prio;
+    work->func = func;
+    work->data = data;
+    work->posted = 0;
+    work->latency = 0;
+    work->max_latency = 0;
+    list_init_head(&work->link);
+}
+
+bool work_post (work_t *work)
+{
+    bool posted = false;
+    CRITICAL_STORE;
+
+    assert(work);
+
+    CRITICAL_START();
+    if (!work_linked(work)) {
+        work->posted = gcnt_get();
+        list_enq(&queues[work->prio], &work->link);
+        posted = true;
+    }
+    CRITICAL_END();
+
+    return posted;
+}
+
+void work_cancel (work_t *work)
+{
+    CRITICAL_STORE;
+
+    assert(work);
+
+    CRITICAL_START();
+    if (work_linked(work))
+        list_delete(&work->link);
+    CRITICAL_END();
+}
+
+bool workq_run_one (void)
+{
+    work_t *work = NULL;
+    uint8_t i;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    for (i = 0; i < WORKQ_PRIO_MAX && work == NULL; ++i)
+        work = (work_t *)list_deq(&queues[i]);
+    CRITICAL_END();
+
+    if (work == NULL)
+        return false;
+
+    work->latency = gcnt_get() - work->posted;
+    if (work->latency > work->max_latency)
+        work->max_latency = work->latency;
+
+    work->func(work->data);
+
+    return true;
+}
+
+void workq_drain (void)
+{
+    while (workq_run_one())
+        ;
+}
+
+bool workq_is_empty (void)
+{
+    bool empty = true;
+    uint8_t i;
+    CRITICAL_STORE;
+
+    CRITICAL_START();
+    for (i = 0; i < WORKQ_PRIO_MAX; ++i)
+        empty = empty && list_is_empty(&queues[i]);
+    CRITICAL_END();
+
+    return empty;
+}
@@ -0,0 +1,308 @@
+/*
+ * Streaming windowed statistics
+ *
+ * Samples are integers of at most 17 bits, so a window keeps exact sums of
+ * the samples and their squares and the mean, mean square and variance
+ * come out of those without the cancellation a running sum of squares has
+ * in floating point. Adding a sample is an add and a 64 bit multiply add,
+ * no division, a sliding window also subtracts the sample leaving it and
+ * keeps its minimum and maximum in monotonic queues. The divisions, square
+ * roots and scaling to units are left to when statistics are read.
+ *
+ * The moving average keeps its mean and variance Welford style, each sample
+ * moves the mean by its weighted difference from it and the variance by
+ * the product of that difference before and after, with a power of two
+ * weight these are shifts.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "wstat.h"
+#include "mbsoc.h"
+#include "util.h"
+#include <assert.h>
+
+
+static void wstat_sum_reset (wstat_sum_t *s)
+{
+    s->count = 0;
+    s->min = INT32_MAX;
+    s->max = INT32_MIN;
+    s->sum = 0;
+    s->sumsq = 0;
+}
+
+/**
+ * Integer square root, rounded down
+ */
+static uint32_t wstat_isqrt (uint64_t val)
+{
+    uint64_t res = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > val)
+        bit >>= 2;
+
+    while (bit) {
+        if (val >= res + bit) {
+            val -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return res;
+}
+
+/**
+ * Divide to Q.16 without overflowing the dividend
+ */
+static uint64_t wstat_div_q16 (uint64_t val, uint32_t n)
+{
+    return ((val / n) << 16) + (((val % n) << 16) / n);
+}
+
+/**
+ * Clamp a Q.16 value to Q15.16
+ */
+static int32_t wstat_sat (int64_t val)
+{
+    if (val > INT32_MAX)
+        return INT32_MAX;
+    if (val < INT32_MIN)
+        return INT32_MIN;
+    return val;
+}
+
+/**
+ * Scale a value with frac fraction bits by a Q0.32 unit per LSB to Q15.16
+ *
+ * The product fits 64 bits for a value of at most 24 bits.
+ */
+static int32_t wstat_scale (int64_t val, uint8_t frac, uint64_t scale)
+{
+    uint8_t shift = 16 + frac;
+
+    return wstat_sat((val * (int64_t)scale + (1LL << (shift - 1))) >> shift);
+}
+
+/**
+ * Multiply by a Q0.32 unit per LSB, rounded down
+ *
+ * Split at 32 bits so a value wider than the scale still fits 64 bits.
+ */
+static uint64_t wstat_mul_q32 (uint64_t val, uint64_t scale)
+{
+    return (val >> 32) * scale + (((val & UINT32_MAX) * scale) >> 32);
+}
+
+void wstat_tumbling_init (wstat_window_t *w, uint32_t size)
+{
+    CRITICAL_STORE;
+
+    assert(size && size <= WSTAT_WINDOW_MAX);
+
+    CRITICAL_START();
+    memset(w, 0, sizeof(*w));
+    w->size = size;
+    wstat_sum_reset(&w->cur);
+    wstat_sum_reset(&w->done);
+    CRITICAL_END();
+}
+
+void wstat_sliding_init (wstat_window_t *w, uint32_t size, int32_t *ring, uint32_t *minq, uint32_t *maxq)
+{
+    CRITICAL_STORE;
+
+    assert(size && size <= WSTAT_WINDOW_MAX);
+    assert((size & (size - 1)) == 0);
+    assert(ring && minq && maxq);
+
+    CRITICAL_START();
+    memset(w, 0, sizeof(*w));
+    w->size = size;
+    w->mask = size - 1;
+    w->ring = ring;
+    w->minq.seq = minq;
+    w->maxq.seq = maxq;
+    wstat_sum_reset(&w->cur);
+    wstat_sum_reset(&w->done);
+    CRITICAL_END();
+}
+
+/**
+ * Queue a sample number, dropping those it supersedes from the back
+ *
+ * Sample numbers are queued oldest first with their values ascending for
+ * the minimum or descending for the maximum, so the front is the window's
+ * minimum or maximum. Each is queued and dropped once.
+ */
+static void wstat_deque_push (wstat_window_t *w, wstat_deque_t *q, uint32_t seq, int32_t val, bool max)
+{
+    while (q->head != q->tail) {
+        int32_t back = w->ring[q->seq[(q->tail - 1) & w->mask] & w->mask];
+
+        if (max ? back > val : back < val)
+            break;
+        q->tail--;
+    }
+    q->seq[q->tail++ & w->mask] = seq;
+}
+
+static void wstat_sliding_add (wstat_window_t *w, int32_t val)
+{
+    uint32_t seq = w->seq++;
+    uint32_t slot = seq & w->mask;
+    wstat_sum_t *s = &w->cur;
+
+    if (seq >= w->size) {
+        int32_t old = w->ring[slot];
+
+        s->sum -= old;
+        s->sumsq -= (int64_t)old * old;
+    } else {
+        s->count++;
+    }
+
+    // the sample leaving the window can only be at the front
+    if (w->minq.head != w->minq.tail && seq - w->minq.seq[w->minq.head & w->mask] >= w->size)
+        w->minq.head++;
+    if (w->maxq.head != w->maxq.tail && seq - w->maxq.seq[w->maxq.head & w->mask] >= w->size)
+        w->maxq.head++;
+
+    w->ring[slot] = val;
+    s->sum += val;
+    s->sumsq += (int64_t)val * val;
+
+    wstat_deque_push(w, &w->minq, seq, val, false);
+    wstat_deque_push(w, &w->maxq, seq, val, true);
+    s->min = w->ring[w->minq.seq[w->minq.head & w->mask] & w->mask];
+    s->max = w->ring[w->maxq.seq[w->maxq.head & w->mask] & w->mask];
+}
+
+/**
+ * Make the current tumbling window the last closed one and open another
+ *
+ * *MUST* be called in a critical region or the ISR adding samples
+ */
+static void wstat_tumbling_close (wstat_window_t *w)
+{
+    w->done = w->cur;
+    w->windows++;
+    wstat_sum_reset(&w->cur);
+}
+
+void wstat_add (wstat_window_t *w, int32_t val)
+{
+    wstat_sum_t *s = &w->cur;
+
+    if (w->ring) {
+        wstat_sliding_add(w, val);
+        return;
+    }
+
+    w->seq++;
+    s->count++;
+    s->sum += val;
+    s->sumsq += (int64_t)val * val;
+    if (val < s->min)
+        s->min = val;
+    if (val > s->max)
+        s->max = val;
+
+    if (s->count == w->size)
+        wstat_tumbling_close(w);
+}
+
+void wstat_close (wstat_window_t *w)
+{
+    CRITICAL_STORE;
+
+    assert(!w->ring);
+
+    CRITICAL_START();
+    wstat_tumbling_close(w);
+    CRITICAL_END();
+}
+
+bool wstat_get (wstat_window_t *w, uint64_t scale, wstat_result_t *r)
+{
+    CRITICAL_STORE;
+    wstat_sum_t s;
+    uint64_t ms, var;
+    uint32_t n;
+
+    CRITICAL_START();
+    s = w->ring ? w->cur : w->done;
+    CRITICAL_END();
+
+    if (s.count == 0)
+        return false;
+    n = s.count;
+
+    // mean square and variance in Q.16 LSBs squared
+    ms = wstat_div_q16(s.sumsq, n);
+    var = wstat_div_q16((int64_t)n * s.sumsq - s.sum * s.sum, n) / n;
+
+    r->count = n;
+    r->min = wstat_scale(s.min, 0, scale);
+    r->max = wstat_scale(s.max, 0, scale);
+    r->mean = wstat_sat((s.sum * (int64_t)scale / n + (1 << 15)) >> 16);
+    r->rms = wstat_scale(wstat_isqrt(ms), 8, scale);
+    r->std = wstat_scale(wstat_isqrt(var), 8, scale);
+    r->var = wstat_mul_q32(wstat_mul_q32(var, scale), scale);
+
+    return true;
+}
+
+void wstat_ema_init (wstat_ema_t *e, uint8_t shift)
+{
+    CRITICAL_STORE;
+
+    assert(shift >= 1 && shift <= 16);
+
+    CRITICAL_START();
+    e->shift = shift;
+    e->valid = false;
+    e->mean = 0;
+    e->var = 0;
+    CRITICAL_END();
+}
+
+void wstat_ema_add (wstat_ema_t *e, int32_t val)
+{
+    int64_t diff, sq;
+
+    if (!e->valid) {
+        e->mean = (int64_t)val << 16;
+        e->var = 0;
+        e->valid = true;
+        return;
+    }
+
+    // var' = (1 - a) * (var + a * diff^2) with a = 2^-shift
+    diff = ((int64_t)val << 16) - e->mean;
+    e->mean += diff >> e->shift;
+    sq = ((diff >> 8) * (diff >> 8)) >> e->shift;
+    e->var += sq - (sq >> e->shift) - (e->var >> e->shift);
+}
+
+bool wstat_ema_get (wstat_ema_t *e, uint64_t scale, int32_t *mean, int32_t *std)
+{
+    CRITICAL_STORE;
+    wstat_ema_t copy;
+
+    CRITICAL_START();
+    copy = *e;
+    CRITICAL_END();
+
+    if (!copy.valid)
+        return false;
+
+    *mean = wstat_scale(copy.mean >> 8, 8, scale);
+    *std = wstat_scale(wstat_isqrt(copy.var), 8, scale);
+
+    return true;
+}
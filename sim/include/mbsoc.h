@@ -0,0 +1,54 @@
+/*
+ * MicroBlaze SoC definitions for the host simulator
+ *
+ * Stands in for src/mbsoc.h, the SoC registers are routed to the
+ * simulator instead of memory mapped IO.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _MBSOC_H_
+#define _MBSOC_H_
+
+#include "xparameters.h"
+#include "xiomodule.h"
+#include "pit.h"
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Critical region protection, interrupts are delivered to the simulated
+ * CPU as a signal which these mask
+ */
+#define CRITICAL_STORE          uint32_t msr
+#define CRITICAL_START()        msr = mfmsr(); microblaze_disable_interrupts()
+#define CRITICAL_END()          mtmsr(msr)
+
+/*
+ * MicroBlaze MCS built-in peripherals
+ */
+#define GPO(ch)                 sim_gpo[(ch)]
+#define GPI(ch)                 sim_gpi[(ch)]
+
+/*
+ * LEDs are connected to GP output port 1
+ */
+#define LEDS        (GPO(1))
+
+/*
+ * SoC IO module definitions
+ */
+#define GCNT_LO                 ((uint32_t)sim_cycles())
+#define GCNT_HI                 ((uint32_t)(sim_cycles() >> 32))
+
+#define PRNG_RAND               sim_prng()
+
+/*
+ * Global instance of the XIO module for BSP functions
+ */
+extern XIOModule xio;
+
+
+#endif
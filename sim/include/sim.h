@@ -0,0 +1,213 @@
+/*
+ * Host simulator for the MicroBlaze MCS SoC
+ *
+ * The firmware runs natively and the peripheral models run against a
+ * virtual cycle counter that follows the host clock. Model events and
+ * interrupts are delivered to the firmware as a timer signal, so ISRs
+ * preempt firmware code as they would on the target.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include "xparameters.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define SIM_CLK_HZ              XPAR_CPU_CORE_CLOCK_FREQ_HZ
+#define SIM_CLKS_PER_US         (SIM_CLK_HZ / 1000000UL)
+
+
+/*
+ * Simulator core
+ */
+void sim_init (void);
+uint64_t sim_cycles (void);
+uint32_t sim_prng (void);
+
+extern volatile uint32_t sim_gpo[5];
+extern volatile uint32_t sim_gpi[5];
+
+/**
+ * Hardware event, the callback runs from the interrupt signal or from
+ * sim_lock() once due, with the simulator locked
+ */
+typedef struct sim_event {
+    struct sim_event    *next;
+    uint64_t            when;
+    bool                pending;
+    void                (*func) (struct sim_event *ev);
+} sim_event_t;
+
+void sim_event_schedule (sim_event_t *ev, uint64_t when);
+void sim_event_cancel (sim_event_t *ev);
+
+/**
+ * Run due events and lock out interrupts while touching model state
+ */
+void sim_lock (void);
+void sim_unlock (void);
+
+/**
+ * Interrupt lines into the IO module
+ *
+ * sim_irq_raise() latches an interrupt as pending and signals the CPU.
+ * The IO module driver takes the pending interrupts it has enabled from
+ * its handler and kicks the CPU when an interrupt is enabled.
+ */
+void sim_irq_raise (uint8_t irq);
+uint32_t sim_irq_take (uint32_t mask);
+void sim_irq_kick (void);
+
+
+/*
+ * I2C bus and OpenCores I2C master model
+ */
+typedef struct sim_i2c_slave {
+    struct sim_i2c_slave    *next;
+    uint8_t                 addr;
+    bool                    (*start) (struct sim_i2c_slave *slave, bool read); // returns ACK
+    bool                    (*write) (struct sim_i2c_slave *slave, uint8_t data); // returns ACK
+    uint8_t                 (*read) (struct sim_i2c_slave *slave);
+    void                    (*stop) (struct sim_i2c_slave *slave);
+} sim_i2c_slave_t;
+
+/**
+ * Bus activity seen by the core model
+ *
+ * Errors count commands written while a transfer was still in progress,
+ * interrupts the driver left unacknowledged and prescaler writes while
+ * the core was enabled. Retunes count prescaler changes, resets count the
+ * core being disabled with a command in progress or the bus busy.
+ */
+typedef struct sim_i2c_stats {
+    uint32_t    retunes;
+    uint32_t    resets;
+    uint32_t    arb_lost;
+    uint32_t    starts;
+    uint32_t    stops;
+    uint32_t    bytes;
+    uint32_t    nacks;
+    uint32_t    errors;
+    uint64_t    busy_clks;
+} sim_i2c_stats_t;
+
+/**
+ * Bus faults
+ *
+ * With SCL held low commands never complete, only disabling the core stops
+ * them. With SDA held low, as by a slave reset in the middle of a byte,
+ * START and STOP lose arbitration until a byte is read with NACK, which
+ * clocks the slave out and releases SDA.
+ */
+enum sim_i2c_fault {
+    SIM_I2C_FAULT_NONE,
+    SIM_I2C_FAULT_SCL_LOW,
+    SIM_I2C_FAULT_SDA_LOW,
+};
+
+/**
+ * Core instance, register accesses are routed to it by base address
+ */
+typedef struct sim_i2c_bus {
+    sim_event_t         ev; // must be first entry
+    struct sim_i2c_bus  *next;
+    uintptr_t           base;
+    uint8_t             irq;
+    uint16_t            prer;
+    uint8_t             ctr;
+    uint8_t             txr;
+    uint8_t             rxr;
+    uint8_t             sr;
+    uint8_t             cmd;
+    uint64_t            cmd_start;
+    sim_i2c_slave_t     *slaves;
+    sim_i2c_slave_t     *active;
+    bool                addr_phase;
+    bool                reading;
+    uint8_t             fault;
+    sim_i2c_stats_t     stats;
+} sim_i2c_bus_t;
+
+void sim_i2c_init (sim_i2c_bus_t *bus, uintptr_t base, uint8_t irq);
+void sim_i2c_attach (sim_i2c_bus_t *bus, sim_i2c_slave_t *slave);
+void sim_i2c_get_stats (sim_i2c_bus_t *bus, sim_i2c_stats_t *stats);
+uint32_t sim_i2c_bus_hz (sim_i2c_bus_t *bus);
+void sim_i2c_fault (sim_i2c_bus_t *bus, uint8_t fault);
+
+
+/*
+ * INA219 current/power monitor model
+ *
+ * The current through the shunt follows a programmable waveform and the
+ * bus voltage is fixed. Conversions run on the datasheet conversion times
+ * for the configured ADC resolution and averaging, and are counted as they
+ * finish whether or not they are read.
+ */
+enum sim_wave_type {
+    SIM_WAVE_DC,
+    SIM_WAVE_SINE,
+    SIM_WAVE_SQUARE,
+    SIM_WAVE_TRIANGLE,
+};
+
+typedef struct sim_wave {
+    uint8_t     type;
+    int32_t     offset_ua;
+    int32_t     amplitude_ua;
+    uint32_t    period_us;
+} sim_wave_t;
+
+typedef struct sim_ina219 {
+    sim_i2c_slave_t slave; // must be first entry
+    uint16_t        reg[6];
+    uint8_t         ptr;
+    uint8_t         count;
+    uint16_t        wr_val;
+    uint32_t        shunt_uohm;
+    uint32_t        bus_mv;
+    sim_wave_t      wave;
+    uint64_t        conv_start;
+    uint64_t        conv_done;
+    uint32_t        conversions;
+} sim_ina219_t;
+
+void sim_ina219_init (sim_ina219_t *dev, sim_i2c_bus_t *bus, uint8_t addr, uint32_t shunt_uohm);
+void sim_ina219_set_bus (sim_ina219_t *dev, uint32_t bus_mv);
+void sim_ina219_set_wave (sim_ina219_t *dev, const sim_wave_t *wave);
+int32_t sim_ina219_current (sim_ina219_t *dev, uint64_t cycles);
+
+
+/*
+ * PCF8574 I2C backpack driving an HD44780 LCD in 4-bit mode
+ *
+ * Timing violations count instructions latched before the previous one
+ * finished executing.
+ */
+typedef struct sim_lcd {
+    sim_i2c_slave_t slave; // must be first entry
+    uint8_t         pins;
+    bool            four_bit;
+    bool            high_nibble;
+    uint8_t         nibble;
+    uint8_t         ac;
+    bool            cgram;
+    bool            increment;
+    uint8_t         display;
+    uint8_t         ddram[0x80];
+    uint8_t         cgram_data[64];
+    uint64_t        busy_until;
+    uint32_t        instrs;
+    uint32_t        chars;
+    uint32_t        violations;
+} sim_lcd_t;
+
+void sim_lcd_init (sim_lcd_t *lcd, sim_i2c_bus_t *bus, uint8_t addr);
+void sim_lcd_dump (sim_lcd_t *lcd, uint8_t width, uint8_t height);
+
+
+#endif // _SIM_H_
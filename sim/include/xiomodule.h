@@ -0,0 +1,79 @@
+/*
+ * Host simulator IO module driver, the subset of the BSP xiomodule.h
+ * and mb_interface.h used by the firmware
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _XIOMODULE_H_
+#define _XIOMODULE_H_
+
+#include <stdint.h>
+
+typedef uint8_t     u8;
+typedef uint16_t    u16;
+typedef uint32_t    u32;
+
+#define XST_SUCCESS                             0L
+#define XST_FAILURE                             1L
+
+#define XIN_IOMODULE_UART_ERROR_INTERRUPT_INTR  0
+#define XIN_IOMODULE_UART_TX_INTERRUPT_INTR     1
+#define XIN_IOMODULE_UART_RX_INTERRUPT_INTR     2
+#define XIN_IOMODULE_PIT_1_INTERRUPT_INTR       3
+#define XIN_IOMODULE_PIT_2_INTERRUPT_INTR       4
+#define XIN_IOMODULE_PIT_3_INTERRUPT_INTR       5
+#define XIN_IOMODULE_PIT_4_INTERRUPT_INTR       6
+#define XIN_IOMODULE_FIT_1_INTERRUPT_INTR       7
+#define XIN_IOMODULE_FIT_2_INTERRUPT_INTR       8
+#define XIN_IOMODULE_FIT_3_INTERRUPT_INTR       9
+#define XIN_IOMODULE_FIT_4_INTERRUPT_INTR       10
+#define XIN_IOMODULE_EXTERNAL_INTERRUPT_INTR    16
+#define XIN_IOMODULE_INTERRUPTS                 24
+
+#define XIN_IOMODULE_TIMERS                     4
+
+#define XTC_INT_MODE_OPTION                     0
+#define XTC_AUTO_RELOAD_OPTION                  0x00000002UL
+
+#define XGPO_DATA_OFFSET                        0x10
+#define XGPO_CHAN_OFFSET                        0x04
+#define XGPI_DATA_OFFSET                        0x20
+#define XGPI_CHAN_OFFSET                        0x04
+
+#define MICROBLAZE_MSR_IE                       0x00000002UL
+
+typedef void (*XInterruptHandler)(void *data);
+
+typedef struct {
+    u16     DeviceId;
+    u32     IsReady;
+    u32     IsStarted;
+} XIOModule;
+
+int XIOModule_Initialize(XIOModule *inst, u16 id);
+int XIOModule_Start(XIOModule *inst);
+int XIOModule_Connect(XIOModule *inst, u8 id, XInterruptHandler handler, void *data);
+void XIOModule_Disconnect(XIOModule *inst, u8 id);
+void XIOModule_Enable(XIOModule *inst, u8 id);
+void XIOModule_Disable(XIOModule *inst, u8 id);
+void XIOModule_DeviceInterruptHandler(void *data);
+
+int XIOModule_Timer_Initialize(XIOModule *inst, u16 id);
+void XIOModule_Timer_Start(XIOModule *inst, u8 timer);
+void XIOModule_Timer_Stop(XIOModule *inst, u8 timer);
+u32 XIOModule_GetValue(XIOModule *inst, u8 timer);
+void XIOModule_SetResetValue(XIOModule *inst, u8 timer, u32 value);
+void XIOModule_SetOptions(XIOModule *inst, u8 timer, u32 options);
+
+int XIOModule_SetBaudRate(XIOModule *inst, u32 baud);
+
+void xil_printf(const char *fmt, ...);
+
+u32 mfmsr(void);
+void mtmsr(u32 msr);
+void microblaze_enable_interrupts(void);
+void microblaze_disable_interrupts(void);
+void microblaze_register_handler(XInterruptHandler handler, void *data);
+
+#endif // _XIOMODULE_H_
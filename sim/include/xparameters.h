@@ -0,0 +1,27 @@
+/*
+ * Host simulator parameters, the subset of the generated BSP
+ * xparameters.h used by the firmware
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#ifndef _XPARAMETERS_H_
+#define _XPARAMETERS_H_
+
+#define XPAR_CPU_CORE_CLOCK_FREQ_HZ     100000000
+#define XPAR_MICROBLAZE_FREQ            100000000
+
+#define XPAR_IOMODULE_0_DEVICE_ID       0
+#define XPAR_IOMODULE_0_BASEADDR        0x80000000
+#define XPAR_IOMODULE_0_IO_BASEADDR     0xC0000000
+
+#define XPAR_IOMODULE_0_FIT1_NO_CLOCKS  100000
+
+// PIT prescaler sources as in system.xml, 0 none, 1 FIT1, 9 external
+#define XPAR_IOMODULE_0_PIT1_PRESCALER  9
+#define XPAR_IOMODULE_0_PIT2_PRESCALER  9
+#define XPAR_IOMODULE_0_PIT3_PRESCALER  1
+// PIT4 unprescaled as the high resolution timer needs, unlike system.xml
+#define XPAR_IOMODULE_0_PIT4_PRESCALER  0
+
+#endif // _XPARAMETERS_H_
@@ -0,0 +1,1449 @@
+/*
+ * Host simulator entrypoint
+ *
+ * Brings the firmware services up against the peripheral models and checks
+ * the expiry of timers, driven by the tick or with --tickless the one-shot
+ * PIT, and of the high resolution timers, then measures the I2C driver:
+ * INA219 register reads through the blocking and coroutine APIs, LCD frame
+ * updates, and sensor reads while the LCD is updating. The INA219 is on
+ * the default controller at 1 MHz and the LCD backpack on a second one at
+ * 100 kHz. A second backpack on the sensor bus takes bulk low priority
+ * traffic to measure the sensor read wait bound. Faults injected on the
+ * sensor bus check that a wedged sensor fails its transfer within the
+ * timeout and the bus recovers. Two more INA219s on other rails share the
+ * sensor bus, a scan must find all three. Continuous acquisition is
+ * checked for its sample cadence and independent ring readers, then across
+ * all three sensors in one pass per period, and each rail's energy and
+ * charge over an epoch against its load. Windowed statistics and moving
+ * averages are checked against known values and a brute force sliding
+ * window, then over every sample acquired from the DC rails and a sine
+ * wave load. The decimation filters are checked for the DC gain and
+ * decimation of each stage and the passband, stopband and aliasing of the
+ * chain, then filter every acquired sample. Triggered capture is checked
+ * for each condition, back to back records, a ring pinned by records not
+ * read out and the edges of an acquired square wave load. Limits are
+ * checked for debounce, hysteresis, latching and shared outputs on
+ * synthetic samples, then for their GPO response time on an acquired rail
+ * past them. Exits non-zero if the models saw a bus protocol or LCD timing
+ * error, or read back unexpected data.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "mbsoc.h"
+#include "acq.h"
+#include "energy.h"
+#include "filt.h"
+#include "hrtimer.h"
+#include "ina219.h"
+#include "lcd.h"
+#include "limit.h"
+#include "pt.h"
+#include "task.h"
+#include "timer.h"
+#include "trig.h"
+#include "tstamp.h"
+#include "twi.h"
+#include "util.h"
+#include "workq.h"
+#include "wstat.h"
+#include "oc_i2c_master.h"
+#include "sim.h"
+#include <stdlib.h>
+
+
+#define SIM_LCD_I2C_BASE    (OC_I2C_BASE + 0x100)
+#define SIM_LCD_I2C_IRQ     (OC_I2C_IRQ + 1)
+#define SIM_INA219_HZ       1000000
+
+#define SIM_BULK_ADDR       0x26
+#define SIM_BULK_HZ         100000
+#define SIM_BULK_LEN        32
+#define SIM_BULK_BITS       (9 * (SIM_BULK_LEN + 1) + 2)
+#define SIM_BULK_US         (SIM_BULK_BITS * 1000000UL / SIM_BULK_HZ)
+#define SIM_JITTER_US       1000        // host scheduling
+
+// deadline for a register read and the recovery timeout after it
+#define SIM_WEDGE_US        (2 * (TWI_TIMEOUT_MS + 2) * 1000UL + SIM_JITTER_US)
+
+#define SIM_TIMER_MS        20
+#define SIM_TIMER_PERIOD_MS 5
+#define SIM_TIMER_RUNS      8
+#define SIM_HRTIMER_US      500
+
+// a tickless wakeup lands on a count of the PIT, up to one count late
+#ifdef TIMER_TICKLESS
+#define SIM_TIMER_SLACK_US  (TIMER_PIT_CLKS_PER_COUNT / GCNT_TICKS_PER_US)
+#else
+#define SIM_TIMER_SLACK_US  0
+#endif
+
+#define SIM_ACQ_HZ          1000
+#define SIM_ACQ_RING        128
+#define SIM_ACQ_MS          500
+
+#define SIM_RAILS           3
+#define SIM_EPOCH_MS        300
+#define SIM_STAT_WINDOW     32
+#define SIM_STAT_SLIDE      64
+#define SIM_STAT_MS         200
+#define SIM_FILT_MS         1000
+#define SIM_TRIG_RING       64
+#define SIM_TRIG_MS         300
+#define SIM_LIMIT_GPO       2
+#define SIM_LIMIT_MS        50
+
+#define SIM_SHUNT_UOHM      100000      // 0.1 ohm
+#define SIM_BUS_MV          12000
+#define SIM_REG_READS       200
+#define SIM_SAMPLES         50
+#define SIM_FRAMES          5
+
+#define SIM_LINE0           "12.0 V 1.250 mW"
+#define SIM_LINE1           "0.0125 A"
+
+
+/*
+ * Global XIO module for BSP
+ */
+XIOModule xio;
+
+static twi_bus_t lcd_bus;
+static sim_i2c_bus_t sensor_bus_model;
+static sim_i2c_bus_t lcd_bus_model;
+static sim_ina219_t ina_models[SIM_RAILS];
+static ina219_t rail_devs[INA219_ADDR_MAX - INA219_ADDR_MIN + 1];
+static sim_lcd_t lcd_model;
+static sim_lcd_t bulk_model;
+static bool failed;
+
+/*
+ * Benchmark measurement of time and bus traffic to one device
+ */
+typedef struct bench {
+    const char      *name;
+    twi_bus_t       *bus;
+    uint8_t         addr;
+    uint64_t        start;
+    twi_dev_stats_t stats;
+} bench_t;
+
+static void bench_begin (bench_t *b, const char *name, twi_bus_t *bus, uint8_t addr)
+{
+    b->name = name;
+    b->bus = bus;
+    b->addr = addr;
+    if (!twi_stats_get(bus, addr, &b->stats))
+        memset(&b->stats, 0, sizeof(b->stats));
+    b->start = gcnt_get();
+}
+
+static void bench_end (bench_t *b, uint32_t ops)
+{
+    uint64_t elapsed = gcnt_get() - b->start;
+    twi_dev_stats_t end;
+
+    twi_stats_get(b->bus, b->addr, &end);
+
+    log("%-16s %d ops in %d us: %d us/op, %d xfers/op, %d bytes/op, %d ops/s",
+            b->name, ops, (uint32_t)(elapsed / GCNT_TICKS_PER_US),
+            (uint32_t)(elapsed / GCNT_TICKS_PER_US / ops),
+            (end.xfers - b->stats.xfers) / ops,
+            (end.bytes - b->stats.bytes) / ops,
+            (uint32_t)((uint64_t)ops * GCNT_HZ / elapsed));
+}
+
+static void check (bool ok, const char *what)
+{
+    if (!ok) {
+        log("FAIL: %s", what);
+        failed = true;
+    }
+}
+
+/*
+ * Timer expiry against the global counter, from the tick or the tickless
+ * one-shot PIT
+ */
+static volatile uint64_t timer_fired[SIM_TIMER_RUNS];
+static volatile uint32_t timer_runs;
+
+static void timer_mark (void *data)
+{
+    if (timer_runs < SIM_TIMER_RUNS)
+        timer_fired[timer_runs++] = gcnt_get();
+}
+
+static bool timer_wait (uint32_t runs, uint32_t ms)
+{
+    uint64_t start = gcnt_get();
+
+    while (timer_runs < runs) {
+        if (gcnt_get() - start > ms * 1000ULL * GCNT_TICKS_PER_US)
+            return false;
+    }
+
+    return true;
+}
+
+static void bench_timer (void)
+{
+    const char *mode;
+    timer_t timer;
+    hrtimer_t hrtimer;
+    uint64_t start;
+    uint32_t i, oneshot, hr, elapsed, err, max_err = 0;
+
+#ifdef TIMER_TICKLESS
+    mode = "tickless";
+#else
+    mode = "tick";
+#endif
+
+    // a one-shot expires on the tick boundary its timeout ends in
+    timer_runs = 0;
+    timer_init(&timer, TIMER_ONE_SHOT, timer_mark, NULL);
+    start = gcnt_get();
+    timer_set(&timer, TIMEOUT_IN_MS(SIM_TIMER_MS));
+    check(timer_wait(1, 2 * SIM_TIMER_MS), "timer one-shot expires");
+    oneshot = (uint32_t)((timer_fired[0] - start) / GCNT_TICKS_PER_US);
+    check(oneshot + 1000 * TIMER_MS_PER_TICK >= SIM_TIMER_MS * 1000 &&
+          oneshot <= SIM_TIMER_MS * 1000 + SIM_TIMER_SLACK_US + SIM_JITTER_US, "timer one-shot timeout");
+
+    // a periodic timer keeps its period from tick to tick
+    timer_runs = 0;
+    timer_init(&timer, TIMER_PERIODIC, timer_mark, NULL);
+    timer_set(&timer, TIMEOUT_IN_MS(SIM_TIMER_PERIOD_MS));
+    check(timer_wait(SIM_TIMER_RUNS, 2 * SIM_TIMER_RUNS * SIM_TIMER_PERIOD_MS), "timer periodic expires");
+    timer_cancel(&timer);
+    for (i = 1; i < timer_runs; ++i) {
+        elapsed = (uint32_t)((timer_fired[i] - timer_fired[i - 1]) / GCNT_TICKS_PER_US);
+        err = (uint32_t)abs((int32_t)elapsed - SIM_TIMER_PERIOD_MS * 1000);
+        if (err > max_err)
+            max_err = err;
+    }
+    check(max_err <= SIM_TIMER_SLACK_US + SIM_JITTER_US, "timer periodic period");
+
+    // a high resolution timer expires to the microsecond
+    timer_runs = 0;
+    hrtimer_init(&hrtimer, timer_mark, NULL);
+    start = gcnt_get();
+    hrtimer_start(&hrtimer, SIM_HRTIMER_US);
+    check(timer_wait(1, SIM_TIMER_MS), "hrtimer expires");
+    hr = (uint32_t)((timer_fired[0] - start) / GCNT_TICKS_PER_US);
+    check(hr + HRTIMER_CLKS_TO_US(HRTIMER_SLACK_CLKS) >= SIM_HRTIMER_US &&
+          hr <= SIM_HRTIMER_US + SIM_JITTER_US, "hrtimer timeout");
+
+    log("timer %s: one-shot %d ms after %d us, periodic %d ms max error %d us, hrtimer %d us after %d us",
+            mode, SIM_TIMER_MS, oneshot, SIM_TIMER_PERIOD_MS, max_err, SIM_HRTIMER_US, hr);
+}
+
+/*
+ * INA219 on each rail, in address order, the first is the default sensor
+ * with the default calibration and its own waveform. The others carry a
+ * DC current through their own shunt and are calibrated for it.
+ */
+static const struct sim_rail {
+    uint8_t     addr;
+    uint32_t    bus_mv;
+    uint32_t    shunt_uohm;
+    uint32_t    max_ua; // 0 for the default calibration
+    int32_t     current_ua;
+} sim_rails[SIM_RAILS] = {
+    { INA219_ADDR,  SIM_BUS_MV, SIM_SHUNT_UOHM, 0,          0 },
+    { 0x41,         5000,       20000,          10000000,   4000000 },
+    { 0x44,         3300,       1000000,        300000,     -150000 },
+};
+
+/*
+ * INA219 register reads
+ */
+static pt_thread_t sample_thread;
+static ina219_pt_t ina_pt;
+static uint16_t sample_regs[REG_MAX];
+static volatile uint32_t samples;
+
+static PT_THREAD(ina219_sampler(struct pt *pt, void *data))
+{
+    PT_BEGIN(pt);
+
+    while (samples < SIM_SAMPLES) {
+        for (ina_pt.reg = REG_SHUNTV; ina_pt.reg <= REG_CURRENT; ++ina_pt.reg) {
+            PT_SPAWN(pt, &ina_pt.pt, ina219_get_reg_pt(&ina_pt));
+            sample_regs[ina_pt.reg] = ina_pt.value;
+        }
+        samples++;
+    }
+
+    PT_END(pt);
+}
+
+static void bench_ina219 (void)
+{
+    sim_wave_t wave = {
+        .type = SIM_WAVE_SINE,
+        .offset_ua = 100000,
+        .amplitude_ua = 50000,
+        .period_us = 20000,
+    };
+    bench_t b;
+    ina219_cal_t cal;
+    ina219_meas_t meas;
+    int32_t current;
+    uint32_t i;
+
+    sim_ina219_set_bus(&ina_models[0], SIM_BUS_MV);
+    sim_ina219_set_wave(&ina_models[0], &wave);
+
+    check(ina219_init(INA219_ADDR), "ina219 init");
+    twi_set_speed(NULL, INA219_ADDR, SIM_INA219_HZ);
+
+    bench_begin(&b, "ina219 blocking", NULL, INA219_ADDR);
+    for (i = 0; i < SIM_REG_READS; ++i)
+        ina219_get_reg(INA219_ADDR, REG_CURRENT);
+    bench_end(&b, SIM_REG_READS);
+
+    ina_pt.i2c_addr = INA219_ADDR;
+    bench_begin(&b, "ina219 coroutine", NULL, INA219_ADDR);
+    pt_sched_start(&sample_thread, ina219_sampler, NULL);
+    while (samples < SIM_SAMPLES)
+        workq_run_one();
+    bench_end(&b, SIM_SAMPLES);
+
+    check(INA219_Q16_MILLI(ina219_busv_q16(sample_regs[REG_BUSV])) == SIM_BUS_MV, "ina219 bus voltage");
+
+    check(ina219_calibrate_lsb(&cal, INA219_SHUNT_UOHM, INA219_CURRENT_LSB_NA) && cal.calib == INA219_CALIB,
+          "ina219 default calibration");
+    current = INA219_Q16_MILLI(ina219_current_q16(&cal, sample_regs[REG_CURRENT]));
+    check(current >= wave.offset_ua - wave.amplitude_ua - 100 &&
+          current <= wave.offset_ua + wave.amplitude_ua + 100, "ina219 current in waveform range");
+
+    check(ina219_get_measure(INA219_ADDR, &meas) && INA219_Q16_MILLI(meas.busv) == SIM_BUS_MV &&
+          meas.power > 0 && !meas.ovf, "ina219 measurement");
+}
+
+/*
+ * LCD frames
+ */
+static pt_thread_t lcd_thread;
+static lcd_pt_t lcd_pt;
+static volatile uint32_t lcd_frames;
+static volatile bool lcd_done;
+
+static PT_THREAD(lcd_frame(struct pt *pt, void *data))
+{
+    PT_BEGIN(pt);
+
+    while (lcd_frames) {
+        lcd_pt.cmd = 0x01;
+        PT_SPAWN(pt, &lcd_pt.pt, lcd_cmd_pt(&lcd_pt));
+        lcd_pt.s = SIM_LINE0;
+        PT_SPAWN(pt, &lcd_pt.pt, lcd_puts_pt(&lcd_pt));
+        lcd_pt.ln = 1;
+        lcd_pt.ch = 0;
+        PT_SPAWN(pt, &lcd_pt.pt, lcd_move_pt(&lcd_pt));
+        lcd_pt.s = SIM_LINE1;
+        PT_SPAWN(pt, &lcd_pt.pt, lcd_puts_pt(&lcd_pt));
+        if (lcd_frames)
+            lcd_frames--; // may have been stopped mid-frame
+    }
+    lcd_done = true;
+
+    PT_END(pt);
+}
+
+static bool lcd_shows (const char *line0, const char *line1)
+{
+    return memcmp(&lcd_model.ddram[0x00], line0, strlen(line0)) == 0 &&
+           memcmp(&lcd_model.ddram[0x40], line1, strlen(line1)) == 0;
+}
+
+static void bench_lcd (void)
+{
+    bench_t b;
+    uint32_t i;
+
+    lcd_set_bus(&lcd_bus);
+    lcd_init();
+    lcd_config(LCD_CFG_BACKLIGHT_ON | LCD_CFG_DISPLAY_ON);
+
+    bench_begin(&b, "lcd blocking", &lcd_bus, LCD_I2C_ADDR);
+    for (i = 0; i < SIM_FRAMES; ++i) {
+        lcd_clr();
+        lcd_puts(SIM_LINE0);
+        lcd_move(1, 0);
+        lcd_puts(SIM_LINE1);
+    }
+    while (twi_busy(&lcd_bus))
+        ;
+    bench_end(&b, SIM_FRAMES);
+    check(lcd_shows(SIM_LINE0, SIM_LINE1), "lcd blocking frame contents");
+
+    lcd_pt_init(&lcd_pt);
+    bench_begin(&b, "lcd coroutine", &lcd_bus, LCD_I2C_ADDR);
+    lcd_frames = SIM_FRAMES;
+    lcd_done = false;
+    pt_sched_start(&lcd_thread, lcd_frame, NULL);
+    while (!lcd_done)
+        workq_run_one();
+    bench_end(&b, SIM_FRAMES);
+    check(lcd_shows(SIM_LINE0, SIM_LINE1), "lcd coroutine frame contents");
+}
+
+/*
+ * Sensor reads while the LCD updates on its own bus
+ */
+static void bench_concurrent (void)
+{
+    bench_t b;
+
+    samples = 0;
+    lcd_frames = UINT32_MAX;
+    lcd_done = false;
+
+    bench_begin(&b, "ina219 with lcd", NULL, INA219_ADDR);
+    pt_sched_start(&lcd_thread, lcd_frame, NULL);
+    pt_sched_start(&sample_thread, ina219_sampler, NULL);
+    while (samples < SIM_SAMPLES)
+        workq_run_one();
+    bench_end(&b, SIM_SAMPLES);
+
+    lcd_frames = 0;
+    while (!lcd_done)
+        workq_run_one();
+    check(lcd_shows(SIM_LINE0, SIM_LINE1), "lcd concurrent frame contents");
+}
+
+/*
+ * Sensor reads against back to back bulk transfers on the same bus
+ */
+static twi_xfer_t bulk_xfer[2];
+static uint8_t bulk_buf[SIM_BULK_LEN]; // EN stays low, nothing is latched
+static volatile bool bulk_run;
+static volatile uint32_t bulk_done;
+
+static void bulk_cb (twi_xfer_t *xfer, uint8_t status)
+{
+    bulk_done++;
+    if (bulk_run)
+        twi_submit(xfer);
+}
+
+static void bench_priority (void)
+{
+    bench_t b;
+    uint32_t high, low;
+    uint8_t i;
+
+    twi_set_speed(NULL, SIM_BULK_ADDR, SIM_BULK_HZ);
+    twi_stats_reset(NULL);
+
+    bulk_run = true;
+    bulk_done = 0;
+    for (i = 0; i < 2; ++i) {
+        twi_xfer_init(&bulk_xfer[i], bulk_cb, NULL);
+        bulk_xfer[i].prio = TWI_PRIO_LOW;
+        twi_xfer_write(&bulk_xfer[i], SIM_BULK_ADDR, bulk_buf, sizeof(bulk_buf));
+        twi_submit(&bulk_xfer[i]);
+    }
+
+    samples = 0;
+    bench_begin(&b, "ina219 with bulk", NULL, INA219_ADDR);
+    pt_sched_start(&sample_thread, ina219_sampler, NULL);
+    while (samples < SIM_SAMPLES)
+        workq_run_one();
+    bench_end(&b, SIM_SAMPLES);
+
+    bulk_run = false;
+    while (twi_xfer_pending(&bulk_xfer[0]) || twi_xfer_pending(&bulk_xfer[1]))
+        ;
+
+    high = twi_stats_max_wait(NULL, TWI_PRIO_HIGH);
+    low = twi_stats_max_wait(NULL, TWI_PRIO_LOW);
+    log("bulk xfers: %d of %d us, max wait high: %d us low: %d us",
+            bulk_done, SIM_BULK_US, high, low);
+
+    // one bulk transfer in progress plus at most one aged one picked ahead
+    check(high <= 2 * SIM_BULK_US + SIM_JITTER_US, "high priority wait bound");
+    check(bulk_done >= 2, "low priority progress");
+}
+
+/*
+ * Register reads against a wedged sensor
+ */
+static twi_xfer_t fault_xfer;
+static uint8_t fault_buf[3];
+static volatile uint8_t fault_status;
+
+static void fault_cb (twi_xfer_t *xfer, uint8_t status)
+{
+    fault_status = status;
+}
+
+/*
+ * Read a register with a fault on the bus, aborting once started if asked,
+ * and return the time to completion in us
+ */
+static uint32_t fault_read (uint8_t fault, bool abort)
+{
+    uint64_t start;
+
+    sim_i2c_fault(&sensor_bus_model, fault);
+
+    fault_status = TWI_XFER_IDLE;
+    fault_buf[0] = REG_CALIB;
+    twi_xfer_write_read(&fault_xfer, INA219_ADDR, &fault_buf[0], 1, &fault_buf[1], 2);
+
+    start = gcnt_get();
+    twi_submit(&fault_xfer);
+    if (abort)
+        check(twi_abort(&fault_xfer), "abort transfer in progress");
+    while (twi_xfer_pending(&fault_xfer))
+        ;
+
+    return (uint32_t)((gcnt_get() - start) / GCNT_TICKS_PER_US);
+}
+
+static void bench_recovery (void)
+{
+    uint16_t val;
+    uint32_t us;
+
+    twi_xfer_init(&fault_xfer, fault_cb, NULL);
+    fault_xfer.prio = TWI_PRIO_HIGH;
+
+    us = fault_read(SIM_I2C_FAULT_SCL_LOW, false);
+    sim_i2c_fault(&sensor_bus_model, SIM_I2C_FAULT_NONE);
+    log("scl held low: status %d after %d us", fault_status, us);
+    check(fault_status == TWI_XFER_TIMEOUT, "scl held low times out");
+    check(us <= SIM_WEDGE_US, "scl held low timeout bound");
+    check(ina219_read_reg(INA219_ADDR, REG_CALIB, &val) && val == INA219_CALIB,
+          "read after scl held low");
+
+    us = fault_read(SIM_I2C_FAULT_SDA_LOW, false);
+    log("sda held low: status %d after %d us", fault_status, us);
+    check(fault_status == TWI_XFER_ARB_LOST, "sda held low loses arbitration");
+    check(sensor_bus_model.fault == SIM_I2C_FAULT_NONE, "sda released by recovery");
+    check(ina219_read_reg(INA219_ADDR, REG_CALIB, &val) && val == INA219_CALIB,
+          "read after sda held low");
+
+    us = fault_read(SIM_I2C_FAULT_SCL_LOW, true);
+    sim_i2c_fault(&sensor_bus_model, SIM_I2C_FAULT_NONE);
+    log("aborted: status %d after %d us", fault_status, us);
+    check(fault_status == TWI_XFER_ABORTED, "abort status");
+    check(us <= SIM_WEDGE_US, "abort bound");
+    check(ina219_read_reg(INA219_ADDR, REG_CALIB, &val) && val == INA219_CALIB,
+          "read after abort");
+}
+
+/*
+ * Discovery of the sensors on the bus and their own instances
+ */
+static void bench_scan (void)
+{
+    const struct sim_rail *rail;
+    ina219_meas_t meas;
+    uint64_t start;
+    int32_t current, power, lsb;
+    uint16_t val;
+    uint8_t n, i;
+
+    // the bulk backpack acknowledges too but is outside the INA219 range
+    n = ina219_scan(NULL, rail_devs, ARRAY_SIZE(rail_devs));
+    log("ina219 scan found %d", n);
+    check(n == SIM_RAILS, "ina219 scan count");
+
+    for (i = 0; i < n && i < SIM_RAILS; ++i) {
+        rail = &sim_rails[i];
+        check(rail_devs[i].addr == rail->addr, "ina219 scan address");
+
+        if (rail->max_ua)
+            check(ina219_calibrate(&rail_devs[i].cal, rail->shunt_uohm, rail->max_ua), "ina219 calibrate");
+        check(ina219_dev_setup(&rail_devs[i]), "ina219 setup");
+        twi_set_speed(NULL, rail_devs[i].addr, SIM_INA219_HZ);
+
+        check(ina219_dev_read(&rail_devs[i], REG_CALIB, &val) && val == rail_devs[i].cal.calib,
+              "ina219 rail instance access");
+
+        if (rail->max_ua == 0)
+            continue;
+
+        // units follow the rail's shunt, within two LSBs
+        start = gcnt_get();
+        while (gcnt_get() - start < 2ULL * ina219_conv_us(rail_devs[i].config) * GCNT_TICKS_PER_US)
+            ;
+        check(ina219_dev_measure(&rail_devs[i], &meas), "ina219 rail measure");
+
+        current = INA219_Q16_MILLI(meas.current);
+        power = INA219_Q16_MILLI(meas.power);
+        lsb = rail_devs[i].cal.current_lsb_pa / 1000000;
+        log("ina219 0x%02x: %d mV %d uA %d mW, calib %d current LSB %d pA",
+                rail->addr, INA219_Q16_MILLI(meas.busv), current, power,
+                rail_devs[i].cal.calib, rail_devs[i].cal.current_lsb_pa);
+
+        check(INA219_Q16_MILLI(meas.busv) == rail->bus_mv, "ina219 rail bus voltage");
+        check(abs(current - rail->current_ua) <= 2 * lsb, "ina219 rail current");
+        check(abs(power - (int32_t)((int64_t)rail->bus_mv * current / 1000000)) <= 2 * 20 * lsb / 1000 + 1,
+              "ina219 rail power and sign");
+        check(!meas.ovf, "ina219 rail overflow");
+    }
+}
+
+/*
+ * Continuous acquisition with a reader keeping up and one that doesn't
+ */
+static acq_sensor_t acq_sensors[SIM_RAILS];
+static acq_sample_t acq_rings[SIM_RAILS][SIM_ACQ_RING];
+
+typedef struct acq_run {
+    acq_stats_t     stats[SIM_RAILS];
+    uint32_t        conversions[SIM_RAILS];
+    uint32_t        read; // of the first sensor by the reader keeping up
+    uint32_t        jitter; // us from the sample cadence
+} acq_run_t;
+
+static void acq_run (acq_run_t *run, uint8_t sensors, uint16_t config, uint32_t rate_hz)
+{
+    acq_reader_t fast, slow;
+    acq_sample_t s, prev = { 0 };
+    uint64_t start;
+    uint32_t period = rate_hz ? GCNT_HZ / rate_hz : 0;
+    uint32_t n = 0, gap;
+    uint8_t i;
+
+    memset(run, 0, sizeof(*run));
+
+    acq_init();
+    for (i = 0; i < sensors; ++i) {
+        rail_devs[i].config = config;
+        acq_add(&acq_sensors[i], &rail_devs[i], acq_rings[i], SIM_ACQ_RING);
+        run->conversions[i] = ina_models[i].conversions;
+    }
+    acq_reader_init(&fast, &acq_sensors[0]);
+    acq_reader_init(&slow, &acq_sensors[0]);
+
+    start = gcnt_get();
+    check(acq_start(rate_hz), "acq start");
+    while (gcnt_get() - start < SIM_ACQ_MS * 1000ULL * GCNT_TICKS_PER_US) {
+        if (!acq_read(&fast, &s))
+            continue;
+
+        if (n++ && period) {
+            // from the nearest period, a stale poll skips one
+            gap = (uint32_t)(s.tstamp - prev.tstamp) % period;
+            gap = gap > period / 2 ? period - gap : gap;
+            if (gap > run->jitter)
+                run->jitter = gap;
+        }
+        prev = s;
+        check(INA219_Q16_MILLI(ina219_busv_q16(s.raw.busv)) == SIM_BUS_MV, "acq bus voltage");
+        check(s.raw.busv & INA219_BUSV_CNVR, "acq sample is a new conversion");
+    }
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+    while (acq_read(&fast, &s))
+        ++n;
+
+    for (i = 0; i < sensors; ++i) {
+        acq_get_stats(&acq_sensors[i], &run->stats[i]);
+        run->conversions[i] = ina_models[i].conversions - run->conversions[i];
+        check(run->stats[i].errors == 0, "acq errors");
+        check(acq_latest(&acq_sensors[i], &s) &&
+              INA219_Q16_MILLI(ina219_busv_q16(s.raw.busv)) == sim_rails[i].bus_mv, "acq rail bus voltage");
+    }
+    run->read = n;
+    run->jitter /= GCNT_TICKS_PER_US;
+
+    check(n == run->stats[0].samples && fast.dropped == 0, "acq reader keeping up");
+
+    check(acq_available(&slow) == SIM_ACQ_RING, "acq slow reader backlog");
+    n = 0;
+    while (acq_read(&slow, &s))
+        ++n;
+    check(n == SIM_ACQ_RING && slow.dropped == run->stats[0].samples - SIM_ACQ_RING,
+          "acq slow reader drops");
+
+    acq_stats_dump();
+}
+
+static void bench_acq (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3);
+    uint32_t expect, rate_hz, total = 0;
+    acq_run_t run;
+    uint8_t i;
+
+    // rates faster than a sample's register reads are refused
+    acq_init();
+    rail_devs[0].config = config | INA219_CFG_BADC(INA219_ADC_9BIT) | INA219_CFG_SADC(INA219_ADC_9BIT) |
+                          INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    acq_add(&acq_sensors[0], &rail_devs[0], acq_rings[0], SIM_ACQ_RING);
+    check(!acq_start(GCNT_HZ + 1) && !acq_start(SIM_INA219_HZ / 100), "acq rate past the bus refused");
+    check(!acq_start(0), "acq conversions past the bus refused");
+
+    // a pass reads every rail on a bus, four registers each, a rate one
+    // rail fits two don't
+    rate_hz = GCNT_HZ * 2 / (3 * 4 * twi_xfer_clks(NULL, rail_devs[0].addr, 1, 2));
+    check(acq_start(rate_hz), "acq rate one rail fits");
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+    rail_devs[1].config = rail_devs[0].config;
+    acq_add(&acq_sensors[1], &rail_devs[1], acq_rings[1], SIM_ACQ_RING);
+    check(!acq_start(rate_hz), "acq rate past two rails on one bus refused");
+
+    // polls follow the part's continuous conversions
+    acq_run(&run, 1, config | INA219_CFG_BADC(INA219_ADC_12BIT) | INA219_CFG_SADC(INA219_ADC_12BIT) |
+            INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT), 0);
+    log("acq continuous: %d samples of %d conversions, %d stale polls",
+            run.stats[0].samples, run.conversions[0], run.stats[0].stale);
+    // overruns are the host not scheduling the simulation in time
+    check(run.stats[0].samples <= run.conversions[0] &&
+          run.stats[0].samples + run.stats[0].overruns + 2 >= run.conversions[0],
+          "acq continuous takes every conversion once");
+    check(run.stats[0].stale <= run.stats[0].samples / 2, "acq continuous polling overhead");
+
+    // each sample triggers the next conversion, which is done by the next tick
+    expect = SIM_ACQ_MS * SIM_ACQ_HZ / 1000;
+    acq_run(&run, 1, config | INA219_CFG_BADC(INA219_ADC_9BIT) | INA219_CFG_SADC(INA219_ADC_9BIT) |
+            INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_TRIG), SIM_ACQ_HZ);
+    log("acq triggered: %d samples of %d, %d conversions, %d stale %d overruns, max cadence jitter: %d us",
+            run.stats[0].samples, expect, run.conversions[0], run.stats[0].stale, run.stats[0].overruns,
+            run.jitter);
+    check(run.stats[0].samples + run.stats[0].stale + run.stats[0].overruns + 1 >= expect,
+          "acq triggered sample count");
+    check(run.stats[0].samples + 1 >= run.conversions[0], "acq triggered takes every conversion");
+    check(run.jitter <= SIM_JITTER_US, "acq cadence");
+
+    // all rails in one pass per conversion, each keeps its full rate
+    acq_run(&run, SIM_RAILS, config | INA219_CFG_BADC(INA219_ADC_AVG2) | INA219_CFG_SADC(INA219_ADC_AVG2) |
+            INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT), 0);
+    for (i = 0; i < SIM_RAILS; ++i) {
+        log("acq 0x%02x: %d samples of %d conversions, %d stale %d overruns",
+                sim_rails[i].addr, run.stats[i].samples, run.conversions[i], run.stats[i].stale,
+                run.stats[i].overruns);
+        check(run.stats[i].samples <= run.conversions[i] &&
+              run.stats[i].samples + run.stats[i].overruns + 2 >= run.conversions[i],
+              "acq multi-sensor takes every conversion once");
+        check(run.stats[i].overruns <= run.conversions[i] / 32, "acq multi-sensor pass fits the period");
+        total += run.stats[i].samples;
+    }
+    log("acq multi-sensor: %d samples/s", total * 1000 / SIM_ACQ_MS);
+}
+
+/*
+ * Energy and charge over an epoch against each rail's load
+ */
+static double sim_wait_ms (uint32_t ms)
+{
+    uint64_t start = gcnt_get();
+
+    while (gcnt_get() - start < ms * 1000ULL * GCNT_TICKS_PER_US)
+        ;
+
+    return ms;
+}
+
+static void bench_energy (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | INA219_CFG_BADC(INA219_ADC_AVG2) |
+                      INA219_CFG_SADC(INA219_ADC_AVG2) | INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    energy_report_t r;
+    ina219_meas_t meas;
+    acq_sample_t s;
+    double hours, wh, mah, expect_wh, expect_mah;
+    uint8_t i;
+
+    acq_init();
+    for (i = 0; i < SIM_RAILS; ++i) {
+        rail_devs[i].config = config;
+        acq_add(&acq_sensors[i], &rail_devs[i], acq_rings[i], SIM_ACQ_RING);
+    }
+    check(acq_start(0), "energy acq start");
+
+    sim_wait_ms(SIM_EPOCH_MS / 2);
+    for (i = 0; i < SIM_RAILS; ++i)
+        energy_epoch(&acq_sensors[i].energy);
+    sim_wait_ms(SIM_EPOCH_MS);
+
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+
+    for (i = 0; i < SIM_RAILS; ++i) {
+        energy_get(&acq_sensors[i].energy, &rail_devs[i].cal, &r);
+        acq_latest(&acq_sensors[i], &s);
+        ina219_measure(&rail_devs[i].cal, &s.raw, &meas);
+
+        hours = (double)r.epoch_clks / GCNT_HZ / 3600;
+        wh = (double)r.epoch_wh / 4294967296.0;
+        mah = (double)r.epoch_mah / 4294967296.0;
+
+        log("energy 0x%02x: epoch %d ms %d uWh %d uAh peak %d mW, total %d uWh %d uAh",
+                sim_rails[i].addr, (uint32_t)(r.epoch_clks / (GCNT_TICKS_PER_US * 1000)),
+                (int32_t)ENERGY_Q32_SCALE(r.epoch_wh, 1000000), (int32_t)ENERGY_Q32_SCALE(r.epoch_mah, 1000),
+                INA219_Q16_MILLI(r.epoch_peak_w),
+                (int32_t)ENERGY_Q32_SCALE(r.total_wh, 1000000), (int32_t)ENERGY_Q32_SCALE(r.total_mah, 1000));
+
+        check(r.epoch_clks >= (SIM_EPOCH_MS - 5) * 1000ULL * GCNT_TICKS_PER_US &&
+              r.epoch_clks <= (SIM_EPOCH_MS + 5) * 1000ULL * GCNT_TICKS_PER_US, "energy epoch length");
+
+        if (sim_rails[i].max_ua == 0) {
+            // the sine load averages to its offset over whole periods
+            expect_wh = SIM_BUS_MV / 1000.0 * 0.1 * hours;
+            check(wh > expect_wh * 0.98 && wh < expect_wh * 1.02, "energy of a varying load");
+            check(r.total_wh > r.epoch_wh, "energy total runs across epochs");
+            continue;
+        }
+
+        // a DC load integrates to exactly its measurement over the epoch
+        expect_wh = meas.power / 65536.0 * hours;
+        expect_mah = meas.current / 65536.0 * hours;
+        check(wh / expect_wh > 0.9999 && wh / expect_wh < 1.0001, "energy of a DC load");
+        check(mah / expect_mah > 0.9999 && mah / expect_mah < 1.0001, "charge of a DC load");
+        check(r.epoch_peak_w == meas.power, "energy epoch peak power");
+        check(sim_rails[i].current_ua > 0 ? r.total_wh > r.epoch_wh : r.total_wh < r.epoch_wh,
+              "energy total runs across epochs");
+    }
+}
+
+/*
+ * Windowed statistics against known sequences and the rails' loads
+ */
+static struct sim_rail_stats {
+    wstat_window_t  power;
+    wstat_window_t  current;
+    int32_t         ring[SIM_STAT_SLIDE];
+    uint32_t        minq[SIM_STAT_SLIDE];
+    uint32_t        maxq[SIM_STAT_SLIDE];
+    wstat_ema_t     current_ema;
+} rail_stats[SIM_RAILS];
+
+static void rail_stats_update (acq_sensor_t *sensor, const acq_sample_t *sample, void *data)
+{
+    struct sim_rail_stats *st = data;
+    int32_t current = (int16_t)sample->raw.current;
+
+    wstat_add(&st->power, current < 0 ? -(int32_t)sample->raw.power : sample->raw.power);
+    wstat_add(&st->current, current);
+    wstat_ema_add(&st->current_ema, current);
+}
+
+static bool near (double val, double expect, double tol)
+{
+    return val >= expect - tol && val <= expect + tol;
+}
+
+static void bench_wstat (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | INA219_CFG_BADC(INA219_ADC_AVG2) |
+                      INA219_CFG_SADC(INA219_ADC_AVG2) | INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    struct sim_rail_stats *st = &rail_stats[0];
+    int32_t vals[1000], mean, std, min, max;
+    wstat_result_t r;
+    ina219_meas_t meas;
+    acq_stats_t stats;
+    acq_sample_t s;
+    int64_t sum;
+    uint32_t i, j, bad = 0;
+
+    // tumbling window of 1 2 3 4 in units
+    wstat_tumbling_init(&st->power, 4);
+    check(!wstat_get(&st->power, WSTAT_UNIT, &r), "wstat no window before the first closes");
+    for (i = 1; i <= 6; ++i)
+        wstat_add(&st->power, i);
+    check(wstat_get(&st->power, WSTAT_UNIT, &r) && r.count == 4 && st->power.windows == 1, "wstat tumbling window");
+    check(r.min == 1 << 16 && r.max == 4 << 16 && r.mean == 5 << 15, "wstat tumbling min max mean");
+    check(near(r.rms / 65536.0, 2.7386, 0.005) && near(r.std / 65536.0, 1.1180, 0.005) &&
+          r.var == 5 << 14, "wstat tumbling rms std var");
+
+    // closed early with the 5 6 added since, then with nothing
+    wstat_close(&st->power);
+    check(wstat_get(&st->power, WSTAT_UNIT, &r) && r.count == 2 && r.mean == 11 << 15 &&
+          st->power.windows == 2, "wstat tumbling window closed early");
+    wstat_close(&st->power);
+    check(!wstat_get(&st->power, WSTAT_UNIT, &r) && st->power.windows == 3, "wstat empty window closed");
+
+    // full scale samples saturate at a unit per LSB and fit at half that
+    wstat_tumbling_init(&st->power, 2);
+    wstat_add(&st->power, WSTAT_VAL_MAX);
+    wstat_add(&st->power, -WSTAT_VAL_MAX);
+    check(wstat_get(&st->power, WSTAT_UNIT, &r) && r.min == INT32_MIN && r.max == INT32_MAX &&
+          r.std == INT32_MAX, "wstat saturates past Q15.16");
+    check(wstat_get(&st->power, WSTAT_UNIT / 2, &r) && r.max == WSTAT_VAL_MAX << 15 &&
+          r.min == -(WSTAT_VAL_MAX << 15) && r.std == WSTAT_VAL_MAX << 15 &&
+          r.var == (int64_t)WSTAT_VAL_MAX * WSTAT_VAL_MAX << 14, "wstat full scale at half a unit");
+
+    // sliding window against a brute force one over full scale samples
+    wstat_sliding_init(&st->current, SIM_STAT_SLIDE, st->ring, st->minq, st->maxq);
+    srand(1);
+    for (i = 0; i < ARRAY_SIZE(vals); ++i) {
+        vals[i] = rand() % (2 * WSTAT_VAL_MAX + 1) - WSTAT_VAL_MAX;
+        if (i > ARRAY_SIZE(vals) / 2)
+            vals[i] = vals[i] / 64 + (int32_t)(i * 50) - 40000; // rising, the maximum churns
+        wstat_add(&st->current, vals[i]);
+
+        min = max = vals[i];
+        sum = 0;
+        for (j = i >= SIM_STAT_SLIDE ? i - SIM_STAT_SLIDE + 1 : 0; j <= i; ++j) {
+            min = vals[j] < min ? vals[j] : min;
+            max = vals[j] > max ? vals[j] : max;
+            sum += vals[j];
+        }
+        if (st->current.cur.min != min || st->current.cur.max != max || st->current.cur.sum != sum)
+            bad++;
+    }
+    check(bad == 0, "wstat sliding window matches brute force");
+    check(wstat_get(&st->current, WSTAT_UNIT, &r) && r.count == SIM_STAT_SLIDE, "wstat sliding window full");
+
+    // moving average of a square wave settles to its middle and half swing
+    wstat_ema_init(&st->current_ema, 4);
+    check(!wstat_ema_get(&st->current_ema, WSTAT_UNIT, &mean, &std), "wstat ema empty");
+    for (i = 0; i < 500; ++i)
+        wstat_ema_add(&st->current_ema, i & 1 ? 1500 : -500);
+    check(wstat_ema_get(&st->current_ema, WSTAT_UNIT, &mean, &std) &&
+          near(mean / 65536.0, 500, 70) && near(std / 65536.0, 1000, 30), "wstat ema mean and deviation");
+
+    // every acquired sample, updated in the acquisition ISR
+    acq_init();
+    for (i = 0; i < SIM_RAILS; ++i) {
+        st = &rail_stats[i];
+        wstat_tumbling_init(&st->power, SIM_STAT_WINDOW);
+        wstat_sliding_init(&st->current, SIM_STAT_SLIDE, st->ring, st->minq, st->maxq);
+        wstat_ema_init(&st->current_ema, 6);
+        rail_devs[i].config = config;
+        acq_add(&acq_sensors[i], &rail_devs[i], acq_rings[i], SIM_ACQ_RING);
+        acq_set_sample_fn(&acq_sensors[i], rail_stats_update, st);
+    }
+    check(acq_start(0), "wstat acq start");
+    sim_wait_ms(SIM_STAT_MS);
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+
+    for (i = 0; i < SIM_RAILS; ++i) {
+        const ina219_cal_t *cal = &rail_devs[i].cal;
+
+        st = &rail_stats[i];
+        acq_get_stats(&acq_sensors[i], &stats);
+        acq_latest(&acq_sensors[i], &s);
+        ina219_measure(cal, &s.raw, &meas);
+        check(st->power.windows * SIM_STAT_WINDOW + st->power.cur.count == stats.samples,
+              "wstat sees every sample");
+
+        wstat_get(&st->power, cal->power_scale, &r);
+        log("wstat 0x%02x: %d windows power (mW) %d [%d %d] std %d", sim_rails[i].addr, st->power.windows,
+                INA219_Q16_MILLI(r.mean), INA219_Q16_MILLI(r.min), INA219_Q16_MILLI(r.max), INA219_Q16_MILLI(r.std));
+        wstat_get(&st->current, cal->current_scale, &r);
+        wstat_ema_get(&st->current_ema, cal->current_scale, &mean, &std);
+        log("wstat 0x%02x: current (uA) %d [%d %d] rms %d std %d ema %d std %d", sim_rails[i].addr,
+                INA219_Q16_MILLI(r.mean), INA219_Q16_MILLI(r.min), INA219_Q16_MILLI(r.max),
+                INA219_Q16_MILLI(r.rms), INA219_Q16_MILLI(r.std), INA219_Q16_MILLI(mean), INA219_Q16_MILLI(std));
+
+        if (sim_rails[i].max_ua == 0) {
+            // 100 mA offset, 50 mA amplitude
+            check(near(INA219_Q16_MILLI(r.min), 50000, 2000) && near(INA219_Q16_MILLI(r.max), 150000, 2000),
+                  "wstat sliding range of a varying load");
+            check(near(INA219_Q16_MILLI(r.rms), 106066, 2000) && near(INA219_Q16_MILLI(r.std), 35355, 2000),
+                  "wstat rms and deviation of a varying load");
+            continue;
+        }
+
+        // a DC load is its measurement throughout
+        check(r.min == meas.current && r.max == meas.current && r.mean == meas.current &&
+              r.std == 0 && r.rms == (meas.current < 0 ? -meas.current : meas.current), "wstat of a DC load");
+        check(mean == meas.current && std == 0, "wstat ema of a DC load");
+    }
+}
+
+/*
+ * Decimation filters against DC and sine inputs and the rails' loads
+ */
+static struct sim_rail_filt {
+    filt_chain_t    chain;
+    filt_cic_t      cic;
+    filt_fir_t      fir;
+    filt_biquad_t   bq;
+    int32_t         hist[2 * ARRAY_SIZE(filt_fir_lp15)];
+    int32_t         out;
+} rail_filts[SIM_RAILS];
+
+static void sim_filt_init (struct sim_rail_filt *f, bool cic, bool fir, bool bq)
+{
+    filt_chain_init(&f->chain);
+    filt_cic_init(&f->cic, 3, 8);
+    filt_fir_init(&f->fir, filt_fir_lp15, ARRAY_SIZE(filt_fir_lp15), 2, f->hist);
+    filt_biquad_init(&f->bq, &filt_biquad_lp10, 1);
+    if (cic)
+        filt_chain_add(&f->chain, &f->cic.stage);
+    if (fir)
+        filt_chain_add(&f->chain, &f->fir.stage);
+    if (bq)
+        filt_chain_add(&f->chain, &f->bq.stage);
+}
+
+/*
+ * Largest output magnitude of a chain over the second half of a sine input
+ * of a period in samples, taken from the INA219 model's waveform
+ */
+static int32_t sim_filt_sine (struct sim_rail_filt *f, uint32_t period, int32_t amplitude)
+{
+    sim_ina219_t model = {
+        .wave = { .type = SIM_WAVE_SINE, .amplitude_ua = amplitude, .period_us = period },
+    };
+    uint32_t i, n = 40 * period;
+    int32_t out, peak = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (!filt_push(&f->chain, sim_ina219_current(&model, i * SIM_CLKS_PER_US), &out) || i < n / 2)
+            continue;
+        out = out < 0 ? -out : out;
+        peak = out > peak ? out : peak;
+    }
+
+    return peak >> FILT_FRAC;
+}
+
+static void rail_filt_update (acq_sensor_t *sensor, const acq_sample_t *sample, void *data)
+{
+    struct sim_rail_filt *f = data;
+
+    filt_push(&f->chain, (int16_t)sample->raw.current, &f->out);
+}
+
+static void bench_filt (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | INA219_CFG_BADC(INA219_ADC_AVG2) |
+                      INA219_CFG_SADC(INA219_ADC_AVG2) | INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    struct sim_rail_filt *f = &rail_filts[0];
+    int32_t out = 0, peak;
+    ina219_meas_t meas;
+    acq_sample_t s;
+    uint32_t i;
+
+    // each stage passes DC exactly once settled
+    sim_filt_init(f, true, false, false);
+    for (i = 0; i < 64; ++i)
+        filt_push(&f->chain, -1234, &out);
+    check(out == -1234 * (1 << FILT_FRAC) && f->chain.out == 8, "filt cic dc gain and decimation");
+
+    sim_filt_init(f, false, true, false);
+    for (i = 0; i < 64; ++i)
+        filt_push(&f->chain, WSTAT_VAL_MAX, &out);
+    check(out == WSTAT_VAL_MAX << FILT_FRAC && f->chain.out == 32, "filt fir dc gain and decimation");
+
+    sim_filt_init(f, false, false, true);
+    for (i = 0; i < 200; ++i)
+        filt_push(&f->chain, 4321, &out);
+    check(out == 4321 << FILT_FRAC, "filt biquad settles to dc");
+
+    // through the whole chain, well under the cutoff passes and over it doesn't
+    sim_filt_init(f, true, true, true);
+    check(f->chain.decim == 16, "filt chain decimation");
+    peak = sim_filt_sine(f, 16 * 50, 10000);
+    log("filt chain: sine of 0.02 output rate peak %d", peak);
+    check(peak > 9800 && peak < 10100, "filt chain passband");
+    sim_filt_init(f, true, true, true);
+    peak = sim_filt_sine(f, 16 * 4, 10000);
+    log("filt chain: sine of 0.25 output rate peak %d", peak);
+    check(peak < 1000, "filt chain stopband");
+    sim_filt_init(f, true, true, true);
+    peak = sim_filt_sine(f, 20, 10000);
+    log("filt chain: sine past the cic input Nyquist/4 peak %d", peak);
+    check(peak < 200, "filt chain anti-alias");
+
+    // every acquired sample, filtered in the acquisition ISR
+    acq_init();
+    for (i = 0; i < SIM_RAILS; ++i) {
+        sim_filt_init(&rail_filts[i], true, true, true);
+        rail_devs[i].config = config;
+        acq_add(&acq_sensors[i], &rail_devs[i], acq_rings[i], SIM_ACQ_RING);
+        acq_set_sample_fn(&acq_sensors[i], rail_filt_update, &rail_filts[i]);
+    }
+    check(acq_start(0), "filt acq start");
+    sim_wait_ms(SIM_FILT_MS);
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+
+    for (i = 0; i < SIM_RAILS; ++i) {
+        f = &rail_filts[i];
+        acq_latest(&acq_sensors[i], &s);
+        ina219_measure(&rail_devs[i].cal, &s.raw, &meas);
+        out = FILT_Q16(f->out, rail_devs[i].cal.current_scale);
+        log("filt 0x%02x: %d samples in %d out current (uA) %d", sim_rails[i].addr,
+                f->chain.in, f->chain.out, INA219_Q16_MILLI(out));
+
+        check(f->chain.out == f->chain.in / 16, "filt decimates every sample");
+        if (sim_rails[i].max_ua == 0)
+            check(near(INA219_Q16_MILLI(out), 100000, 5000), "filt of a varying load");
+        else
+            check(near(out, meas.current, abs(meas.current) / 10000), "filt of a DC load");
+    }
+}
+
+/*
+ * Triggered capture against synthetic samples and a square wave load
+ */
+static trig_t rail_trig;
+static acq_sample_t trig_ring[SIM_TRIG_RING];
+
+/*
+ * Feed current register values with a timestamp of 1000 cycles per sample
+ */
+static void sim_trig_feed (const int16_t *vals, uint32_t n)
+{
+    acq_sample_t s = { .raw = { .power = 100 } };
+    uint32_t i;
+
+    for (i = 0; i < n; ++i) {
+        s.tstamp = (uint64_t)(rail_trig.head + rail_trig.stats.lost) * 1000;
+        s.raw.current = vals[i];
+        trig_sample(&rail_trig, &s);
+    }
+}
+
+static bool sim_trig_fires (uint8_t source, uint8_t type, int32_t lo, int32_t hi, int16_t prev, int16_t val)
+{
+    trig_cond_t cond = { .source = source, .type = type, .lo = lo, .hi = hi };
+    int16_t vals[] = { prev, val };
+    trig_record_t rec;
+
+    trig_init(&rail_trig, trig_ring, SIM_TRIG_RING);
+    sim_trig_feed(vals, 1);
+    trig_arm(&rail_trig, &cond, 1, 0);
+    sim_trig_feed(vals, 2);
+
+    return trig_get(&rail_trig, &rec) && rec.trigger == 2;
+}
+
+static void trig_update (acq_sensor_t *sensor, const acq_sample_t *sample, void *data)
+{
+    trig_sample(data, sample);
+}
+
+static void bench_trig (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | INA219_CFG_BADC(INA219_ADC_AVG2) |
+                      INA219_CFG_SADC(INA219_ADC_AVG2) | INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    trig_cond_t cond = { .source = TRIG_SRC_CURRENT, .type = TRIG_EDGE_RISE, .lo = 100 };
+    sim_wave_t square = {
+        .type = SIM_WAVE_SQUARE,
+        .offset_ua = 100000,
+        .amplitude_ua = 50000,
+        .period_us = 20000,
+    };
+    int16_t vals[SIM_TRIG_RING] = { 0 };
+    acq_sample_t buf[SIM_TRIG_RING];
+    trig_record_t rec, first;
+    trig_stats_t stats;
+    ina219_meas_t meas;
+    uint32_t i, n, pre, records = 0, bad = 0;
+
+    // each condition on the sample it should fire on and not the one before
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_LEVEL_ABOVE, 10, 0, 5, 11) &&
+          !sim_trig_fires(TRIG_SRC_CURRENT, TRIG_LEVEL_ABOVE, 10, 0, 5, 10), "trig level above");
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_LEVEL_BELOW, -10, 0, 0, -11), "trig level below");
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_EDGE_RISE, 10, 0, 10, 11) &&
+          !sim_trig_fires(TRIG_SRC_CURRENT, TRIG_EDGE_RISE, 10, 0, 11, 12), "trig rising edge");
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_EDGE_FALL, 10, 0, 10, 9) &&
+          !sim_trig_fires(TRIG_SRC_CURRENT, TRIG_EDGE_FALL, 10, 0, 9, 8), "trig falling edge");
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_WINDOW_OUT, -10, 10, 0, 11) &&
+          sim_trig_fires(TRIG_SRC_CURRENT, TRIG_WINDOW_OUT, -10, 10, 0, -11) &&
+          !sim_trig_fires(TRIG_SRC_CURRENT, TRIG_WINDOW_OUT, -10, 10, 0, 10), "trig window out");
+    check(sim_trig_fires(TRIG_SRC_CURRENT, TRIG_WINDOW_IN, -10, 10, 20, -10) &&
+          !sim_trig_fires(TRIG_SRC_CURRENT, TRIG_WINDOW_IN, -10, 10, 20, 11), "trig window in");
+    check(sim_trig_fires(TRIG_SRC_POWER, TRIG_LEVEL_BELOW, -50, 0, 1, -1), "trig signed power");
+
+    // back to back spikes, the second right after the first record closes
+    trig_init(&rail_trig, trig_ring, SIM_TRIG_RING);
+    trig_arm(&rail_trig, &cond, 8, 8);
+    vals[20] = vals[21] = 200;
+    vals[29] = 200;
+    sim_trig_feed(vals, 40);
+    check(trig_get(&rail_trig, &first) && first.start == 12 && first.trigger == 20 && first.count == 17 &&
+          first.tstamp == 20 * 1000, "trig record");
+    n = trig_copy(&rail_trig, &first, 0, buf, SIM_TRIG_RING);
+    check(n == 17 && buf[0].tstamp == 12 * 1000 && buf[8].raw.current == 200 && buf[16].tstamp == 28 * 1000,
+          "trig record samples");
+    trig_release(&rail_trig);
+    check(trig_get(&rail_trig, &rec) && rec.trigger == 29 && rec.start == 21, "trig rearms on the next sample");
+    trig_release(&rail_trig);
+    check(!trig_get(&rail_trig, &rec), "trig records released");
+
+    // records not read out pin the ring, samples and triggers that don't fit
+    // are dropped rather than them
+    memset(vals, 0, sizeof(vals));
+    vals[0] = 200;
+    sim_trig_feed(vals, 20);
+    check(trig_get(&rail_trig, &first), "trig pinned record");
+    vals[SIM_TRIG_RING / 2] = 200;
+    sim_trig_feed(vals, SIM_TRIG_RING);
+    trig_get_stats(&rail_trig, &stats);
+    check(stats.triggers == 4 && stats.lost > 0 && stats.missed == 1, "trig pinned ring drops samples and triggers");
+    n = trig_copy(&rail_trig, &first, 0, buf, SIM_TRIG_RING);
+    check(n == first.count && buf[first.trigger - first.start].raw.current == 200 &&
+          buf[0].tstamp == (uint64_t)first.start * 1000, "trig pinned record intact");
+    trig_release(&rail_trig);
+    trig_release(&rail_trig);
+    sim_trig_feed(vals, 1);
+    check(rail_trig.stats.lost == stats.lost, "trig stores again once released");
+
+    // a longer pre armed while a record is queued starts no earlier than it
+    memset(vals, 0, sizeof(vals));
+    trig_init(&rail_trig, trig_ring, SIM_TRIG_RING);
+    trig_arm(&rail_trig, &cond, 2, 2);
+    vals[10] = 200;
+    sim_trig_feed(vals, 16);
+    trig_arm(&rail_trig, &cond, 32, 2);
+    vals[10] = 0;
+    vals[1] = 200;
+    sim_trig_feed(vals, SIM_TRIG_RING);
+    check(trig_get(&rail_trig, &first) && first.start == 8 && first.count == 5, "trig record queued");
+    trig_release(&rail_trig);
+    check(trig_get(&rail_trig, &rec) && rec.start == first.start && rec.trigger == 17,
+          "trig pre clamped to the queued record");
+    n = trig_copy(&rail_trig, &rec, 0, buf, SIM_TRIG_RING);
+    check(n == rec.count && buf[rec.trigger - rec.start].raw.current == 200 &&
+          buf[0].tstamp == (uint64_t)rec.start * 1000, "trig clamped record intact");
+    trig_release(&rail_trig);
+
+    // edges of a square wave load, acquired
+    sim_ina219_set_wave(&ina_models[0], &square);
+    cond.lo = (int64_t)square.offset_ua * 1000000 / rail_devs[0].cal.current_lsb_pa;
+    trig_init(&rail_trig, trig_ring, SIM_TRIG_RING);
+    trig_arm(&rail_trig, &cond, 4, 8);
+
+    acq_init();
+    rail_devs[0].config = config;
+    acq_add(&acq_sensors[0], &rail_devs[0], acq_rings[0], SIM_ACQ_RING);
+    acq_set_sample_fn(&acq_sensors[0], trig_update, &rail_trig);
+    check(acq_start(0), "trig acq start");
+    for (i = 0; i < SIM_TRIG_MS / 10; ++i) {
+        sim_wait_ms(10);
+        while (trig_get(&rail_trig, &rec)) {
+            // an edge before 4 samples are stored has only those before it
+            pre = rec.trigger < 4 ? rec.trigger : 4;
+            n = trig_copy(&rail_trig, &rec, 0, buf, SIM_TRIG_RING);
+            ina219_measure(&rail_devs[0].cal, &buf[pre].raw, &meas);
+            if (rec.trigger - rec.start != pre || rec.count != pre + 9 || n != rec.count ||
+                buf[pre].tstamp != rec.tstamp ||
+                meas.current <= square.offset_ua * 65536LL / 1000)
+                bad++;
+            records++;
+            trig_release(&rail_trig);
+        }
+    }
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+
+    trig_get_stats(&rail_trig, &stats);
+    log("trig square wave: %d records triggers: %d missed: %d lost: %d",
+            records, stats.triggers, stats.missed, stats.lost);
+    check(records >= SIM_TRIG_MS / 20 / 2 && bad == 0, "trig square wave edges");
+    check(stats.missed == 0 && stats.lost == 0, "trig keeps up with reading out");
+
+    sim_ina219_set_wave(&ina_models[0], &(sim_wave_t){ .type = SIM_WAVE_DC, .offset_ua = sim_rails[0].current_ua });
+}
+
+/*
+ * Limits against synthetic samples and an acquired rail past them
+ */
+static list_t sim_limits;
+
+static void sim_limit_feed (int16_t current, uint16_t busv, uint16_t power, uint32_t n)
+{
+    acq_sample_t s = { .raw = { .busv = busv << 3, .current = current, .power = power } };
+
+    while (n--) {
+        s.tstamp = gcnt_get();
+        limit_sample(&sim_limits, &s);
+    }
+}
+
+static bool sim_limit_event (limit_t *limit, bool trip, int32_t val)
+{
+    limit_event_t ev;
+
+    return limit_get_event(&ev) && ev.limit == limit && ev.trip == trip && ev.val == val &&
+           ev.detect_clks < SIM_JITTER_US * GCNT_TICKS_PER_US &&
+           ev.output_clks < SIM_JITTER_US * GCNT_TICKS_PER_US;
+}
+
+static void limit_update (acq_sensor_t *sensor, const acq_sample_t *sample, void *data)
+{
+    limit_sample(data, sample);
+}
+
+static void bench_limit (void)
+{
+    uint16_t config = INA219_CFG_BRNG_32V | INA219_CFG_PG(3) | INA219_CFG_BADC(INA219_ADC_AVG2) |
+                      INA219_CFG_SADC(INA219_ADC_AVG2) | INA219_CFG_MODE(INA219_MODE_SHUNT_BUS_CONT);
+    limit_cfg_t oc_cfg = { .name = "oc", .source = LIMIT_SRC_CURRENT, .latch = true, .trip = 100,
+                           .clear = 80, .debounce = 3, .gpo = SIM_LIMIT_GPO, .mask = 1 << 0 };
+    limit_cfg_t op_cfg = { .name = "op", .source = LIMIT_SRC_POWER, .trip = 1000, .clear = 900,
+                           .release = 2, .gpo = SIM_LIMIT_GPO, .mask = 1 << 0 };
+    limit_cfg_t uv_cfg = { .name = "uv", .source = LIMIT_SRC_BUSV, .under = true, .trip = 1000,
+                           .clear = 1100, .gpo = SIM_LIMIT_GPO, .mask = 1 << 1 };
+    const ina219_cal_t *cal = &rail_devs[1].cal;
+    limit_t oc, op, uv;
+    limit_stats_t oc_stats, uv_stats;
+    limit_event_t ev;
+
+    limit_svc_init();
+    list_init_head(&sim_limits);
+    limit_add(&sim_limits, &oc, &oc_cfg);
+    limit_add(&sim_limits, &op, &op_cfg);
+    limit_add(&sim_limits, &uv, &uv_cfg);
+    sim_gpo[SIM_LIMIT_GPO] = 0;
+
+    // debounce restarts on a sample back within the limit
+    sim_limit_feed(101, 1200, 0, 2);
+    sim_limit_feed(50, 1200, 0, 1);
+    sim_limit_feed(101, 1200, 0, 2);
+    check(!oc.tripped && sim_gpo[SIM_LIMIT_GPO] == 0 && !limit_get_event(&ev), "limit debounce");
+    sim_limit_feed(101, 1200, 0, 1);
+    check(oc.tripped && sim_gpo[SIM_LIMIT_GPO] == (1 << 0) && sim_limit_event(&oc, true, 101), "limit trip");
+    sim_limit_feed(50, 1200, 0, 4);
+    check(oc.tripped && sim_gpo[SIM_LIMIT_GPO] == (1 << 0), "limit latched");
+
+    // a shared output stays set while any limit drives it
+    sim_limit_feed(50, 1200, 1001, 1);
+    check(op.tripped && sim_limit_event(&op, true, 1001), "limit shared output trip");
+    sim_limit_feed(50, 1200, 950, 4);
+    sim_limit_feed(50, 1200, 850, 1);
+    sim_limit_feed(50, 1200, 950, 1);
+    sim_limit_feed(50, 1200, 850, 1);
+    check(op.tripped, "limit hysteresis and release count");
+    sim_limit_feed(50, 1200, 850, 1);
+    check(!op.tripped && sim_limit_event(&op, false, 850) && sim_gpo[SIM_LIMIT_GPO] == (1 << 0),
+          "limit shared output held");
+    limit_clear(&oc);
+    check(!oc.tripped && sim_gpo[SIM_LIMIT_GPO] == 0 && limit_get_event(&ev) && ev.limit == &oc && !ev.trip,
+          "limit clear latched");
+
+    // power takes the sign of the current, bus voltage is past its flags
+    sim_limit_feed(-50, 1200, 2000, 1);
+    check(!op.tripped, "limit signed power");
+    sim_limit_feed(50, 999, 0, 1);
+    check(uv.tripped && sim_gpo[SIM_LIMIT_GPO] == (1 << 1) && sim_limit_event(&uv, true, 999), "limit under");
+    sim_limit_feed(50, 1100, 0, 1);
+    check(uv.tripped, "limit under hysteresis");
+    sim_limit_feed(50, 1101, 0, 1);
+    check(!uv.tripped && sim_gpo[SIM_LIMIT_GPO] == 0 && sim_limit_event(&uv, false, 1101), "limit under clear");
+    check(!limit_get_event(&ev) && limit_events_dropped() == 0, "limit events read out");
+
+    // a rail acquired past its limits, the outputs follow within the sample
+    limit_svc_init();
+    list_init_head(&sim_limits);
+    oc_cfg.trip = (int64_t)sim_rails[1].current_ua * 3 / 4 * 1000000 / cal->current_lsb_pa;
+    oc_cfg.clear = oc_cfg.trip / 2;
+    oc_cfg.debounce = 2;
+    uv_cfg.trip = (sim_rails[1].bus_mv + 500) / 4;
+    uv_cfg.clear = uv_cfg.trip + 100;
+    uv_cfg.debounce = 2;
+    limit_add(&sim_limits, &oc, &oc_cfg);
+    limit_add(&sim_limits, &uv, &uv_cfg);
+    sim_gpo[SIM_LIMIT_GPO] = 0;
+
+    acq_init();
+    rail_devs[1].config = config;
+    acq_add(&acq_sensors[1], &rail_devs[1], acq_rings[1], SIM_ACQ_RING);
+    acq_set_sample_fn(&acq_sensors[1], limit_update, &sim_limits);
+    check(acq_start(0), "limit acq start");
+    sim_wait_ms(SIM_LIMIT_MS);
+    acq_stop();
+    while (twi_busy(NULL))
+        ;
+
+    limit_get_stats(&oc, &oc_stats);
+    limit_get_stats(&uv, &uv_stats);
+    log("limit acquired: trips oc %d uv %d, max detect %d us, max output %d ns",
+            oc_stats.trips, uv_stats.trips,
+            tstamp_cycles_to_us(oc_stats.max_detect_clks > uv_stats.max_detect_clks ?
+                                oc_stats.max_detect_clks : uv_stats.max_detect_clks),
+            (uint32_t)tstamp_cycles_to_ns(oc_stats.max_output_clks > uv_stats.max_output_clks ?
+                                          oc_stats.max_output_clks : uv_stats.max_output_clks));
+    check(oc_stats.trips == 1 && uv_stats.trips == 1 && uv_stats.clears == 0 &&
+          sim_gpo[SIM_LIMIT_GPO] == 3, "limit acquired outputs");
+    check(limit_get_event(&ev) && ev.limit == &oc && ev.trip && ev.val > oc_cfg.trip &&
+          ev.detect_clks > 0, "limit acquired event");
+    check(oc_stats.max_output_clks < SIM_JITTER_US * GCNT_TICKS_PER_US &&
+          uv_stats.max_output_clks < SIM_JITTER_US * GCNT_TICKS_PER_US, "limit output latency");
+}
+
+static void dump_bus_model (const char *name, sim_i2c_bus_t *model)
+{
+    sim_i2c_stats_t bus;
+
+    sim_i2c_get_stats(model, &bus);
+    log("%s model at %d Hz starts: %d stops: %d bytes: %d nacks: %d retunes: %d errors: %d busy: %d us",
+            name, sim_i2c_bus_hz(model), bus.starts, bus.stops, bus.bytes, bus.nacks,
+            bus.retunes, bus.errors, (uint32_t)(bus.busy_clks / GCNT_TICKS_PER_US));
+    log("    resets: %d arbitration lost: %d", bus.resets, bus.arb_lost);
+    check(bus.errors == 0, "i2c protocol errors");
+}
+
+int main (void)
+{
+    uint8_t i;
+
+    sim_init();
+    sim_i2c_init(&sensor_bus_model, OC_I2C_BASE, OC_I2C_IRQ);
+    sim_i2c_init(&lcd_bus_model, SIM_LCD_I2C_BASE, SIM_LCD_I2C_IRQ);
+    for (i = 0; i < SIM_RAILS; ++i) {
+        sim_wave_t dc = { .type = SIM_WAVE_DC, .offset_ua = sim_rails[i].current_ua };
+
+        sim_ina219_init(&ina_models[i], &sensor_bus_model, sim_rails[i].addr, sim_rails[i].shunt_uohm);
+        sim_ina219_set_bus(&ina_models[i], sim_rails[i].bus_mv);
+        sim_ina219_set_wave(&ina_models[i], &dc);
+    }
+    sim_lcd_init(&lcd_model, &lcd_bus_model, LCD_I2C_ADDR);
+    sim_lcd_init(&bulk_model, &sensor_bus_model, SIM_BULK_ADDR);
+
+    XIOModule_Initialize(&xio, XPAR_IOMODULE_0_DEVICE_ID);
+    XIOModule_Timer_Initialize(&xio, XPAR_IOMODULE_0_DEVICE_ID);
+    microblaze_register_handler(XIOModule_DeviceInterruptHandler, XPAR_IOMODULE_0_DEVICE_ID);
+    XIOModule_Start(&xio);
+
+    workq_init();
+    timer_svc_init();
+    hrtimer_svc_init();
+    task_svc_init();
+    pt_sched_init();
+
+    twi_init(&xio);
+    twi_bus_init(&lcd_bus, &xio, "i2c1", SIM_LCD_I2C_BASE, SIM_LCD_I2C_IRQ, LCD_I2C_FREQ);
+
+    microblaze_enable_interrupts();
+
+    bench_timer();
+    bench_ina219();
+    bench_lcd();
+    bench_concurrent();
+    bench_priority();
+    bench_recovery();
+    bench_scan();
+    bench_acq();
+    bench_energy();
+    bench_wstat();
+    bench_filt();
+    bench_trig();
+    bench_limit();
+
+    twi_stats_dump();
+
+    dump_bus_model("i2c0", &sensor_bus_model);
+    dump_bus_model("i2c1", &lcd_bus_model);
+    log("lcd model instrs: %d chars: %d timing violations: %d",
+            lcd_model.instrs, lcd_model.chars, lcd_model.violations);
+    sim_lcd_dump(&lcd_model, LCD_WIDTH, LCD_HEIGHT);
+
+    check(lcd_model.violations == 0, "lcd timing violations");
+
+    log("simulation %s", failed ? "FAILED" : "passed");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
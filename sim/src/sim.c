@@ -0,0 +1,283 @@
+/*
+ * Host simulator core
+ *
+ * Virtual time is the host monotonic clock scaled to the core clock, so
+ * the firmware's busy waits and the peripheral models agree on time. The
+ * simulator is single threaded: a POSIX timer is armed for the next model
+ * event and its signal is the CPU interrupt. The handler runs the events
+ * that are due, then the registered interrupt handler, so masking the
+ * signal is disabling interrupts. Events that come due while interrupts
+ * are masked are run by sim_lock() before any model register access, so
+ * the firmware always sees the models up to date. When an event runs well
+ * past its time the host has descheduled the simulator, the time lost is
+ * taken out of the virtual clock so it doesn't show up as bus latency.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "sim.h"
+#include "xiomodule.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#define SIM_IRQ_SIGNAL      SIGALRM
+#define SIM_STALL_CLKS      (500 * SIM_CLKS_PER_US)
+
+
+volatile uint32_t sim_gpo[5];
+volatile uint32_t sim_gpi[5];
+
+static struct {
+    struct timespec     start;
+    volatile uint64_t   stalled;
+    timer_t             timer;
+    sigset_t            saved;
+    uint8_t             depth;
+    sim_event_t         *events;
+    volatile uint32_t   pending;
+    XInterruptHandler   handler;
+    void                *handler_data;
+    uint32_t            prng;
+} sim;
+
+
+uint64_t sim_cycles (void)
+{
+    struct timespec now;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (uint64_t)(now.tv_sec - sim.start.tv_sec) * 1000000000ULL + now.tv_nsec - sim.start.tv_nsec;
+
+    return ns * SIM_CLKS_PER_US / 1000 - sim.stalled;
+}
+
+uint32_t sim_prng (void)
+{
+    // xorshift32
+    sim.prng ^= sim.prng << 13;
+    sim.prng ^= sim.prng >> 17;
+    sim.prng ^= sim.prng << 5;
+
+    return sim.prng;
+}
+
+/*
+ * Arm the timer for the earliest event
+ */
+static void sim_timer_arm (void)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    uint64_t ns;
+
+    if (sim.events != NULL) {
+        ns = (sim.events->when + sim.stalled) * 1000 / SIM_CLKS_PER_US + sim.start.tv_nsec;
+        its.it_value.tv_sec = sim.start.tv_sec + ns / 1000000000ULL;
+        its.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+
+    timer_settime(sim.timer, TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Run events that are due, with the interrupt signal masked
+ */
+static void sim_run_events (void)
+{
+    sim_event_t *ev;
+    uint64_t now = sim_cycles();
+    bool ran = false;
+
+    // stop the clock for a host stall
+    if (sim.events != NULL && now > sim.events->when + SIM_STALL_CLKS) {
+        sim.stalled += now - sim.events->when;
+        now = sim.events->when;
+    }
+
+    while (sim.events != NULL && sim.events->when <= now) {
+        ev = sim.events;
+        sim.events = ev->next;
+        ev->pending = false;
+        ev->func(ev);
+        ran = true;
+    }
+
+    if (ran)
+        sim_timer_arm();
+}
+
+void sim_lock (void)
+{
+    sigset_t block, saved;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIM_IRQ_SIGNAL);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    if (sim.depth++ == 0)
+        sim.saved = saved;
+
+    sim_run_events();
+}
+
+void sim_unlock (void)
+{
+    if (--sim.depth == 0)
+        sigprocmask(SIG_SETMASK, &sim.saved, NULL);
+}
+
+void sim_event_schedule (sim_event_t *ev, uint64_t when)
+{
+    sim_event_t **iter;
+
+    if (ev->pending)
+        sim_event_cancel(ev);
+
+    ev->when = when;
+    ev->pending = true;
+
+    // keep the event list sorted by time
+    for (iter = &sim.events; *iter != NULL; iter = &(*iter)->next) {
+        if (when < (*iter)->when)
+            break;
+    }
+    ev->next = *iter;
+    *iter = ev;
+
+    if (sim.events == ev)
+        sim_timer_arm();
+}
+
+void sim_event_cancel (sim_event_t *ev)
+{
+    sim_event_t **iter;
+
+    for (iter = &sim.events; *iter != NULL; iter = &(*iter)->next) {
+        if (*iter == ev) {
+            *iter = ev->next;
+            break;
+        }
+    }
+    ev->pending = false;
+}
+
+void sim_irq_raise (uint8_t irq)
+{
+    sim.pending |= 1UL << irq;
+
+    // delivered once interrupts are unmasked
+    raise(SIM_IRQ_SIGNAL);
+}
+
+uint32_t sim_irq_take (uint32_t mask)
+{
+    uint32_t taken;
+    sigset_t block, saved;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIM_IRQ_SIGNAL);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+    taken = sim.pending & mask;
+    sim.pending &= ~taken;
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    return taken;
+}
+
+void sim_irq_kick (void)
+{
+    if (sim.pending)
+        raise(SIM_IRQ_SIGNAL);
+}
+
+/*
+ * CPU interrupt entry, runs with the signal masked like the MicroBlaze runs
+ * its handler with MSR[IE] clear
+ */
+static void sim_cpu_irq (int sig)
+{
+    sim.depth++;
+    sim_run_events();
+    sim.depth--;
+
+    if (sim.handler != NULL && sim.pending)
+        sim.handler(sim.handler_data);
+}
+
+void sim_init (void)
+{
+    struct sigevent sev;
+    struct sigaction sa;
+    sigset_t block;
+
+    clock_gettime(CLOCK_MONOTONIC, &sim.start);
+    sim.prng = 0x2545f491;
+
+    // the CPU comes out of reset with interrupts disabled
+    sigemptyset(&block);
+    sigaddset(&block, SIM_IRQ_SIGNAL);
+    sigprocmask(SIG_BLOCK, &block, NULL);
+
+    sa.sa_handler = sim_cpu_irq;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIM_IRQ_SIGNAL, &sa, NULL);
+
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIM_IRQ_SIGNAL;
+    sev.sigev_value.sival_ptr = NULL;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &sim.timer) != 0) {
+        perror("sim: timer_create");
+        exit(1);
+    }
+}
+
+/*
+ * MicroBlaze interrupt control
+ */
+u32 mfmsr (void)
+{
+    sigset_t cur;
+
+    sigprocmask(SIG_BLOCK, NULL, &cur);
+
+    return sigismember(&cur, SIM_IRQ_SIGNAL) ? 0 : MICROBLAZE_MSR_IE;
+}
+
+void mtmsr (u32 msr)
+{
+    if (msr & MICROBLAZE_MSR_IE)
+        microblaze_enable_interrupts();
+    else
+        microblaze_disable_interrupts();
+}
+
+void microblaze_enable_interrupts (void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIM_IRQ_SIGNAL);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+void microblaze_disable_interrupts (void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIM_IRQ_SIGNAL);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+void microblaze_register_handler (XInterruptHandler handler, void *data)
+{
+    sim.handler_data = data;
+    sim.handler = handler;
+}
@@ -0,0 +1,306 @@
+/*
+ * OpenCores I2C master core model
+ *
+ * Commands written to CR take the time they would on the bus: one SCL
+ * period of 5 * (prescale + 1) core clocks per bit, nine for a byte plus
+ * the ACK, and one each for a START or STOP. On completion TIP clears and
+ * IF sets, raising the interrupt if IEN is set, as the core does. Each
+ * core instance is its own bus with its own slaves. Faults can be injected
+ * on a bus to exercise the driver's timeout and recovery paths.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "sim.h"
+#include "xiomodule.h"
+#include "oc_i2c_master.h"
+
+#include <stddef.h>
+#include <string.h>
+
+
+static sim_i2c_bus_t *buses;
+
+
+static uint32_t sim_i2c_bit_clks (sim_i2c_bus_t *bus)
+{
+    return 5 * ((uint32_t)bus->prer + 1);
+}
+
+static sim_i2c_bus_t *sim_i2c_find (uintptr_t base)
+{
+    sim_i2c_bus_t *bus;
+
+    for (bus = buses; bus != NULL; bus = bus->next) {
+        if (bus->base == base)
+            return bus;
+    }
+
+    return NULL;
+}
+
+/*
+ * Finish a command with the interrupt
+ */
+static void sim_i2c_finish (sim_i2c_bus_t *bus, uint64_t when)
+{
+    bus->stats.busy_clks += when - bus->cmd_start;
+    bus->cmd = 0;
+    bus->sr &= ~OC_I2C_TIP;
+
+    if (bus->sr & OC_I2C_IF)
+        bus->stats.errors++; // previous interrupt never acknowledged
+    bus->sr |= OC_I2C_IF;
+
+    if (bus->ctr & OC_I2C_IEN)
+        sim_irq_raise(bus->irq);
+}
+
+/*
+ * Complete the command in progress, runs as a hardware event
+ */
+static void sim_i2c_done (sim_event_t *ev)
+{
+    sim_i2c_bus_t *bus = (sim_i2c_bus_t *)ev;
+    sim_i2c_slave_t *slave;
+    bool ack;
+
+    if (bus->fault == SIM_I2C_FAULT_SDA_LOW) {
+        if ((bus->cmd & OC_I2C_RD) && (bus->cmd & OC_I2C_ACK)) {
+            bus->fault = SIM_I2C_FAULT_NONE; // slave clocked out
+        } else if (bus->cmd & (OC_I2C_STA | OC_I2C_STO)) {
+            bus->stats.arb_lost++;
+            bus->sr |= OC_I2C_AL;
+            bus->sr &= ~OC_I2C_BUSY;
+            bus->active = NULL;
+            sim_i2c_finish(bus, ev->when);
+            return;
+        }
+    }
+
+    if (bus->cmd & OC_I2C_STA) {
+        bus->stats.starts++;
+        bus->active = NULL;
+        bus->addr_phase = true;
+    }
+
+    if (bus->cmd & OC_I2C_WR) {
+        bus->stats.bytes++;
+        if (bus->addr_phase) {
+            bus->addr_phase = false;
+            bus->reading = bus->txr & 1;
+            for (slave = bus->slaves; slave != NULL; slave = slave->next) {
+                if (slave->addr == (bus->txr >> 1))
+                    break;
+            }
+            ack = slave != NULL && slave->start(slave, bus->reading);
+            bus->active = ack ? slave : NULL;
+        } else {
+            ack = bus->active != NULL && !bus->reading && bus->active->write(bus->active, bus->txr);
+        }
+
+        if (ack) {
+            bus->sr &= ~OC_I2C_RXACK;
+        } else {
+            bus->sr |= OC_I2C_RXACK;
+            bus->stats.nacks++;
+        }
+    } else if (bus->cmd & OC_I2C_RD) {
+        bus->stats.bytes++;
+        if (bus->active != NULL && bus->reading)
+            bus->rxr = bus->active->read(bus->active);
+        else
+            bus->rxr = 0xff; // bus pulled up
+    }
+
+    if (bus->cmd & OC_I2C_STO) {
+        bus->stats.stops++;
+        if (bus->active != NULL)
+            bus->active->stop(bus->active);
+        bus->active = NULL;
+        bus->sr &= ~OC_I2C_BUSY;
+    }
+
+    sim_i2c_finish(bus, ev->when);
+}
+
+/*
+ * Start a command written to CR
+ */
+static void sim_i2c_command (sim_i2c_bus_t *bus, uint8_t cmd)
+{
+    uint32_t bits = 0;
+
+    if (cmd & OC_I2C_IACK)
+        bus->sr &= ~OC_I2C_IF;
+
+    cmd &= OC_I2C_STA | OC_I2C_STO | OC_I2C_RD | OC_I2C_WR | OC_I2C_ACK;
+    if (!(cmd & (OC_I2C_STA | OC_I2C_STO | OC_I2C_RD | OC_I2C_WR)))
+        return;
+
+    if (!(bus->ctr & OC_I2C_EN))
+        return;
+
+    if (bus->sr & OC_I2C_TIP) {
+        bus->stats.errors++; // command overwritten while in progress
+        return;
+    }
+
+    if (cmd & OC_I2C_STA) {
+        bits += 1;
+        bus->sr |= OC_I2C_BUSY;
+        bus->sr &= ~OC_I2C_AL;
+    }
+    if (cmd & (OC_I2C_RD | OC_I2C_WR))
+        bits += 9;
+    if (cmd & OC_I2C_STO)
+        bits += 1;
+
+    bus->cmd = cmd;
+    bus->cmd_start = sim_cycles();
+    bus->sr |= OC_I2C_TIP;
+
+    // a stretched clock never finishes the command
+    if (bus->fault != SIM_I2C_FAULT_SCL_LOW)
+        sim_event_schedule(&bus->ev, bus->cmd_start + bits * sim_i2c_bit_clks(bus));
+}
+
+/*
+ * Disabling the core drops the command in progress and frees the bus
+ */
+static void sim_i2c_control (sim_i2c_bus_t *bus, uint8_t ctr)
+{
+    if ((bus->ctr & OC_I2C_EN) && !(ctr & OC_I2C_EN) &&
+        (bus->sr & (OC_I2C_TIP | OC_I2C_BUSY))) {
+        bus->stats.resets++;
+        if (bus->sr & OC_I2C_TIP) {
+            sim_event_cancel(&bus->ev);
+            bus->stats.busy_clks += sim_cycles() - bus->cmd_start;
+            bus->cmd = 0;
+        }
+        bus->sr &= ~(OC_I2C_TIP | OC_I2C_BUSY);
+        bus->active = NULL;
+        bus->addr_phase = false;
+    }
+
+    bus->ctr = ctr;
+}
+
+/*
+ * Prescaler writes are only allowed with the core disabled
+ */
+static void sim_i2c_prescale (sim_i2c_bus_t *bus, uint16_t prer)
+{
+    if (bus->ctr & OC_I2C_EN)
+        bus->stats.errors++;
+    if (prer != bus->prer)
+        bus->stats.retunes++;
+
+    bus->prer = prer;
+}
+
+uint8_t oc_i2c_sim_read (uintptr_t base, uint8_t reg)
+{
+    sim_i2c_bus_t *bus;
+    uint8_t val = 0xff; // nothing decodes the address
+
+    sim_lock();
+    bus = sim_i2c_find(base);
+    if (bus == NULL) {
+        sim_unlock();
+        return val;
+    }
+
+    switch (reg) {
+        case OC_I2C_PRER_LO:
+            val = bus->prer & 0xff;
+            break;
+        case OC_I2C_PRER_HI:
+            val = bus->prer >> 8;
+            break;
+        case OC_I2C_CTR:
+            val = bus->ctr;
+            break;
+        case OC_I2C_RXR:
+            val = bus->rxr;
+            break;
+        case OC_I2C_SR:
+            val = bus->sr;
+            break;
+    }
+    sim_unlock();
+
+    return val;
+}
+
+void oc_i2c_sim_write (uintptr_t base, uint8_t reg, uint8_t val)
+{
+    sim_i2c_bus_t *bus;
+
+    sim_lock();
+    bus = sim_i2c_find(base);
+    if (bus == NULL) {
+        sim_unlock();
+        return;
+    }
+
+    switch (reg) {
+        case OC_I2C_PRER_LO:
+            sim_i2c_prescale(bus, (bus->prer & 0xff00) | val);
+            break;
+        case OC_I2C_PRER_HI:
+            sim_i2c_prescale(bus, (bus->prer & 0x00ff) | (val << 8));
+            break;
+        case OC_I2C_CTR:
+            sim_i2c_control(bus, val);
+            break;
+        case OC_I2C_TXR:
+            bus->txr = val;
+            break;
+        case OC_I2C_CR:
+            sim_i2c_command(bus, val);
+            break;
+    }
+    sim_unlock();
+}
+
+void sim_i2c_init (sim_i2c_bus_t *bus, uintptr_t base, uint8_t irq)
+{
+    memset(bus, 0, sizeof(*bus));
+    bus->ev.func = sim_i2c_done;
+    bus->base = base;
+    bus->irq = irq;
+    bus->prer = 0xffff;
+
+    sim_lock();
+    bus->next = buses;
+    buses = bus;
+    sim_unlock();
+}
+
+void sim_i2c_attach (sim_i2c_bus_t *bus, sim_i2c_slave_t *slave)
+{
+    sim_lock();
+    slave->next = bus->slaves;
+    bus->slaves = slave;
+    sim_unlock();
+}
+
+void sim_i2c_get_stats (sim_i2c_bus_t *bus, sim_i2c_stats_t *stats)
+{
+    sim_lock();
+    *stats = bus->stats;
+    sim_unlock();
+}
+
+uint32_t sim_i2c_bus_hz (sim_i2c_bus_t *bus)
+{
+    return SIM_CLK_HZ / sim_i2c_bit_clks(bus);
+}
+
+void sim_i2c_fault (sim_i2c_bus_t *bus, uint8_t fault)
+{
+    sim_lock();
+    bus->fault = fault;
+    sim_unlock();
+}
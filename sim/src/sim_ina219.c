@@ -0,0 +1,295 @@
+/*
+ * INA219 current/power monitor model
+ *
+ * Register layout, conversion times and the current/power calculations
+ * follow the TI datasheet (SBOS448). Conversion results are latched when
+ * a data register is read, taken from the last conversion that completed,
+ * and averaging is modelled by sampling the waveform across the
+ * conversion window.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "sim.h"
+
+#include <math.h>
+#include <string.h>
+
+
+#define INA_REG_CONFIG      0
+#define INA_REG_SHUNTV      1
+#define INA_REG_BUSV        2
+#define INA_REG_POWER       3
+#define INA_REG_CURRENT     4
+#define INA_REG_CALIB       5
+
+#define INA_CONFIG_RST      (1 << 15)
+#define INA_CONFIG_BRNG     (1 << 13)
+#define INA_CONFIG_DEFAULT  0x399f
+
+#define INA_BUSV_CNVR       (1 << 1)
+#define INA_BUSV_OVF        (1 << 0)
+
+#define INA_MODE_SHUNT      1
+#define INA_MODE_BUS        2
+#define INA_MODE_CONT       4
+
+#define SIM_PI              3.14159265358979323846
+
+
+/*
+ * Conversion time in us and samples averaged for each ADC setting
+ */
+static const struct {
+    uint32_t    us;
+    uint8_t     samples;
+} adc_setting[16] = {
+    {    84,   1 }, {   148,   1 }, {   276,   1 }, {   532,   1 },
+    {    84,   1 }, {   148,   1 }, {   276,   1 }, {   532,   1 },
+    {   532,   1 }, {  1060,   2 }, {  2130,   4 }, {  4260,   8 },
+    {  8510,  16 }, { 17020,  32 }, { 34050,  64 }, { 68100, 128 },
+};
+
+
+int32_t sim_ina219_current (sim_ina219_t *dev, uint64_t cycles)
+{
+    sim_wave_t *w = &dev->wave;
+    double phase;
+
+    if (w->type == SIM_WAVE_DC || w->period_us == 0)
+        return w->offset_ua;
+
+    phase = fmod((double)cycles / SIM_CLKS_PER_US, w->period_us) / w->period_us;
+
+    switch (w->type) {
+        case SIM_WAVE_SINE:
+            return w->offset_ua + (int32_t)(w->amplitude_ua * sin(2 * SIM_PI * phase));
+        case SIM_WAVE_SQUARE:
+            return w->offset_ua + (phase < 0.5 ? w->amplitude_ua : -w->amplitude_ua);
+        case SIM_WAVE_TRIANGLE:
+            return w->offset_ua + (int32_t)(w->amplitude_ua * (phase < 0.5 ? 4 * phase - 1 : 3 - 4 * phase));
+    }
+
+    return w->offset_ua;
+}
+
+static uint8_t sim_ina219_mode (sim_ina219_t *dev)
+{
+    return dev->reg[INA_REG_CONFIG] & 0x7;
+}
+
+/*
+ * Time in cycles for one conversion cycle in the current mode
+ */
+static uint64_t sim_ina219_conv_clks (sim_ina219_t *dev)
+{
+    uint16_t config = dev->reg[INA_REG_CONFIG];
+    uint8_t mode = sim_ina219_mode(dev);
+    uint64_t us = 0;
+
+    if (mode & INA_MODE_SHUNT)
+        us += adc_setting[(config >> 3) & 0xf].us;
+    if (mode & INA_MODE_BUS)
+        us += adc_setting[(config >> 7) & 0xf].us;
+
+    return us * SIM_CLKS_PER_US;
+}
+
+/*
+ * Compute the result registers for a conversion finishing at a time
+ */
+static void sim_ina219_convert (sim_ina219_t *dev, uint64_t end)
+{
+    uint16_t config = dev->reg[INA_REG_CONFIG];
+    uint8_t mode = sim_ina219_mode(dev);
+    uint8_t samples = adc_setting[(config >> 3) & 0xf].samples;
+    uint64_t window = sim_ina219_conv_clks(dev);
+    int32_t range = 4000 << ((config >> 11) & 0x3); // 40 mV per gain step in 10 uV LSBs
+    uint32_t bus_max = (config & INA_CONFIG_BRNG) ? 32000 : 16000;
+    int64_t sum = 0, current;
+    int32_t shunt;
+    uint32_t bus, power;
+    uint8_t i;
+    bool ovf = false;
+
+    if (mode & INA_MODE_SHUNT) {
+        for (i = 0; i < samples; ++i)
+            sum += sim_ina219_current(dev, end - window + (window * (i + 1)) / samples);
+        shunt = (int32_t)((sum / samples) * (int64_t)dev->shunt_uohm / 10000000);
+        if (shunt > range) {
+            shunt = range;
+            ovf = true;
+        } else if (shunt < -range) {
+            shunt = -range;
+            ovf = true;
+        }
+        dev->reg[INA_REG_SHUNTV] = (uint16_t)(int16_t)shunt;
+    }
+
+    if (mode & INA_MODE_BUS) {
+        bus = dev->bus_mv > bus_max ? bus_max : dev->bus_mv;
+        dev->reg[INA_REG_BUSV] = (uint16_t)((bus / 4) << 3);
+    }
+
+    // current and power are only calculated once calibrated
+    if (dev->reg[INA_REG_CALIB] != 0) {
+        current = (int64_t)(int16_t)dev->reg[INA_REG_SHUNTV] * dev->reg[INA_REG_CALIB] / 4096;
+        if (current > INT16_MAX || current < INT16_MIN) {
+            current = current > 0 ? INT16_MAX : INT16_MIN;
+            ovf = true;
+        }
+        power = (uint32_t)((current < 0 ? -current : current) * (dev->reg[INA_REG_BUSV] >> 3) / 5000);
+        if (power > UINT16_MAX) {
+            power = UINT16_MAX;
+            ovf = true;
+        }
+        dev->reg[INA_REG_CURRENT] = (uint16_t)(int16_t)current;
+        dev->reg[INA_REG_POWER] = (uint16_t)power;
+    }
+
+    dev->reg[INA_REG_BUSV] |= INA_BUSV_CNVR;
+    if (ovf)
+        dev->reg[INA_REG_BUSV] |= INA_BUSV_OVF;
+    else
+        dev->reg[INA_REG_BUSV] &= ~INA_BUSV_OVF;
+}
+
+/*
+ * Bring the result registers up to date with conversions finished by now
+ */
+static void sim_ina219_update (sim_ina219_t *dev)
+{
+    uint64_t now = sim_cycles();
+    uint64_t period = sim_ina219_conv_clks(dev);
+    uint64_t n;
+
+    if (dev->conv_done == 0 || now < dev->conv_done || period == 0)
+        return;
+
+    if (sim_ina219_mode(dev) & INA_MODE_CONT) {
+        // latest of the back to back conversions that has finished
+        n = (now - dev->conv_done) / period;
+        dev->conversions += n + 1;
+        dev->conv_done += n * period;
+        sim_ina219_convert(dev, dev->conv_done);
+        dev->conv_done += period;
+    } else {
+        dev->conversions++;
+        sim_ina219_convert(dev, dev->conv_done);
+        dev->conv_done = 0;
+    }
+}
+
+static void sim_ina219_reset (sim_ina219_t *dev)
+{
+    memset(dev->reg, 0, sizeof(dev->reg));
+    dev->reg[INA_REG_CONFIG] = INA_CONFIG_DEFAULT;
+    dev->conv_start = sim_cycles();
+    dev->conv_done = dev->conv_start + sim_ina219_conv_clks(dev);
+}
+
+static void sim_ina219_write_reg (sim_ina219_t *dev, uint8_t reg, uint16_t val)
+{
+    switch (reg) {
+        case INA_REG_CONFIG:
+            if (val & INA_CONFIG_RST) {
+                sim_ina219_reset(dev);
+                break;
+            }
+            dev->reg[INA_REG_CONFIG] = val;
+            dev->reg[INA_REG_BUSV] &= ~INA_BUSV_CNVR;
+
+            // a config write starts a new conversion in any active mode
+            dev->conv_start = sim_cycles();
+            if (sim_ina219_mode(dev) & (INA_MODE_SHUNT | INA_MODE_BUS))
+                dev->conv_done = dev->conv_start + sim_ina219_conv_clks(dev);
+            else
+                dev->conv_done = 0;
+            break;
+        case INA_REG_CALIB:
+            dev->reg[INA_REG_CALIB] = val & 0xfffe; // bit 0 is always zero
+            break;
+        default:
+            break; // result registers are read only
+    }
+}
+
+static bool sim_ina219_start (sim_i2c_slave_t *slave, bool read)
+{
+    sim_ina219_t *dev = (sim_ina219_t *)slave;
+
+    dev->count = 0;
+    if (read)
+        sim_ina219_update(dev);
+
+    return true;
+}
+
+static bool sim_ina219_write (sim_i2c_slave_t *slave, uint8_t data)
+{
+    sim_ina219_t *dev = (sim_ina219_t *)slave;
+
+    switch (dev->count++) {
+        case 0:
+            dev->ptr = data;
+            return data <= INA_REG_CALIB;
+        case 1:
+            dev->wr_val = data << 8;
+            return true;
+        case 2:
+            dev->wr_val |= data;
+            sim_ina219_write_reg(dev, dev->ptr, dev->wr_val);
+            return true;
+    }
+
+    return false;
+}
+
+static uint8_t sim_ina219_read (sim_i2c_slave_t *slave)
+{
+    sim_ina219_t *dev = (sim_ina219_t *)slave;
+    uint16_t val = dev->reg[dev->ptr];
+
+    // reading the power register clears the conversion ready flag
+    if (dev->ptr == INA_REG_POWER && dev->count == 1)
+        dev->reg[INA_REG_BUSV] &= ~INA_BUSV_CNVR;
+
+    return (dev->count++ & 1) ? val & 0xff : val >> 8;
+}
+
+static void sim_ina219_stop (sim_i2c_slave_t *slave)
+{
+}
+
+void sim_ina219_init (sim_ina219_t *dev, sim_i2c_bus_t *bus, uint8_t addr, uint32_t shunt_uohm)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->slave.addr = addr;
+    dev->slave.start = sim_ina219_start;
+    dev->slave.write = sim_ina219_write;
+    dev->slave.read = sim_ina219_read;
+    dev->slave.stop = sim_ina219_stop;
+    dev->shunt_uohm = shunt_uohm;
+    dev->bus_mv = 5000;
+    dev->wave.type = SIM_WAVE_DC;
+
+    sim_lock();
+    sim_ina219_reset(dev);
+    sim_unlock();
+
+    sim_i2c_attach(bus, &dev->slave);
+}
+
+void sim_ina219_set_bus (sim_ina219_t *dev, uint32_t bus_mv)
+{
+    sim_lock();
+    dev->bus_mv = bus_mv;
+    sim_unlock();
+}
+
+void sim_ina219_set_wave (sim_ina219_t *dev, const sim_wave_t *wave)
+{
+    sim_lock();
+    dev->wave = *wave;
+    sim_unlock();
+}
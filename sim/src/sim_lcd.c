@@ -0,0 +1,147 @@
+/*
+ * PCF8574 I2C backpack and HD44780 LCD model
+ *
+ * Each byte written to the PCF8574 sets its eight output pins, wired to
+ * the LCD as in lcd.h. The HD44780 latches D4-D7 and RS on the falling
+ * edge of EN. It powers up in 8-bit mode, where every latch is a whole
+ * instruction with the low data lines reading zero, until a function set
+ * selects the 4-bit interface. Execution times are from the HD44780U
+ * datasheet at 270 kHz.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define PIN_RS              (1 << 0)
+#define PIN_EN              (1 << 2)
+
+#define LCD_EXEC_US         37
+#define LCD_EXEC_DATA_US    41
+#define LCD_EXEC_HOME_US    1520
+
+
+static void sim_lcd_exec (sim_lcd_t *lcd, uint8_t value, bool data)
+{
+    uint64_t now = sim_cycles();
+    uint32_t exec_us = LCD_EXEC_US;
+
+    if (now < lcd->busy_until)
+        lcd->violations++;
+
+    if (data) {
+        if (lcd->cgram)
+            lcd->cgram_data[lcd->ac & 0x3f] = value;
+        else
+            lcd->ddram[lcd->ac & 0x7f] = value;
+        lcd->ac += lcd->increment ? 1 : -1;
+        lcd->chars++;
+        exec_us = LCD_EXEC_DATA_US;
+    } else if (value & 0x80) { // set DDRAM address
+        lcd->ac = value & 0x7f;
+        lcd->cgram = false;
+    } else if (value & 0x40) { // set CGRAM address
+        lcd->ac = value & 0x3f;
+        lcd->cgram = true;
+    } else if (value & 0x20) { // function set
+        lcd->four_bit = !(value & 0x10);
+    } else if (value & 0x10) { // cursor or display shift
+        if (!(value & 0x08))
+            lcd->ac += (value & 0x04) ? 1 : -1;
+    } else if (value & 0x08) { // display control
+        lcd->display = value & 0x07;
+    } else if (value & 0x04) { // entry mode set
+        lcd->increment = value & 0x02;
+    } else if (value & 0x02) { // return home
+        lcd->ac = 0;
+        lcd->cgram = false;
+        exec_us = LCD_EXEC_HOME_US;
+    } else if (value & 0x01) { // clear display
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->ac = 0;
+        lcd->cgram = false;
+        lcd->increment = true;
+        exec_us = LCD_EXEC_HOME_US;
+    }
+
+    if (!data)
+        lcd->instrs++;
+    lcd->busy_until = now + exec_us * SIM_CLKS_PER_US;
+}
+
+static bool sim_lcd_start (sim_i2c_slave_t *slave, bool read)
+{
+    return true;
+}
+
+static bool sim_lcd_write (sim_i2c_slave_t *slave, uint8_t pins)
+{
+    sim_lcd_t *lcd = (sim_lcd_t *)slave;
+    uint8_t nibble = pins >> 4;
+    bool data = pins & PIN_RS;
+
+    // latch on falling edge of EN
+    if ((lcd->pins & PIN_EN) && !(pins & PIN_EN)) {
+        if (!lcd->four_bit) {
+            sim_lcd_exec(lcd, nibble << 4, data);
+            lcd->high_nibble = true;
+        } else if (lcd->high_nibble) {
+            lcd->nibble = nibble;
+            lcd->high_nibble = false;
+        } else {
+            sim_lcd_exec(lcd, (lcd->nibble << 4) | nibble, data);
+            lcd->high_nibble = true;
+        }
+    }
+
+    lcd->pins = pins;
+
+    return true;
+}
+
+static uint8_t sim_lcd_read (sim_i2c_slave_t *slave)
+{
+    sim_lcd_t *lcd = (sim_lcd_t *)slave;
+
+    return lcd->pins;
+}
+
+static void sim_lcd_stop (sim_i2c_slave_t *slave)
+{
+}
+
+void sim_lcd_init (sim_lcd_t *lcd, sim_i2c_bus_t *bus, uint8_t addr)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+    lcd->slave.addr = addr;
+    lcd->slave.start = sim_lcd_start;
+    lcd->slave.write = sim_lcd_write;
+    lcd->slave.read = sim_lcd_read;
+    lcd->slave.stop = sim_lcd_stop;
+    lcd->high_nibble = true;
+    lcd->increment = true;
+
+    sim_i2c_attach(bus, &lcd->slave);
+}
+
+void sim_lcd_dump (sim_lcd_t *lcd, uint8_t width, uint8_t height)
+{
+    static const uint8_t line_offset[4] = { 0x00, 0x40, 0x14, 0x54 };
+    uint8_t ln, ch, c;
+
+    sim_lock();
+    for (ln = 0; ln < height && ln < 4; ++ln) {
+        printf("    |");
+        for (ch = 0; ch < width; ++ch) {
+            c = lcd->ddram[(line_offset[ln] + ch) & 0x7f];
+            putchar(c >= 0x20 && c < 0x7f ? c : '?');
+        }
+        printf("|\n");
+    }
+    sim_unlock();
+}
@@ -0,0 +1,216 @@
+/*
+ * Host simulator IO module driver
+ *
+ * Implements the BSP interrupt controller, PIT and FIT calls on top of the
+ * simulator core. FIT1 fires every XPAR_IOMODULE_0_FIT1_NO_CLOCKS clocks
+ * and each PIT counts its prescaler source as configured in system.xml,
+ * core clocks or FIT1 pulses. A PIT on FIT1 takes its first count on the
+ * next pulse, as the hardware does. Other sources are counted as core
+ * clocks.
+ *
+ * Copyright (c) 2022 Matt Liss
+ * BSD-3-Clause
+ */
+#include "sim.h"
+#include "mbsoc.h"
+#include "xiomodule.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+
+typedef struct sim_pit {
+    sim_event_t     ev; // must be first entry
+    uint8_t         irq;
+    uint8_t         prescaler;
+    u32             reset;
+    u32             options;
+    bool            running;
+} sim_pit_t;
+
+static const uint8_t sim_pit_prescaler[XIN_IOMODULE_TIMERS] = {
+    XPAR_IOMODULE_0_PIT1_PRESCALER,
+    XPAR_IOMODULE_0_PIT2_PRESCALER,
+    XPAR_IOMODULE_0_PIT3_PRESCALER,
+    XPAR_IOMODULE_0_PIT4_PRESCALER,
+};
+
+static struct {
+    XInterruptHandler   handler[XIN_IOMODULE_INTERRUPTS];
+    void                *data[XIN_IOMODULE_INTERRUPTS];
+    volatile uint32_t   enabled;
+    sim_pit_t           pit[XIN_IOMODULE_TIMERS];
+    sim_event_t         fit;
+} iomod;
+
+
+static void sim_fit_expire (sim_event_t *ev)
+{
+    sim_irq_raise(XIN_IOMODULE_FIT_1_INTERRUPT_INTR);
+    sim_event_schedule(ev, ev->when + XPAR_IOMODULE_0_FIT1_NO_CLOCKS);
+}
+
+/**
+ * Clocks per count of a PIT
+ */
+static uint32_t sim_pit_clks (sim_pit_t *pit)
+{
+    return pit->prescaler == PIT_PRESCALER_FIT1 ? XPAR_IOMODULE_0_FIT1_NO_CLOCKS : 1;
+}
+
+/**
+ * Expiry of a PIT started now with its reset value
+ *
+ * *MUST* be called with the simulator locked
+ */
+static uint64_t sim_pit_expiry (sim_pit_t *pit, uint64_t now)
+{
+    u32 counts = pit->reset ? pit->reset : 1;
+    uint64_t first = now + 1;
+
+    if (pit->prescaler == PIT_PRESCALER_FIT1 && iomod.fit.when > now)
+        first = iomod.fit.when;
+
+    return first + (uint64_t)(counts - 1) * sim_pit_clks(pit);
+}
+
+static void sim_pit_expire (sim_event_t *ev)
+{
+    sim_pit_t *pit = (sim_pit_t *)ev;
+
+    sim_irq_raise(pit->irq);
+
+    if (pit->options & XTC_AUTO_RELOAD_OPTION)
+        sim_event_schedule(ev, ev->when + (uint64_t)(pit->reset ? pit->reset : 1) * sim_pit_clks(pit));
+    else
+        pit->running = false;
+}
+
+int XIOModule_Initialize (XIOModule *inst, u16 id)
+{
+    uint8_t i;
+
+    inst->DeviceId = id;
+    inst->IsReady = 1;
+    inst->IsStarted = 0;
+
+    sim_lock();
+    for (i = 0; i < XIN_IOMODULE_TIMERS; ++i) {
+        iomod.pit[i].ev.func = sim_pit_expire;
+        iomod.pit[i].irq = XIN_IOMODULE_PIT_1_INTERRUPT_INTR + i;
+        iomod.pit[i].prescaler = sim_pit_prescaler[i];
+    }
+    iomod.fit.func = sim_fit_expire;
+    sim_event_schedule(&iomod.fit, sim_cycles() + XPAR_IOMODULE_0_FIT1_NO_CLOCKS);
+    sim_unlock();
+
+    return XST_SUCCESS;
+}
+
+int XIOModule_Start (XIOModule *inst)
+{
+    inst->IsStarted = 1;
+    return XST_SUCCESS;
+}
+
+int XIOModule_Connect (XIOModule *inst, u8 id, XInterruptHandler handler, void *data)
+{
+    iomod.data[id] = data;
+    iomod.handler[id] = handler;
+    return XST_SUCCESS;
+}
+
+void XIOModule_Disconnect (XIOModule *inst, u8 id)
+{
+    XIOModule_Disable(inst, id);
+    iomod.handler[id] = NULL;
+}
+
+void XIOModule_Enable (XIOModule *inst, u8 id)
+{
+    __atomic_fetch_or(&iomod.enabled, 1UL << id, __ATOMIC_SEQ_CST);
+    sim_irq_kick();
+}
+
+void XIOModule_Disable (XIOModule *inst, u8 id)
+{
+    __atomic_fetch_and(&iomod.enabled, ~(1UL << id), __ATOMIC_SEQ_CST);
+}
+
+void XIOModule_DeviceInterruptHandler (void *data)
+{
+    uint32_t pending;
+    uint8_t id;
+
+    while ((pending = sim_irq_take(iomod.enabled)) != 0) {
+        for (id = 0; id < XIN_IOMODULE_INTERRUPTS; ++id) {
+            if ((pending & (1UL << id)) && iomod.handler[id] != NULL)
+                iomod.handler[id](iomod.data[id]);
+        }
+    }
+}
+
+int XIOModule_Timer_Initialize (XIOModule *inst, u16 id)
+{
+    return XST_SUCCESS;
+}
+
+void XIOModule_Timer_Start (XIOModule *inst, u8 timer)
+{
+    sim_pit_t *pit = &iomod.pit[timer];
+
+    sim_lock();
+    pit->running = true;
+    sim_event_schedule(&pit->ev, sim_pit_expiry(pit, sim_cycles()));
+    sim_unlock();
+}
+
+void XIOModule_Timer_Stop (XIOModule *inst, u8 timer)
+{
+    sim_pit_t *pit = &iomod.pit[timer];
+
+    sim_lock();
+    pit->running = false;
+    sim_event_cancel(&pit->ev);
+    sim_unlock();
+}
+
+u32 XIOModule_GetValue (XIOModule *inst, u8 timer)
+{
+    sim_pit_t *pit = &iomod.pit[timer];
+    uint64_t now;
+    u32 value = 0;
+
+    sim_lock();
+    now = sim_cycles();
+    if (pit->running && pit->ev.pending && pit->ev.when > now)
+        value = (u32)((pit->ev.when - now + sim_pit_clks(pit) - 1) / sim_pit_clks(pit));
+    sim_unlock();
+
+    return value;
+}
+
+void XIOModule_SetResetValue (XIOModule *inst, u8 timer, u32 value)
+{
+    iomod.pit[timer].reset = value;
+}
+
+void XIOModule_SetOptions (XIOModule *inst, u8 timer, u32 options)
+{
+    iomod.pit[timer].options = options;
+}
+
+int XIOModule_SetBaudRate (XIOModule *inst, u32 baud)
+{
+    return XST_SUCCESS;
+}
+
+void xil_printf (const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
@@ -5,18 +5,69 @@
  * BSD-3-Clause
  */
 #include "mbsoc.h"
+#include "acq.h"
+#include "energy.h"
+#include "filt.h"
+#include "prof.h"
+#include "hrtimer.h"
+#include "pt.h"
 #include "ina219.h"
 #include "lcd.h"
+#include "limit.h"
 #include "sdram.h"
+#include "task.h"
 #include "timer.h"
+#include "trig.h"
+#include "tstamp.h"
 #include "twi.h"
 #include "util.h"
+#include "workq.h"
+#include "wstat.h"
 #include <assert.h>
 #include <stdlib.h>
 
 
 #define STDOUT_BAUD     460800
 
+#define INA219_MAX      (INA219_ADDR_MAX - INA219_ADDR_MIN + 1)
+
+#define ACQ_RING        ((acq_sample_t *)SDRAM_BASE)
+#define ACQ_RING_SIZE   (SDRAM_SIZE / 2 / sizeof(acq_sample_t)) // first half of SDRAM
+#define ACQ_SENSOR_RING (ACQ_RING_SIZE / INA219_MAX) // samples per sensor
+
+#define TRIG_RING       (ACQ_RING + ACQ_RING_SIZE) // second half of SDRAM
+#define TRIG_SENSOR_RING ACQ_SENSOR_RING
+#define TRIG_LEVEL_UA   500000 // current rising past
+#define TRIG_PRE        64 // samples kept before the trigger
+#define TRIG_POST       192 // and after
+#define TRIG_DUMP_CHUNK 16 // samples copied out at a time
+
+#define LIMIT_GPO       2 // channel of the limit outputs
+#define LIMIT_LOAD_OFF  (1 << 0) // drops the loads, over-current or power
+#define LIMIT_UV_ALARM  (1 << 1)
+#define LIMIT_OC_UA     2000000 // latched, the loads stay off for the hold
+#define LIMIT_OC_HOLD_MS 5000 // then cleared, tripping again if still over
+#define LIMIT_OC_CLR_UA 1800000
+#define LIMIT_OC_DEB    2 // samples
+#define LIMIT_UV_MV     4500
+#define LIMIT_UV_CLR_MV 4750
+#define LIMIT_UV_DEB    4
+#define LIMIT_OP_MW     8000
+#define LIMIT_OP_CLR_MW 7000
+#define LIMIT_OP_DEB    4
+
+#define STAT_WINDOW     WSTAT_WINDOW_MAX // samples, closed each log period first
+#define STAT_EMA_SHIFT  6 // 1/64 weight, about 35 ms at 532 us conversions
+#define FILT_CIC_ORDER  3
+#define FILT_CIC_DECIM  8 // then 2 in the FIR, 1 sample in 16 passed on
+
+#define SAMPLE_PERIOD   TIMEOUT_IN_MS(200)
+#define LCD_PERIOD      TIMEOUT_IN_MS(500)
+#define HB_PERIOD       TIMEOUT_IN_MS(250)
+#define STATS_PERIOD    TIMEOUT_IN_SEC(30)
+#define TRIG_PERIOD     TIMEOUT_IN_MS(100)
+#define LIMIT_PERIOD    TIMEOUT_IN_MS(100)
+
 
 /*
  * Global XIO module for BSP
@@ -24,10 +75,80 @@
 XIOModule xio;
 
 /*
- * LED heartbeat
+ * Tasks run by the main loop
+ */
+static task_t hb_task;
+static task_t sample_task;
+static task_t lcd_task;
+static task_t stats_task;
+static task_t trig_task;
+static task_t limit_task;
+
+/*
+ * Decimation filter of one channel of a sensor and its newest output
  */
-static timer_t hb_timer;
+struct rail_filt {
+    filt_chain_t    chain;
+    filt_cic_t      cic;
+    filt_fir_t      fir;
+    filt_biquad_t   bq;
+    int32_t         hist[2 * ARRAY_SIZE(filt_fir_lp15)];
+    volatile int32_t out;
+};
 
+/*
+ * Limits, running statistics and triggered capture of a sensor, updated
+ * with every sample acquired
+ */
+struct rail_stats {
+    list_t          limits;
+    limit_t         oc;
+    limit_t         uv;
+    limit_t         op;
+    uint64_t        oc_held; // since the over-current trip was seen, or 0
+    wstat_window_t  busv;
+    wstat_window_t  current;
+    wstat_window_t  power;
+    wstat_ema_t     busv_ema;
+    wstat_ema_t     current_ema;
+    wstat_ema_t     power_ema;
+    struct rail_filt current_filt;
+    struct rail_filt power_filt;
+    trig_t          trig;
+};
+
+/*
+ * INA219s found on the bus, their acquisition and statistics
+ */
+static ina219_t ina_devs[INA219_MAX];
+static acq_sensor_t acq_sensors[INA219_MAX];
+static struct rail_stats rail_stats[INA219_MAX];
+static uint8_t ina_count;
+
+/*
+ * Display redraw, written out a transfer at a time by a coroutine
+ */
+static struct lcd_redraw {
+    pt_thread_t     thread;
+    lcd_pt_t        lcd;
+    bool            busy;
+    char            text[2 * LCD_WIDTH + 2]; // two lines and a newline
+} lcd_redraw;
+
+PROF_REGION(ina219_dump_sample);
+
+/*
+ * INA219 sample in engineering units
+ */
+struct data_sample {
+    uint16_t    busv;
+    int32_t     current;
+    int32_t     power;
+};
+
+/*
+ * LED heartbeat
+ */
 static void heartbeat(void *data)
 {
     static uint8_t leds = 0;
@@ -35,71 +156,437 @@ static void heartbeat(void *data)
     LEDS = leds++;
 }
 
-static void ina219_dump_regs(uint8_t i2c_addr)
+static void ina219_dump_regs(ina219_t *dev)
 {
-    uint16_t data;
+    uint16_t data = 0;
     uint8_t i;
 
     xil_printf("                    reg: value\r\n");
     for (i = 0; i < REG_MAX; ++i) {
-        data = ina219_get_reg(i2c_addr, i);
+        ina219_dev_read(dev, i, &data);
         xil_printf("                    % 3d: 0x%04x\r\n", i, data);
     }
 }
 
-static void ina219_dump_sample(void)
+static void rail_filt_init(struct rail_filt *f)
 {
-    uint64_t tick = gcnt_get();
-    struct data_sample {
-        uint16_t    busv;
-        int32_t     shuntv;
-        int32_t     current;
-        int32_t     power;
-    } sample = { 0 };
+    filt_chain_init(&f->chain);
+    filt_cic_init(&f->cic, FILT_CIC_ORDER, FILT_CIC_DECIM);
+    filt_fir_init(&f->fir, filt_fir_lp15, ARRAY_SIZE(filt_fir_lp15), 2, f->hist);
+    filt_biquad_init(&f->bq, &filt_biquad_lp10, 1);
+    filt_chain_add(&f->chain, &f->cic.stage);
+    filt_chain_add(&f->chain, &f->fir.stage);
+    filt_chain_add(&f->chain, &f->bq.stage);
+    f->out = 0;
+}
 
-    sample.busv = ina219_get_busv(INA219_ADDR);
-    sample.shuntv = ina219_get_shuntv(INA219_ADDR);
-    sample.current = ina219_get_current(INA219_ADDR);
-    sample.power = ina219_get_power(INA219_ADDR);
+static void rail_filt_push(struct rail_filt *f, int32_t val)
+{
+    int32_t out;
 
-    lcd_clr();
-    lcd_home();
+    if (filt_push(&f->chain, val, &out))
+        f->out = out;
+}
+
+/*
+ * Add a sample to the statistics of its sensor, runs in the I2C ISR
+ */
+static void rail_stats_update(acq_sensor_t *sensor, const acq_sample_t *sample, void *data)
+{
+    struct rail_stats *st = data;
+    int32_t busv = sample->raw.busv >> 3;
+    int32_t current = (int16_t)sample->raw.current;
+    int32_t power = current < 0 ? -(int32_t)sample->raw.power : sample->raw.power;
+
+    limit_sample(&st->limits, sample);
+    wstat_add(&st->busv, busv);
+    wstat_add(&st->current, current);
+    wstat_add(&st->power, power);
+    wstat_ema_add(&st->busv_ema, busv);
+    wstat_ema_add(&st->current_ema, current);
+    wstat_ema_add(&st->power_ema, power);
+    rail_filt_push(&st->current_filt, current);
+    rail_filt_push(&st->power_filt, power);
+    trig_sample(&st->trig, sample);
+}
+
+static void rail_stats_init(struct rail_stats *st)
+{
+    list_init_head(&st->limits);
+    wstat_tumbling_init(&st->busv, STAT_WINDOW);
+    wstat_tumbling_init(&st->current, STAT_WINDOW);
+    wstat_tumbling_init(&st->power, STAT_WINDOW);
+    wstat_ema_init(&st->busv_ema, STAT_EMA_SHIFT);
+    wstat_ema_init(&st->current_ema, STAT_EMA_SHIFT);
+    wstat_ema_init(&st->power_ema, STAT_EMA_SHIFT);
+    rail_filt_init(&st->current_filt);
+    rail_filt_init(&st->power_filt);
+}
+
+/*
+ * Engineering units to register LSBs of a sensor
+ */
+static int32_t current_to_lsb(const ina219_cal_t *cal, int32_t ua)
+{
+    return (int64_t)ua * 1000000 / cal->current_lsb_pa;
+}
+
+static int32_t busv_to_lsb(int32_t mv)
+{
+    return mv / 4;
+}
+
+static int32_t power_to_lsb(const ina219_cal_t *cal, int32_t mw)
+{
+    return (int64_t)mw * 1000000000 / (20 * (int64_t)cal->current_lsb_pa);
+}
+
+/*
+ * Over-current and over-power drop the loads of every sensor through one
+ * output, under-voltage raises an alarm. Over-current latches, the limit
+ * task clears it after LIMIT_OC_HOLD_MS.
+ */
+static void rail_limits_init(struct rail_stats *st, uint8_t i)
+{
+    const ina219_cal_t *cal = &ina_devs[i].cal;
+    limit_cfg_t cfg = { .id = i, .gpo = LIMIT_GPO };
+
+    cfg.name = "over-current";
+    cfg.source = LIMIT_SRC_CURRENT;
+    cfg.latch = true;
+    cfg.trip = current_to_lsb(cal, LIMIT_OC_UA);
+    cfg.clear = current_to_lsb(cal, LIMIT_OC_CLR_UA);
+    cfg.debounce = LIMIT_OC_DEB;
+    cfg.mask = LIMIT_LOAD_OFF;
+    limit_add(&st->limits, &st->oc, &cfg);
+
+    cfg.name = "under-voltage";
+    cfg.source = LIMIT_SRC_BUSV;
+    cfg.under = true;
+    cfg.latch = false;
+    cfg.trip = busv_to_lsb(LIMIT_UV_MV);
+    cfg.clear = busv_to_lsb(LIMIT_UV_CLR_MV);
+    cfg.debounce = cfg.release = LIMIT_UV_DEB;
+    cfg.mask = LIMIT_UV_ALARM;
+    limit_add(&st->limits, &st->uv, &cfg);
+
+    cfg.name = "over-power";
+    cfg.source = LIMIT_SRC_POWER;
+    cfg.under = false;
+    cfg.trip = power_to_lsb(cal, LIMIT_OP_MW);
+    cfg.clear = power_to_lsb(cal, LIMIT_OP_CLR_MW);
+    cfg.debounce = cfg.release = LIMIT_OP_DEB;
+    cfg.mask = LIMIT_LOAD_OFF;
+    limit_add(&st->limits, &st->op, &cfg);
+}
+
+/*
+ * Moving averages of a sensor in engineering units
+ */
+static bool data_sample_from_ema(struct data_sample *sample, uint8_t i)
+{
+    const ina219_cal_t *cal = &ina_devs[i].cal;
+    int32_t busv, current, power, std;
+
+    if (!wstat_ema_get(&rail_stats[i].busv_ema, INA219_BUSV_SCALE, &busv, &std) ||
+        !wstat_ema_get(&rail_stats[i].current_ema, cal->current_scale, &current, &std) ||
+        !wstat_ema_get(&rail_stats[i].power_ema, cal->power_scale, &power, &std))
+        return false;
+
+    sample->busv = INA219_Q16_MILLI(busv);
+    sample->current = INA219_Q16_MILLI(current);
+    sample->power = INA219_Q16_MILLI(power);
+
+    return true;
+}
+
+/*
+ * Log each sensor's statistics over every sample since the last log and
+ * its newest decimated current and power
+ */
+static void ina219_dump_sample(void *data)
+{
+    PROF_BEGIN(ina219_dump_sample);
+    wstat_result_t busv, current, power;
+    energy_report_t energy;
+    uint8_t i;
+    CRITICAL_STORE;
+
+    for (i = 0; i < ina_count; ++i) {
+        const ina219_cal_t *cal = &ina_devs[i].cal;
+
+        // the same samples in all three windows
+        CRITICAL_START();
+        wstat_close(&rail_stats[i].busv);
+        wstat_close(&rail_stats[i].current);
+        wstat_close(&rail_stats[i].power);
+        CRITICAL_END();
+
+        if (!wstat_get(&rail_stats[i].busv, INA219_BUSV_SCALE, &busv) ||
+            !wstat_get(&rail_stats[i].current, cal->current_scale, &current) ||
+            !wstat_get(&rail_stats[i].power, cal->power_scale, &power)) {
+            log("0x%02x: no samples acquired", ina_devs[i].addr);
+            continue;
+        }
+
+        xil_printf("0x%02x window %d of %d: ", ina_devs[i].addr, rail_stats[i].power.windows, power.count);
+        xil_printf("bus (mV): %d [%d %d] \t", INA219_Q16_MILLI(busv.mean),
+                INA219_Q16_MILLI(busv.min), INA219_Q16_MILLI(busv.max));
+        xil_printf("current (uA): %ld [%ld %ld] rms %ld \t", INA219_Q16_MILLI(current.mean),
+                INA219_Q16_MILLI(current.min), INA219_Q16_MILLI(current.max), INA219_Q16_MILLI(current.rms));
+        xil_printf("power (mW): %ld [%ld %ld] std %ld \t", INA219_Q16_MILLI(power.mean),
+                INA219_Q16_MILLI(power.min), INA219_Q16_MILLI(power.max), INA219_Q16_MILLI(power.std));
+        xil_printf("filtered (uA mW): %ld %ld \t",
+                INA219_Q16_MILLI(FILT_Q16(rail_stats[i].current_filt.out, cal->current_scale)),
+                INA219_Q16_MILLI(FILT_Q16(rail_stats[i].power_filt.out, cal->power_scale)));
+
+        energy_get(&acq_sensors[i].energy, cal, &energy);
+        xil_printf("energy (uWh): %d \t", (int32_t)ENERGY_Q32_SCALE(energy.total_wh, 1000000));
+        xil_printf("charge (uAh): %d\r\n", (int32_t)ENERGY_Q32_SCALE(energy.total_mah, 1000));
+    }
+
+    PROF_END(ina219_dump_sample);
+}
+
+/*
+ * Append an unsigned number to a string, zero padded to digits if not 0
+ */
+static char *str_putui(char *s, uint32_t num, uint8_t digits)
+{
+    char buf[10];
+    uint8_t n = 0;
+
+    do {
+        buf[n++] = '0' + num % 10;
+        num /= 10;
+    } while ((num || n < digits) && n < sizeof(buf));
+
+    while (n)
+        *s++ = buf[--n];
+
+    return s;
+}
 
+/*
+ * Copy a line to the redraw text, padded or cut to the display width
+ */
+static char *lcd_line(char *dst, const char *line, const char *end)
+{
+    uint8_t i;
+
+    for (i = 0; i < LCD_WIDTH; ++i)
+        *dst++ = line + i < end ? line[i] : ' ';
+
+    return dst;
+}
+
+/*
+ * Write the redraw text over the whole display, the lines are padded so
+ * nothing needs clearing first
+ */
+static PT_THREAD(lcd_redraw_pt(struct pt *pt, void *data))
+{
+    struct lcd_redraw *r = data;
+
+    PT_BEGIN(pt);
+
+    r->lcd.ln = 0;
+    r->lcd.ch = 0;
+    PT_SPAWN(pt, &r->lcd.pt, lcd_move_pt(&r->lcd));
+
+    r->lcd.s = r->text;
+    PT_SPAWN(pt, &r->lcd.pt, lcd_puts_pt(&r->lcd));
+
+    r->busy = false;
+
+    PT_END(pt);
+}
+
+/*
+ * Format the first sensor's sample and hand it to the redraw coroutine, a
+ * redraw still in progress is left to finish
+ */
+static void lcd_show_sample(void *data)
+{
+    struct data_sample sample;
+    char line[32], *s, *t;
+
+    // the first sensor found is shown, smoothed over recent samples
+    if (ina_count == 0 || lcd_redraw.busy || !data_sample_from_ema(&sample, 0))
+        return;
+
+    s = line;
     uint16_t vw = sample.busv / 1000;
     uint16_t vd = sample.busv / 100 - (vw * 10);
-    lcd_putui(vw, 0);
-    lcd_putch('.');
-    lcd_putui(vd, 1);
-    lcd_putch(' ');
-    lcd_putch('V');
-    lcd_putch(' ');
+    s = str_putui(s, vw, 0);
+    *s++ = '.';
+    s = str_putui(s, vd, 1);
+    *s++ = ' ';
+    *s++ = 'V';
+    *s++ = ' ';
 
     int32_t pw = sample.power / 1000;
     uint32_t pd = abs(sample.power - (pw * 1000));
     if (sample.power < 0)
-        lcd_putch('-');
-    lcd_putui(pw, 0);
-    lcd_putch('.');
-    lcd_putui(pd, 3);
-    lcd_putch(' ');
-    lcd_putch('m');
-    lcd_putch('W');
-    lcd_putch('\n');
-
+        *s++ = '-';
+    s = str_putui(s, abs(pw), 0);
+    *s++ = '.';
+    s = str_putui(s, pd, 3);
+    *s++ = ' ';
+    *s++ = 'm';
+    *s++ = 'W';
+    t = lcd_line(lcd_redraw.text, line, s);
+    *t++ = '\n';
+
+    s = line;
     int32_t iw = sample.current / 1000000;
     uint32_t id = abs(sample.current / 100 - (iw * 10000));
     if (sample.current < 0)
-        lcd_putch('-');
-    lcd_putui(iw, 0);
-    lcd_putch('.');
-    lcd_putui(id, 4);
-    lcd_putch(' ');
-    lcd_putch('A');
+        *s++ = '-';
+    s = str_putui(s, abs(iw), 0);
+    *s++ = '.';
+    s = str_putui(s, id, 4);
+    *s++ = ' ';
+    *s++ = 'A';
+    t = lcd_line(t, line, s);
+    *t = '\0';
+
+    lcd_redraw.busy = true;
+    pt_sched_start(&lcd_redraw.thread, lcd_redraw_pt, &lcd_redraw);
+}
+
+/*
+ * Log each sensor's energy, charge and peak power since the last stats
+ * dump and start a new epoch
+ */
+static void dump_energy(void)
+{
+    energy_report_t energy;
+    uint8_t i;
+
+    for (i = 0; i < ina_count; ++i) {
+        energy_get(&acq_sensors[i].energy, &ina_devs[i].cal, &energy);
+        energy_epoch(&acq_sensors[i].energy);
 
-    xil_printf("0x%06x%08x: bus (mV): %d \t", (uint32_t)(tick>>32), (uint32_t)tick, sample.busv);
-    xil_printf("shunt (uV): %ld   \t", sample.shuntv);
-    xil_printf("current (uA): %ld \t", sample.current);
-    xil_printf("power (mW): %ld\r\n", sample.power);
+        log("0x%02x epoch of %d ms energy (uWh): %d charge (uAh): %d peak (mW): %d",
+                ina_devs[i].addr, (uint32_t)(energy.epoch_clks / (GCNT_TICKS_PER_US * 1000)),
+                (int32_t)ENERGY_Q32_SCALE(energy.epoch_wh, 1000000),
+                (int32_t)ENERGY_Q32_SCALE(energy.epoch_mah, 1000),
+                INA219_Q16_MILLI(energy.epoch_peak_w));
+    }
+}
+
+/*
+ * Dump each record captured around a trigger in bulk and release it
+ */
+static void trig_dump(void *data)
+{
+    acq_sample_t buf[TRIG_DUMP_CHUNK];
+    trig_record_t rec;
+    ina219_meas_t meas;
+    uint32_t off, n, k;
+    int32_t dt;
+    uint8_t i;
+
+    for (i = 0; i < ina_count; ++i) {
+        trig_t *t = &rail_stats[i].trig;
+
+        while (trig_get(t, &rec)) {
+            log("0x%02x trigger at 0x%06x%08x: %d samples, %d before", ina_devs[i].addr,
+                    (uint32_t)(rec.tstamp >> 32), (uint32_t)rec.tstamp, rec.count, rec.trigger - rec.start);
+
+            for (off = 0; (n = trig_copy(t, &rec, off, buf, TRIG_DUMP_CHUNK)) != 0; off += n) {
+                for (k = 0; k < n; ++k) {
+                    ina219_measure(&ina_devs[i].cal, &buf[k].raw, &meas);
+                    dt = buf[k].tstamp - rec.tstamp;
+                    xil_printf("%c%d us: %ld uA %ld mW\r\n", dt < 0 ? '-' : '+',
+                            tstamp_cycles_to_us(dt < 0 ? -dt : dt),
+                            INA219_Q16_MILLI(meas.current), INA219_Q16_MILLI(meas.power));
+                }
+            }
+
+            trig_release(t);
+        }
+    }
+}
+
+/*
+ * Log limit trips and clears with the time the sample took to detect and
+ * the time from then to the output, and clear latched over-currents held
+ * for LIMIT_OC_HOLD_MS
+ */
+static void limit_log(void *data)
+{
+    limit_event_t ev;
+    uint64_t now;
+    uint8_t i;
+
+    while (limit_get_event(&ev)) {
+        log("0x%02x %s %s at 0x%06x%08x: %d lsb, detect %d us, output %d ns",
+                ina_devs[ev.limit->cfg.id].addr, ev.limit->cfg.name, ev.trip ? "trip" : "clear",
+                (uint32_t)(ev.tstamp >> 32), (uint32_t)ev.tstamp, ev.val,
+                tstamp_cycles_to_us(ev.detect_clks), (uint32_t)tstamp_cycles_to_ns(ev.output_clks));
+    }
+
+    now = gcnt_get();
+    for (i = 0; i < ina_count; ++i) {
+        struct rail_stats *st = &rail_stats[i];
+
+        if (!st->oc.tripped) {
+            st->oc_held = 0;
+        } else if (st->oc_held == 0) {
+            st->oc_held = now;
+        } else if (tstamp_to_ms(now - st->oc_held) >= LIMIT_OC_HOLD_MS) {
+            log("0x%02x %s held %d ms, clearing", ina_devs[i].addr, st->oc.cfg.name, LIMIT_OC_HOLD_MS);
+            st->oc_held = 0;
+            limit_clear(&st->oc);
+        }
+    }
+}
+
+static void dump_limit_stats(void)
+{
+    limit_stats_t stats;
+    limit_t *limits[3];
+    uint8_t i, k;
+
+    for (i = 0; i < ina_count; ++i) {
+        limits[0] = &rail_stats[i].oc;
+        limits[1] = &rail_stats[i].uv;
+        limits[2] = &rail_stats[i].op;
+        for (k = 0; k < ARRAY_SIZE(limits); ++k) {
+            limit_get_stats(limits[k], &stats);
+            log("0x%02x %s %s trips: %d clears: %d max detect: %d us max output: %d ns",
+                    ina_devs[i].addr, limits[k]->cfg.name, limits[k]->tripped ? "tripped" : "ok",
+                    stats.trips, stats.clears,
+                    tstamp_cycles_to_us(stats.max_detect_clks),
+                    (uint32_t)tstamp_cycles_to_ns(stats.max_output_clks));
+        }
+    }
+    log("limit events dropped: %d", limit_events_dropped());
+}
+
+static void dump_trig_stats(void)
+{
+    trig_stats_t stats;
+    uint8_t i;
+
+    for (i = 0; i < ina_count; ++i) {
+        trig_get_stats(&rail_stats[i].trig, &stats);
+        log("0x%02x triggers: %d missed: %d lost: %d", ina_devs[i].addr,
+                stats.triggers, stats.missed, stats.lost);
+    }
+}
+
+static void dump_stats(void *data)
+{
+    task_dump_stats();
+    acq_stats_dump();
+    dump_energy();
+    dump_limit_stats();
+    dump_trig_stats();
+    twi_stats_dump();
+    prof_dump();
 }
 
 /*
@@ -113,6 +600,10 @@ static int mb_init(void)
     if (rv != XST_SUCCESS)
         return -1;
 
+    rv = XIOModule_Timer_Initialize(&xio, XPAR_IOMODULE_0_DEVICE_ID);
+    if (rv != XST_SUCCESS)
+        return -1;
+
     rv = XIOModule_SetBaudRate(&xio, STDOUT_BAUD);
     if (rv != XST_SUCCESS)
         return -1;
@@ -123,11 +614,12 @@ static int mb_init(void)
     microblaze_register_handler(XIOModule_DeviceInterruptHandler, XPAR_IOMODULE_0_DEVICE_ID);
     XIOModule_Start(&xio);
 
-    // initialize timer services
+    // initialize deferred work, timer and task services
+    workq_init();
     timer_svc_init();
-
-    timer_init(&hb_timer, TIMER_PERIODIC, heartbeat, NULL);
-    timer_set(&hb_timer, TIMEOUT_IN_MS(250));
+    hrtimer_svc_init();
+    task_svc_init();
+    pt_sched_init();
 
     twi_init(&xio);
 
@@ -139,34 +631,72 @@ static int mb_init(void)
 
 int main()
 {
+    trig_cond_t trig_cond = { .source = TRIG_SRC_CURRENT, .type = TRIG_EDGE_RISE };
     bool status;
+    uint8_t i;
     uint32_t *sdram = (uint32_t *)SDRAM_BASE;
 
     assert(mb_init() == XST_SUCCESS);
     log("MicroBlaze CPU/IO Freq: %d MHz", XPAR_MICROBLAZE_FREQ/1000000UL);
     log("mbsoc starting...");
 
+#ifdef CONFIG_BENCH
+    tstamp_bench();
+    filt_bench();
+#endif
+
     lcd_init();
     lcd_config(LCD_CFG_BACKLIGHT_ON | LCD_CFG_DISPLAY_ON);
     lcd_clr();
     lcd_puts("ram test...");
+    lcd_pt_init(&lcd_redraw.lcd);
 
     sdram_pattern_test(sdram, SDRAM_SIZE);
     sdram_rand_d_test(sdram, SDRAM_SIZE, 1);
     sdram_rand_da_test(sdram, SDRAM_SIZE, 1);
 
-    status = ina219_init(INA219_ADDR);
-    log("ina219_init %s", status ? "success" : "failed");
-    ina219_dump_regs(INA219_ADDR);
+    ina_count = ina219_scan(NULL, ina_devs, INA219_MAX);
+    log("ina219_scan found %d", ina_count);
+    for (i = 0; i < ina_count; ++i) {
+        status = ina219_dev_setup(&ina_devs[i]);
+        log("ina219 0x%02x setup %s", ina_devs[i].addr, status ? "success" : "failed");
+        ina219_dump_regs(&ina_devs[i]);
+    }
 
     //sdram_rand_log_err_counts(sdram, SDRAM_SIZE);
 
-    log("system init complete");
-    while (true)
-    {
-        ina219_dump_sample();
-        delay_ms(200);
+    task_init(&hb_task, "heartbeat", WORKQ_PRIO_HIGH, heartbeat, NULL);
+    task_init(&sample_task, "sample", WORKQ_PRIO_NORMAL, ina219_dump_sample, NULL);
+    task_init(&lcd_task, "lcd", WORKQ_PRIO_LOW, lcd_show_sample, NULL);
+    task_init(&stats_task, "stats", WORKQ_PRIO_LOW, dump_stats, NULL);
+    task_init(&trig_task, "trig", WORKQ_PRIO_LOW, trig_dump, NULL);
+    task_init(&limit_task, "limit", WORKQ_PRIO_NORMAL, limit_log, NULL);
+
+    task_set_period(&hb_task, HB_PERIOD);
+    task_set_period(&sample_task, SAMPLE_PERIOD);
+    task_set_period(&lcd_task, LCD_PERIOD);
+    task_set_period(&stats_task, STATS_PERIOD);
+    task_set_period(&trig_task, TRIG_PERIOD);
+    task_set_period(&limit_task, LIMIT_PERIOD);
+
+    // samples go to the SDRAM ring and the statistics the tasks above show
+    limit_svc_init();
+    acq_init();
+    for (i = 0; i < ina_count; ++i) {
+        acq_add(&acq_sensors[i], &ina_devs[i], ACQ_RING + i * ACQ_SENSOR_RING, ACQ_SENSOR_RING);
+        rail_stats_init(&rail_stats[i]);
+        rail_limits_init(&rail_stats[i], i);
+        trig_init(&rail_stats[i].trig, TRIG_RING + i * TRIG_SENSOR_RING, TRIG_SENSOR_RING);
+        trig_cond.lo = current_to_lsb(&ina_devs[i].cal, TRIG_LEVEL_UA);
+        trig_arm(&rail_stats[i].trig, &trig_cond, TRIG_PRE, TRIG_POST);
+        acq_set_sample_fn(&acq_sensors[i], rail_stats_update, &rail_stats[i]);
     }
+    status = acq_start(0);
+    log("acquisition of %d sensors at %d us conversions %s", ina_count,
+            ina219_conv_us(INA219_CONFIG), status ? "started" : "failed");
+
+    log("system init complete");
+    task_loop();
 
     return 0;
 }
@@ -9,6 +9,7 @@
 
 #include "xparameters.h"
 #include "xiomodule.h"
+#include "pit.h"
 
 #include <stdbool.h>
 #include <stdint.h>